@@ -0,0 +1,252 @@
+#include "asyncquery.h"
+#include <queryprofiler.h>
+
+AsyncQueryQueue::AsyncQueryQueue(Database* _db) :
+    QObject(nullptr), db(_db) {}
+
+
+DbTask <PgResult> AsyncQueryQueue::enqueue(const QString& queryText, const QVector <QVariant>& params, DbCancelToken token)
+{
+    Pending p {nextId++, queryText, params, DbTask <PgResult>(), token, -1};
+    if (token.isCanceled())
+    {
+        p.task.setError(std::make_exception_ptr(DbCanceledException("Запрос отменен")));
+        return p.task;
+    }
+    quint64 id = p.id;
+    p.cancelCallback = p.token.onCancel([this, id]() {cancel(id);});
+    queue.enqueue(p);
+    if (!running)
+    {
+        startNext();
+    }
+    return p.task;
+}
+
+void AsyncQueryQueue::startNext()
+{
+    while (!running && !queue.isEmpty())
+    {
+        Pending next = queue.dequeue();
+        PGconn* conn = nullptr;
+        try
+        {
+            db->checkConnection();
+            conn = Database::rawConnection(db->getQSqlDatabase());
+            if (conn == nullptr)
+            {
+                throw DbException("Драйвер не предоставляет подключение libpq");
+            }
+        }
+        catch (std::exception&)
+        {
+            next.token.removeCallback(next.cancelCallback);
+            next.task.setError(std::current_exception());
+            continue;
+        }
+
+        if (conn != rawConn || !readNotifier)
+        {
+            // после переподключения у libpq новый сокет
+            resetNotifiers();
+            rawConn = conn;
+            readNotifier.reset(new QSocketNotifier(PQsocket(rawConn), QSocketNotifier::Read));
+            writeNotifier.reset(new QSocketNotifier(PQsocket(rawConn), QSocketNotifier::Write));
+            connect(readNotifier.data(), &QSocketNotifier::activated, this, [this]() {readResults();});
+            connect(writeNotifier.data(), &QSocketNotifier::activated, this, [this]() {flushOutput();});
+        }
+
+        QVector <QByteArray> values;
+        QVector <const char*> valuePtrs;
+        values.reserve(next.params.size());
+        for (const auto& i : next.params)
+        {
+            values.append(Database::toPgText(i));
+            valuePtrs.append(values.last().isNull() ? nullptr : values.last().constData());
+        }
+        PQsetnonblocking(rawConn, 1);
+        if (PQsendQueryParams(rawConn, next.text.toUtf8().constData(), next.params.size(), nullptr,
+                              valuePtrs.constData(), nullptr, nullptr, 0) != 1)
+        {
+            QString error = PQerrorMessage(rawConn);
+            PQsetnonblocking(rawConn, 0);
+            next.token.removeCallback(next.cancelCallback);
+            next.task.setError(std::make_exception_ptr(DbException(error.toStdString())));
+            continue;
+        }
+        current = next;
+        currentCanceled = false;
+        currentResult.reset();
+        currentError.clear();
+        running = true;
+        deadline.reset(new QueryDeadline(db->getConnId(), db->getQueryTimeout()));
+        if (QueryProfiler::isEnabled())
+        {
+            profileClock.start();
+        }
+        readNotifier->setEnabled(true);
+        flushOutput();
+    }
+}
+
+void AsyncQueryQueue::readResults()
+{
+    if (!running)
+    {
+        return;
+    }
+    if (PQconsumeInput(rawConn) != 1)
+    {
+        currentError = PQerrorMessage(rawConn);
+        complete();
+        return;
+    }
+    while (running && !PQisBusy(rawConn))
+    {
+        PGresult* res = PQgetResult(rawConn);
+        if (res == nullptr)
+        {
+            complete();
+            return;
+        }
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
+        {
+            currentResult = PgResult(res, PQclear);
+        }
+        else
+        {
+            currentError = PQresultErrorMessage(res);
+            PQclear(res);
+        }
+    }
+}
+
+void AsyncQueryQueue::flushOutput()
+{
+    if (!running)
+    {
+        return;
+    }
+    int flushResult = PQflush(rawConn);
+    if (flushResult == -1)
+    {
+        currentError = PQerrorMessage(rawConn);
+        complete();
+        return;
+    }
+    writeNotifier->setEnabled(flushResult == 1);
+}
+
+void AsyncQueryQueue::complete()
+{
+    running = false;
+    deadline.reset();
+    readNotifier->setEnabled(false);
+    writeNotifier->setEnabled(false);
+    PQsetnonblocking(rawConn, 0);
+
+    Pending done = current;
+    current = Pending();
+    done.token.removeCallback(done.cancelCallback);
+    bool timedOut = db->takeTimedOut();
+    if (QueryProfiler::isEnabled() && profileClock.isValid())
+    {
+        QueryProfiler::record(done.text, profileClock.nsecsElapsed() / 1000,
+                              currentError.isEmpty() ? Database::affectedRows(currentResult.data()) : 0, !currentError.isEmpty());
+        profileClock.invalidate();
+    }
+    if (currentError.isEmpty())
+    {
+        done.task.setValue(currentResult);
+    }
+    else
+    {
+        if (!db->outsideTransaction && PQtransactionStatus(rawConn) == PQTRANS_INERROR)
+        {
+            try
+            {
+                db->cancelTransaction();
+            }
+            catch (std::exception&) {}
+        }
+        std::exception_ptr error;
+        if (timedOut)
+        {
+            error = std::make_exception_ptr(DbTimeoutException("Превышено время выполнения запроса: " + currentError.toStdString()));
+        }
+        else if (currentCanceled)
+        {
+            error = std::make_exception_ptr(DbCanceledException("Запрос отменен: " + currentError.toStdString()));
+        }
+        else
+        {
+            error = std::make_exception_ptr(DbException(currentError.toStdString()));
+        }
+        done.task.setError(error);
+    }
+    currentResult.reset();
+    // продолжение задачи могло уже поставить и запустить следующий запрос
+    startNext();
+}
+
+void AsyncQueryQueue::cancel(quint64 id)
+{
+    if (running && current.id == id)
+    {
+        // результат придет с ошибкой отмены от сервера
+        currentCanceled = true;
+        QString error;
+        Database::cancelRawQuery(db->getDb(), error);
+        return;
+    }
+    for (auto it = queue.begin(); it != queue.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            Pending p = *it;
+            queue.erase(it);
+            p.task.setError(std::make_exception_ptr(DbCanceledException("Запрос отменен")));
+            return;
+        }
+    }
+}
+
+// может вызываться из обработчика сигнала уведомителя, поэтому deleteLater
+void AsyncQueryQueue::resetNotifiers()
+{
+    if (readNotifier)
+    {
+        readNotifier->setEnabled(false);
+        readNotifier.take()->deleteLater();
+    }
+    if (writeNotifier)
+    {
+        writeNotifier->setEnabled(false);
+        writeNotifier.take()->deleteLater();
+    }
+}
+
+AsyncQueryQueue::~AsyncQueryQueue()
+{
+    if (running)
+    {
+        // дочитываем ответ отмененного запроса, чтобы подключение осталось пригодным
+        QString error;
+        Database::cancelRawQuery(db->getDb(), error);
+        PQsetnonblocking(rawConn, 0);
+        while (PGresult* res = PQgetResult(rawConn))
+        {
+            PQclear(res);
+        }
+        running = false;
+        current.token.removeCallback(current.cancelCallback);
+        current.task.setError(std::make_exception_ptr(DbCanceledException("Подключение закрыто")));
+    }
+    while (!queue.isEmpty())
+    {
+        Pending p = queue.dequeue();
+        p.token.removeCallback(p.cancelCallback);
+        p.task.setError(std::make_exception_ptr(DbCanceledException("Подключение закрыто")));
+    }
+}
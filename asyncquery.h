@@ -0,0 +1,78 @@
+#ifndef ASYNCQUERY_H
+#define ASYNCQUERY_H
+
+#include <QObject>
+#include <QQueue>
+#include <QSocketNotifier>
+#include <QScopedPointer>
+#include <QElapsedTimer>
+#include <database.h>
+#include <dbtask.h>
+
+// неблокирующее выполнение запросов на подключении Database через сокет libpq
+// и цикл событий потока подключения: поток не ждет ответа сервера.
+// Запросы одного подключения выполняются по очереди в порядке поступления.
+// Пока запрос выполняется, синхронные запросы Database на этом подключении бросают DbException
+class AsyncQueryQueue : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AsyncQueryQueue(Database* _db);
+
+    AsyncQueryQueue(const AsyncQueryQueue&)                   = delete;
+
+    AsyncQueryQueue(AsyncQueryQueue&& )                       = delete;
+
+    AsyncQueryQueue& operator=(const AsyncQueryQueue&)        = delete;
+
+    AsyncQueryQueue& operator=(AsyncQueryQueue&&)             = delete;
+
+    DbTask <PgResult> enqueue(const QString& queryText, const QVector <QVariant>& params, DbCancelToken token);
+
+    qint32 pendingCount() const {return queue.size() + (running ? 1 : 0);}
+
+    // запрос отправлен и ответ еще не прочитан: подключение нельзя использовать синхронно
+    bool isRunning() const {return running;}
+
+    ~AsyncQueryQueue();
+
+private:
+    struct Pending
+    {
+        quint64 id;
+        QString text;
+        QVector <QVariant> params;
+        DbTask <PgResult> task;
+        DbCancelToken token;
+        qint32 cancelCallback;
+    };
+
+    void startNext();
+
+    void readResults();
+
+    void flushOutput();
+
+    void complete();
+
+    void cancel(quint64 id);
+
+    void resetNotifiers();
+
+    Database* db;
+    PGconn* rawConn = nullptr;
+    QQueue <Pending> queue;
+    Pending current;
+    bool running = false;
+    bool currentCanceled = false;
+    quint64 nextId = 1;
+    PgResult currentResult;
+    QString currentError;
+    QScopedPointer <QueryDeadline> deadline;
+    // время выполнения текущего запроса для QueryProfiler
+    QElapsedTimer profileClock;
+    QScopedPointer <QSocketNotifier> readNotifier;
+    QScopedPointer <QSocketNotifier> writeNotifier;
+};
+
+#endif // ASYNCQUERY_H
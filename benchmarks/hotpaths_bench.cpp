@@ -0,0 +1,190 @@
+#include <QtTest>
+#include <database.h>
+#include <utility.h>
+#include <typedrecord.h>
+#include <queryprofiler.h>
+#include <modifiedfilesystemwatcher.h>
+
+// доступ замеров к построению текста запросов, скрытому от пользователей Database
+class QueryTextProbe : public Database
+{
+public:
+    using Database::insertQueryText;
+    using Database::updateQueryText;
+};
+
+// замеры не обращаются к БД и файловой системе: только разбор снимков и построение текста запросов
+class HotPathBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void diffEntries_data();
+    void diffEntries();
+
+    void insertQueryText();
+    void updateQueryText();
+    void typedUpdate();
+
+    void translate_data();
+    void translate();
+
+    void insertValue();
+
+    void parentPath();
+
+    void fingerprint();
+
+private:
+    static DbRecord pathRecord();
+};
+
+
+static QStringList makeEntries(qint32 count)
+{
+    QStringList entries;
+    entries.reserve(count);
+    for (qint32 i = 0; i < count; i++)
+    {
+        entries.append(QString("2021-03-%1_Съемка_%2").arg(i % 28 + 1, 2, 10, QChar('0')).arg(i));
+    }
+    return entries;
+}
+
+struct PathUpdate : TypedRecord <PathUpdate, SetColumn <QString>, SetColumn <QDateTime>, KeyColumn <qint32>>
+{
+    using TypedRecord::TypedRecord;
+
+    static const char* const* columnNames()
+    {
+        static const char* const names[] = {"filepath", "datetime", "id"};
+        return names;
+    }
+};
+
+DbRecord HotPathBenchmark::pathRecord()
+{
+    DbRecord rec;
+    rec.insertValue("filepath", "//Camera20/DATA/Иванов/2021-03-01_Съемка_1/");
+    rec.insertValue("datetime", QDateTime::currentDateTime());
+    rec.insertValue("username", "Иванов Петр");
+    rec.insertValue("id", 12345);
+    rec.setGenerated("id", true);
+    return rec;
+}
+
+
+void HotPathBenchmark::diffEntries_data()
+{
+    QTest::addColumn <qint32> ("count");
+    QTest::newRow("10") << 10;
+    QTest::newRow("1k") << 1000;
+    QTest::newRow("100k") << 100000;
+}
+
+// типичное событие: одно переименование в каталоге
+void HotPathBenchmark::diffEntries()
+{
+    QFETCH(qint32, count);
+    QStringList oldEntries = makeEntries(count);
+    QStringList newEntries = oldEntries;
+    newEntries[count / 2] = "renamed";
+    DirectoryDiff diff;
+    QBENCHMARK
+    {
+        diff = ModifiedFileSystemWatcher::diffEntries(oldEntries, newEntries);
+    }
+    QCOMPARE(diff.added.size(), 1);
+    QCOMPARE(diff.deleted.size(), 1);
+}
+
+void HotPathBenchmark::insertQueryText()
+{
+    DbRecord rec = pathRecord();
+    QString text;
+    QBENCHMARK
+    {
+        text = QueryTextProbe::insertQueryText(rec, "testing.life_cycle_e", QString(), false);
+    }
+    QVERIFY(!text.isEmpty());
+}
+
+void HotPathBenchmark::updateQueryText()
+{
+    DbRecord rec = pathRecord();
+    QString text;
+    QBENCHMARK
+    {
+        text = QueryTextProbe::updateQueryText(rec, "testing.life_cycle_e", false);
+    }
+    QVERIFY(text.contains("WHERE"));
+}
+
+// то же обновление, что updateQueryText + insertValue, но с записью постоянного состава
+void HotPathBenchmark::typedUpdate()
+{
+    QByteArray text;
+    PathUpdate::Params params;
+    QBENCHMARK
+    {
+        PathUpdate rec("//Camera20/DATA/Иванов/2021-03-01_Съемка_1/", QDateTime::currentDateTime(), 12345);
+        text = PathUpdate::updateText("testing.life_cycle_e");
+        params = rec.params();
+    }
+    QVERIFY(text.contains("WHERE id = $3"));
+    QCOMPARE(params[2], QByteArray("12345"));
+}
+
+void HotPathBenchmark::translate_data()
+{
+    QTest::addColumn <QString> ("text");
+    QTest::newRow("username") << QString("Щербаков Юрий Ильич");
+    QTest::newRow("path") << QString("//Camera20/DATA/Щербаков/2021-03-01_Съемка_звезды/кадр_0001.raw");
+}
+
+void HotPathBenchmark::translate()
+{
+    QFETCH(QString, text);
+    QString result;
+    QBENCHMARK
+    {
+        result = Utility::translate(text);
+    }
+    QVERIFY(!result.isEmpty());
+}
+
+void HotPathBenchmark::insertValue()
+{
+    QBENCHMARK
+    {
+        DbRecord rec = pathRecord();
+        Q_UNUSED(rec);
+    }
+}
+
+void HotPathBenchmark::parentPath()
+{
+    QString parent;
+    QBENCHMARK
+    {
+        parent = ModifiedFileSystemWatcher::parentPath("//Camera20/DATA/Иванов/2021-03-01_Съемка_1/");
+    }
+    QCOMPARE(parent, QString("//Camera20/DATA/Иванов"));
+}
+
+// запрос с литералами, как его собирает QString::arg
+void HotPathBenchmark::fingerprint()
+{
+    const QString query = "SELECT id, filepath FROM testing.life_cycle_e WHERE id IN (1, 2, 3) "
+                          "AND filepath = '//Camera20/DATA/Иванов/2021-03-01_Съемка_1/' AND datetime > 2021";
+    QString result;
+    QBENCHMARK
+    {
+        result = QueryProfiler::fingerprint(query);
+    }
+    QCOMPARE(result, QString("SELECT id, filepath FROM testing.life_cycle_e WHERE id IN (?) "
+                             "AND filepath = ? AND datetime > ?"));
+}
+
+QTEST_GUILESS_MAIN(HotPathBenchmark)
+#include "hotpaths_bench.moc"
@@ -20,6 +20,20 @@ private:
     std::string whatStr;
 };
 
+// запрос отменен по истечении срока выполнения
+class DbTimeoutException : public DbException
+{
+public:
+    DbTimeoutException(const std::string &whatStr) noexcept : DbException(whatStr) { }
+};
+
+// запрос отменен через DbCancelToken
+class DbCanceledException : public DbException
+{
+public:
+    DbCanceledException(const std::string &whatStr) noexcept : DbException(whatStr) { }
+};
+
 
 class ThreadDbException : public QtConcurrent::Exception
 {
@@ -0,0 +1,126 @@
+#include "connectionpool.h"
+
+DbConnectionPool::DbConnectionPool(const ConnectionData& cData, qint32 maxConnections, QObject* parent) :
+    QObject(parent), connData(cData), maxConn(maxConnections), available(maxConnections) {}
+
+
+QSharedPointer <DbFileWatcher> DbConnectionPool::acquire()
+{
+    return takeConnection(-1);
+}
+
+QSharedPointer <DbFileWatcher> DbConnectionPool::tryAcquire(qint32 timeout)
+{
+    return takeConnection(timeout);
+}
+
+bool DbConnectionPool::reserveSlot(qint32 timeout)
+{
+    if (available.tryAcquire())
+    {
+        return true;
+    }
+    // места заняты, в том числе свободными подключениями других потоков: одно из них закрывается
+    // в своем потоке, место освобождается при его удалении. Попытка без ожидания никого не вытесняет
+    if (timeout != 0)
+    {
+        mutex.lock();
+        if (!idle.isEmpty())
+        {
+            auto it = idle.begin();
+            DbFileWatcher* evicted = it.value();
+            idle.erase(it);
+            connect(evicted, &QObject::destroyed, this, [this]() {available.release();}, Qt::DirectConnection);
+            evicted->deleteLater();
+        }
+        mutex.unlock();
+    }
+    if (timeout < 0)
+    {
+        available.acquire();
+        return true;
+    }
+    return available.tryAcquire(1, timeout);
+}
+
+QSharedPointer <DbFileWatcher> DbConnectionPool::takeConnection(qint32 timeout)
+{
+    QThread* current = QThread::currentThread();
+    DbFileWatcher* conn = nullptr;
+    mutex.lock();
+    auto it = idle.find(current);
+    if (it != idle.end())
+    {
+        conn = it.value();
+        idle.erase(it);
+    }
+    else if (!knownThreads.contains(current))
+    {
+        // подключения потока закрываем в нем же, когда поток завершается
+        knownThreads.insert(current);
+        connect(current, &QThread::finished, this, [this, current]() {dropThreadConnections(current);}, Qt::DirectConnection);
+    }
+    mutex.unlock();
+    // свободное подключение потока свое место уже занимает
+    if (conn == nullptr && !reserveSlot(timeout))
+    {
+        return QSharedPointer <DbFileWatcher>();
+    }
+
+    try
+    {
+        if (conn == nullptr)
+        {
+            conn = new DbFileWatcher();
+            if (replicaEnabled)
+            {
+                conn->setReplica(replicaData, maxReplicaLag);
+            }
+        }
+        conn->setQueryTimeout(queryTimeout);
+        conn->setStandbyEnabled(standbyEnabled);
+        if (!conn->isConnected())
+        {
+            conn->connectDb(connData);
+        }
+    }
+    catch (std::exception&)
+    {
+        delete conn;
+        available.release();
+        throw;
+    }
+    return QSharedPointer <DbFileWatcher>(conn, [this](DbFileWatcher* c) {release(c);});
+}
+
+void DbConnectionPool::release(DbFileWatcher* conn)
+{
+    // подписчики прежнего владельца не должны получать ошибки следующего
+    QObject::disconnect(conn, &DbFileWatcher::errorOccured, nullptr, nullptr);
+    QObject::disconnect(conn, &Database::connectionLost, nullptr, nullptr);
+    QObject::disconnect(conn, &Database::connectionRestored, nullptr, nullptr);
+    QObject::disconnect(conn, &Database::readRoutingChanged, nullptr, nullptr);
+    // место остается за подключением, пока оно открыто
+    mutex.lock();
+    idle.insert(conn->thread(), conn);
+    mutex.unlock();
+}
+
+void DbConnectionPool::dropThreadConnections(QThread* thread)
+{
+    mutex.lock();
+    QList <DbFileWatcher*> conns = idle.values(thread);
+    idle.remove(thread);
+    knownThreads.remove(thread);
+    mutex.unlock();
+    qDeleteAll(conns);
+    available.release(conns.size());
+}
+
+DbConnectionPool::~DbConnectionPool()
+{
+    mutex.lock();
+    qDeleteAll(idle);
+    idle.clear();
+    mutex.unlock();
+}
@@ -0,0 +1,84 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <QObject>
+#include <QMutex>
+#include <QSemaphore>
+#include <QMultiHash>
+#include <QSet>
+#include <QSharedPointer>
+#include <QThread>
+#include <dbfilewatcher.h>
+
+// общий пул подключений к БД для всех потоков сервиса.
+// QSqlDatabase можно использовать только в создавшем его потоке, поэтому
+// свободные подключения хранятся отдельно для каждого потока,
+// а общее число открытых подключений, занятых и свободных, ограничено maxConnections.
+// Когда места нет, свободное подключение другого потока закрывается в его потоке (deleteLater)
+class DbConnectionPool : public QObject
+{
+    Q_OBJECT
+public:
+    DbConnectionPool(const ConnectionData& cData, qint32 maxConnections, QObject* parent = nullptr);
+
+    DbConnectionPool(const DbConnectionPool&)                   = delete;
+
+    DbConnectionPool(DbConnectionPool&& )                       = delete;
+
+    DbConnectionPool& operator=(const DbConnectionPool&)        = delete;
+
+    DbConnectionPool& operator=(DbConnectionPool&&)             = delete;
+
+    // блокируется, пока не освободится подключение; подключение возвращается в пул при удалении указателя
+    QSharedPointer <DbFileWatcher> acquire();
+
+    // то же, но с ограничением ожидания; при неудаче возвращает пустой указатель
+    QSharedPointer <DbFileWatcher> tryAcquire(qint32 timeout);
+
+    const ConnectionData& getConnData() const {return connData;}
+
+    qint32 getMaxConnections() const {return maxConn;}
+
+    // срок выполнения запросов по умолчанию для всех подключений пула, мс
+    void setQueryTimeout(qint32 timeout) {queryTimeout = timeout;}
+
+    // у каждого подключения пула заранее открыто резервное (см. Database::setStandbyEnabled);
+    // число подключений к серверу удваивается
+    void setStandbyEnabled(bool enabled) {standbyEnabled = enabled;}
+
+    // реплика для чтения у каждого подключения пула (см. Database::setReplica); задать до первого acquire
+    void setReplica(const ConnectionData& _replicaData, qint32 _maxReplicaLag)
+    {
+        replicaData = _replicaData;
+        maxReplicaLag = _maxReplicaLag;
+        replicaEnabled = true;
+    }
+
+    ~DbConnectionPool();
+
+private:
+    // timeout < 0 - без ограничения ожидания
+    QSharedPointer <DbFileWatcher> takeConnection(qint32 timeout);
+
+    // место для нового подключения
+    bool reserveSlot(qint32 timeout);
+
+    void release(DbFileWatcher* conn);
+
+    void dropThreadConnections(QThread* thread);
+
+    ConnectionData connData;
+    qint32 maxConn;
+    qint32 queryTimeout = 0;
+    bool standbyEnabled = false;
+    bool replicaEnabled = false;
+    ConnectionData replicaData;
+    qint32 maxReplicaLag = 0;
+    // места для открытия подключений
+    QSemaphore available;
+    QMutex mutex;
+    QMultiHash <QThread*, DbFileWatcher*> idle;
+    QSet <QThread*> knownThreads;
+};
+
+#endif // CONNECTIONPOOL_H
@@ -1,5 +1,21 @@
 #include "database.h"
+#include "dbpipeline.h"
+#include "asyncquery.h"
+#include "tracer.h"
+#include "queryprofiler.h"
 #include <QDebug>
+#include <QRandomGenerator>
+#include <utility>
+
+// пауза между попытками переподключения: удваивается от первой до последней, ±50% случайно,
+// чтобы подключения всех потоков не шли к перезапущенному серверу одновременно
+constexpr const qint64 reconnectBaseDelay = 250;
+constexpr const qint64 reconnectMaxDelay = 30000;
+
+// отставание реплики от основного сервера в байтах журнала, которое при живой потоковой репликации
+// считается догнанным: на простаивающем сервере журнал растет только служебными записями
+// (контрольные точки, снимки транзакций), а время последней примененной транзакции не меняется
+constexpr const qint64 replicaWalSlack = 65536;
 
 bool operator!=(const ConnectionData& a1, const ConnectionData& a2)
 {
@@ -15,6 +31,7 @@ int Database::connectionsCount = 0;
 int Database::localConnCount = 0;
 QMutex Database::mutex;
 QMap <QUuid, QPair<QSqlDatabase*, bool>> Database::connections;
+QSet <QUuid> Database::timedOutConnections;
 
 
 
@@ -78,6 +95,250 @@ void Database::connectDb(const ConnectionData& cData)
     {
         throw DbException(db->lastError().text().toStdString());
     }
+    outageClock.invalidate();
+    restoreSession();
+    openStandby();
+}
+
+void Database::reconnect()
+{
+    if (!outageClock.isValid())
+    {
+        outageClock.start();
+        reconnectAttempts = 0;
+        nextAttemptAt = 0;
+        // транзакция осталась на оборванном подключении
+        outsideTransaction = false;
+        emit connectionLost();
+    }
+    if (outageClock.elapsed() < nextAttemptAt)
+    {
+        throw DbException("Соединение с БД не установлено");
+    }
+    ++reconnectAttempts;
+    bool restored = promoteStandby();
+    if (!restored)
+    {
+        db->close();
+        restored = db->open();
+    }
+    if (!restored)
+    {
+        qint64 delay = qMin(reconnectMaxDelay, reconnectBaseDelay << qMin(reconnectAttempts - 1, 16));
+        delay = static_cast <qint64> (delay * (0.5 + QRandomGenerator::global()->generateDouble()));
+        nextAttemptAt = outageClock.elapsed() + delay;
+        throw DbException("Соединение с БД не установлено: " + db->lastError().text().toStdString());
+    }
+    restoreSession();
+    qint64 outage = outageClock.elapsed();
+    outageClock.invalidate();
+    openStandby();
+    emit connectionRestored(outage, reconnectAttempts);
+}
+
+bool Database::promoteStandby()
+{
+    if (standby == nullptr || !standby->isOpen())
+    {
+        return false;
+    }
+    // простаивающее подключение могло быть закрыто сервером вместе с основным: проверяем одним обменом
+    PGconn* conn = rawConnection(standby);
+    PGresult* res = conn == nullptr ? nullptr : PQexec(conn, "");
+    bool alive = res != nullptr && PQresultStatus(res) == PGRES_EMPTY_QUERY;
+    PQclear(res);
+    if (!alive)
+    {
+        standby->close();
+        return false;
+    }
+    // меняется содержимое, а не указатели: копии Database(Database*) и список подключений
+    // держат тот же QSqlDatabase и тоже переходят на резервное подключение
+    std::swap(*db, *standby);
+    standby->close();
+    return true;
+}
+
+void Database::restoreSession()
+{
+    // сервер не хранит состояние прежнего сеанса: сбрасываем признаки, относившиеся к нему,
+    // и задаем параметры заново. Именованных подготовленных запросов нет: QSqlQuery готовит
+    // запрос при каждом выполнении, поэтому заново готовить нечего
+    resetTimedOut(connId);
+    applySessionSettings(*db, false);
+    setConnectionOptions(this);
+}
+
+// на основном подключении запрос прерывает QueryDeadline, statement_timeout - страховка на случай,
+// если отмена не дошла до сервера; на реплике срок задает только сервер
+void Database::applySessionSettings(QSqlDatabase& conn, bool replicaSession)
+{
+    const qint32 timeout = replicaSession ? queryTimeout : queryTimeout * 2;
+    QSqlQuery(conn).exec(QString("SET statement_timeout = %1").arg(timeout));
+}
+
+void Database::setQueryTimeout(qint32 timeout)
+{
+    queryTimeout = timeout;
+    if (db->isOpen())
+    {
+        applySessionSettings(*db, false);
+    }
+    if (replica != nullptr && replica->isOpen())
+    {
+        applySessionSettings(*replica, true);
+    }
+}
+
+void Database::setReplica(const ConnectionData& replicaData, qint32 maxLag, qint32 checkInterval)
+{
+    if (replica == nullptr)
+    {
+        replica = new QSqlDatabase(QSqlDatabase::addDatabase(db->driverName(), db->connectionName() + "_replica"));
+    }
+    replica->close();
+    replica->setHostName(replicaData.host);
+    replica->setPort(replicaData.port);
+    replica->setDatabaseName(replicaData.dbName);
+    replica->setUserName(Utility::translate(replicaData.userName));
+    replica->setPassword(replicaData.password);
+    maxReplicaLag = maxLag;
+    replicaCheckInterval = checkInterval;
+    replicaCheckClock.invalidate();
+    replicaUsable = false;
+}
+
+QSqlDatabase* Database::readReplica()
+{
+    if (replica == nullptr)
+    {
+        return nullptr;
+    }
+    if (!replicaCheckClock.isValid() || replicaCheckClock.elapsed() >= replicaCheckInterval)
+    {
+        replicaCheckClock.start();
+        QString reason;
+        bool usable = checkReplica(reason);
+        setReplicaUsable(usable, reason);
+    }
+    return replicaUsable ? replica : nullptr;
+}
+
+bool Database::checkReplica(QString& reason)
+{
+    PGconn* conn = replica->isOpen() ? rawConnection(replica) : nullptr;
+    if (conn == nullptr || PQstatus(conn) == CONNECTION_BAD)
+    {
+        replica->close();
+        if (!replica->open())
+        {
+            reason = "replica unavailable: " + replica->lastError().text();
+            return false;
+        }
+        applySessionSettings(*replica, true);
+    }
+    // позиция журнала основного сервера: сравнение с полученным самой репликой журналом показало бы
+    // нулевое отставание и при оборванной репликации. Имена функций PostgreSQL 9.6 (xlog, location)
+    QSqlQuery primary(QString(), *db);
+    if (!primary.exec("SELECT pg_current_xlog_location()::text") || !primary.next())
+    {
+        reason = "primary WAL position unknown: " + primary.lastError().text();
+        return false;
+    }
+    // реплика, применившая журнал до этой позиции, не отстает. Не отстает и реплика, которая получает
+    // журнал (pg_stat_wal_receiver без прав суперпользователя показывает только pid, статус NULL),
+    // применила все полученное и отстает не больше чем на replicaWalSlack байт.
+    // Иначе отставание - время с последней примененной транзакции (без нее отставание неизвестно)
+    QSqlQuery query(QString(), *replica);
+    query.prepare("WITH p AS (SELECT CAST(:primary AS pg_lsn) AS lsn, pg_last_xlog_replay_location() AS replayed) "
+                  "SELECT CASE WHEN NOT pg_is_in_recovery() OR replayed >= lsn THEN 0 "
+                  "WHEN replayed = pg_last_xlog_receive_location() "
+                  "AND pg_xlog_location_diff(lsn, replayed) <= :slack "
+                  "AND EXISTS (SELECT 1 FROM pg_stat_wal_receiver WHERE COALESCE(status, 'streaming') = 'streaming') "
+                  "THEN 0 "
+                  "ELSE EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) * 1000 END::bigint FROM p");
+    query.bindValue(":primary", primary.value(0).toString());
+    query.bindValue(":slack", replicaWalSlack);
+    if (!query.exec() || !query.next() || query.isNull(0))
+    {
+        reason = "replica lag unknown: " + query.lastError().text();
+        return false;
+    }
+    qint64 lag = query.value(0).toLongLong();
+    reason = QString("replica lag %1 ms").arg(lag);
+    return lag <= maxReplicaLag;
+}
+
+void Database::setReplicaUsable(bool usable, const QString& reason)
+{
+    if (usable != replicaUsable)
+    {
+        replicaUsable = usable;
+        emit readRoutingChanged(usable, reason);
+    }
+}
+
+QSqlQuery Database::execRead(const QString& queryText, const QVector <QPair <QString, QVariant>>& bindings, qint32 timeout)
+{
+    // внутри транзакции читаем свои же незафиксированные изменения - только на основном
+    QSqlDatabase* source = outsideTransaction ? nullptr : readReplica();
+    if (source != nullptr)
+    {
+        TraceSpan span("query", "db");
+        QueryProfile profile(queryText);
+        QSqlQuery query(QString(), *source);
+        bool ok;
+        if (bindings.isEmpty())
+        {
+            ok = query.exec(queryText);
+        }
+        else
+        {
+            ok = query.prepare(queryText);
+            for (const auto& i : bindings)
+            {
+                query.bindValue(i.first, i.second);
+            }
+            ok = ok && query.exec();
+        }
+        if (ok)
+        {
+            profile.finish(affectedRows(query));
+            return query;
+        }
+        // до следующей проверки читаем с основного сервера
+        setReplicaUsable(false, "replica query failed: " + query.lastError().text());
+    }
+    if (bindings.isEmpty())
+    {
+        return execAndCheck(queryText, timeout);
+    }
+    checkConnection();
+    QSqlQuery query(QString(), *getQSqlDatabase());
+    query.prepare(queryText);
+    for (const auto& i : bindings)
+    {
+        query.bindValue(i.first, i.second);
+    }
+    execPreparedQuery(query, timeout);
+    return query;
+}
+
+void Database::openStandby()
+{
+    if (!standbyEnabled || !db->isOpen())
+    {
+        return;
+    }
+    if (standby == nullptr)
+    {
+        standby = new QSqlDatabase(QSqlDatabase::cloneDatabase(*db, db->connectionName() + "_standby"));
+    }
+    // неудача не мешает работе: при обрыве подключение будет установлено заново
+    if (!standby->isOpen())
+    {
+        standby->open();
+    }
 }
 
 
@@ -97,7 +358,13 @@ void Database::disconnectDb()
 
 bool Database::isConnected() const
 {
-    return db->isOpen();
+    if (!db->isOpen())
+    {
+        return false;
+    }
+    // QSqlDatabase остается открытым после обрыва соединения, его видит только libpq
+    PGconn* conn = rawConnection(db);
+    return conn == nullptr || PQstatus(conn) != CONNECTION_BAD;
 }
 
 
@@ -139,6 +406,7 @@ void Database::endTransaction()
 {
     checkConnection();
     outsideTransaction = false;
+    TraceSpan span("commit", "db");
     if(!db->commit())
     {
         throw DbException(db->lastError().text().toStdString());
@@ -161,6 +429,7 @@ void Database::internalEndTransaction()
 {
     if (!outsideTransaction)
     {
+        TraceSpan span("commit", "db");
         if(!db->commit())
         {
             throw DbException(db->lastError().text().toStdString());
@@ -199,11 +468,16 @@ QSqlDatabase* Database::getDb()
     return db;
 }
 
-QSqlQuery Database::execAndCheck(const QString& queryText)
+QSqlQuery Database::execAndCheck(const QString& queryText, qint32 timeout)
 {
+    checkConnection();
     QSqlQuery query(QString(), *getQSqlDatabase());
+    QueryDeadline deadline(connId, effectiveTimeout(timeout));
+    TraceSpan span("query", "db");
+    QueryProfile profile(queryText);
     if (!query.exec(queryText))
     {
+        bool timedOut = takeTimedOut();
         mutex.lock();
         auto it = connections.find(connId);
         if (it != connections.end())
@@ -218,14 +492,19 @@ QSqlQuery Database::execAndCheck(const QString& queryText)
         }
         mutex.unlock();
         cancelTransaction();
+        if (timedOut)
+        {
+            throw DbTimeoutException("Превышено время выполнения запроса: " + query.lastError().text().toStdString());
+        }
         throw DbException(query.lastError().text().toStdString());
     }
+    profile.finish(affectedRows(query));
     return query;
 }
 
 QStringList Database::getSimpleList(const QString& queryText)
 {
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     QStringList list;
     while(query.next())
     {
@@ -245,34 +524,83 @@ QSqlQuery Database::simpleInsertReturning(const DbRecord& rec, const QString& ta
 }
 
 QSqlQuery Database::simpleInsertPrivate(const DbRecord &rec, const QString& tableName, const QString& addQuery)
+{
+    QSqlQuery query(QString(), *getQSqlDatabase());
+    query.prepare(insertQueryText(rec, tableName, addQuery, false));
+    for (int i = 0; i < rec.count(); i++)
+    {
+        query.bindValue(":" + rec.fieldName(i), rec.value(i));
+    }
+    execPreparedQuery(query);
+    return query;
+}
+
+// делает апдейт всех переданных полей, даже если они переданы в качестве ПК (переделать, подумать ввести определение того,
+// что это ПК, но в тоже время его тоже нужно обновить
+void Database::simpleUpdate(const DbRecord& rec, const QString& tableName)
+{
+    QSqlQuery query(QString(), *getQSqlDatabase());
+    query.prepare(updateQueryText(rec, tableName, false));
+    for (int i = 0; i < rec.count(); i++)
+    {
+        query.bindValue(":" + rec.fieldName(i), rec.value(i));/*":" + rec.fieldName(i).toUpper()*/
+    }
+    execPreparedQuery(query);
+}
+
+
+void Database::simpleDelete(const DbRecord& rec, const QString& tableName)
+{
+    QSqlQuery query(QString(), *getQSqlDatabase());
+    query.prepare(deleteQueryText(rec, tableName, false));
+
+    for (int i = 0; i < rec.count(); i++)
+    {
+        query.bindValue(":" + rec.fieldName(i), rec.value(i));
+    }
+    execPreparedQuery(query);
+}
+
+qint32 Database::simpleInsert(const DbRecord& rec, const QString& tableName, DbPipeline& pipeline)
+{
+    return pipeline.add(insertQueryText(rec, tableName, QString(), true), recordValues(rec));
+}
+
+qint32 Database::simpleUpdate(const DbRecord& rec, const QString& tableName, DbPipeline& pipeline)
+{
+    return pipeline.add(updateQueryText(rec, tableName, true), recordValues(rec));
+}
+
+qint32 Database::simpleDelete(const DbRecord& rec, const QString& tableName, DbPipeline& pipeline)
+{
+    return pipeline.add(deleteQueryText(rec, tableName, true), recordValues(rec));
+}
+
+// имя параметра для i-го поля записи
+static QString placeholder(const DbRecord& rec, int i, bool positional)
+{
+    return positional ? "$" + QString::number(i + 1) : ":" + rec.fieldName(i);
+}
+
+QString Database::insertQueryText(const DbRecord &rec, const QString& tableName, const QString& addQuery, bool positional)
 {
     QString what;
     QString values;
     for (int i = 0; i < rec.count(); i++)
     {
         what.append(rec.fieldName(i) + ",");
-        values.append(":" + rec.fieldName(i) + ",");
+        values.append(placeholder(rec, i, positional) + ",");
     }
     what.chop(1);
     values.chop(1);
-    QSqlQuery query(QString(), *getQSqlDatabase());
-    QString queryText =  QString("INSERT INTO %1 (%2) VALUES (%3) %4" )
+    return QString("INSERT INTO %1 (%2) VALUES (%3) %4" )
             .arg(tableName)
             .arg(what)
             .arg(values)
             .arg(addQuery);
-    query.prepare(queryText);
-    for (int i = 0; i < rec.count(); i++)
-    {
-        query.bindValue(":" + rec.fieldName(i), rec.value(i));
-    }
-    execPreparedQuery(query);
-    return query;
 }
 
-// делает апдейт всех переданных полей, даже если они переданы в качестве ПК (переделать, подумать ввести определение того,
-// что это ПК, но в тоже время его тоже нужно обновить
-void Database::simpleUpdate(const DbRecord& rec, const QString& tableName)
+QString Database::updateQueryText(const DbRecord &rec, const QString& tableName, bool positional)
 {
     QString setString = " SET ";
     QString whereString = " WHERE ";
@@ -280,77 +608,303 @@ void Database::simpleUpdate(const DbRecord& rec, const QString& tableName)
     {
         if (rec.isGenerated(i))
         {
-            whereString.append(QString(" %1=:%2 AND")
+            whereString.append(QString(" %1=%2 AND")
                                .arg(rec.fieldName(i))
-                               .arg(rec.fieldName(i)));
+                               .arg(placeholder(rec, i, positional)));
         }
         else
         {
-            setString.append(QString(" %1=:%2,")
+            setString.append(QString(" %1=%2,")
                              .arg(rec.fieldName(i))
-                             .arg(rec.fieldName(i)));
+                             .arg(placeholder(rec, i, positional)));
         }
     }
     whereString.chop(3);
     setString.chop(1);
-    QSqlQuery query(QString(), *getQSqlDatabase());
-    QString queryText = QString("UPDATE %1 " + setString + whereString).arg(tableName);
-    query.prepare(queryText);
-    for (int i = 0; i < rec.count(); i++)
-    {
-        query.bindValue(":" + rec.fieldName(i), rec.value(i));/*":" + rec.fieldName(i).toUpper()*/
-    }
-    execPreparedQuery(query);
+    return QString("UPDATE %1 " + setString + whereString).arg(tableName);
 }
 
-
-void Database::simpleDelete(const DbRecord& rec, const QString& tableName)
+QString Database::deleteQueryText(const DbRecord &rec, const QString& tableName, bool positional)
 {
     QString whereString = " WHERE ";
     for (int i = 0; i < rec.count(); i++)
     {
 
-        whereString.append(QString(" %1=:%2 AND")
+        whereString.append(QString(" %1=%2 AND")
                            .arg(rec.fieldName(i))
-                           .arg(rec.fieldName(i)));
+                           .arg(placeholder(rec, i, positional)));
 
     }
     whereString.chop(3);
-    QSqlQuery query(QString(), *getQSqlDatabase());
-    QString queryText = QString("DELETE FROM %1 " + whereString).arg(tableName);
-    query.prepare(queryText);
+    return QString("DELETE FROM %1 " + whereString).arg(tableName);
+}
 
+QVector <QVariant> Database::recordValues(const DbRecord &rec)
+{
+    QVector <QVariant> values;
+    values.reserve(rec.count());
     for (int i = 0; i < rec.count(); i++)
     {
-        query.bindValue(":" + rec.fieldName(i), rec.value(i));
+        values.append(rec.value(i));
     }
-    execPreparedQuery(query);
+    return values;
 }
 
 void Database::checkConnection()
 {
-    if (!isConnected())
+    checkNoAsyncQuery();
+    if (isConnected())
+    {
+        return;
+    }
+    // connectDb еще не вызывался
+    if (connData->dbName.isEmpty())
     {
         throw DbException("Соединение с БД не установлено");
     }
+    reconnect();
+}
+
+void Database::checkNoAsyncQuery() const
+{
+    // синхронный запрос посреди неблокирующего смешал бы их ответы в протоколе libpq
+    if (asyncQueries != nullptr && asyncQueries->isRunning())
+    {
+        throw DbException("Подключение занято асинхронным запросом");
+    }
+    if (activePipeline != nullptr)
+    {
+        throw DbException("Подключение занято конвейером запросов");
+    }
 }
 
 QVariant Database::getSomeInfo(const QString& queryText)
 {
     checkConnection();
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     query.first();
     return query.value(0);
 }
 
 
-void Database::execPreparedQuery(QSqlQuery& query)
+void Database::execPreparedQuery(QSqlQuery& query, qint32 timeout)
 {
+    checkNoAsyncQuery();
+    QueryDeadline deadline(connId, effectiveTimeout(timeout));
+    TraceSpan span("query", "db");
+    QueryProfile profile(query.lastQuery());
     if (!query.exec())
     {
+        bool timedOut = takeTimedOut();
         cancelTransaction();
+        if (timedOut)
+        {
+            throw DbTimeoutException("Превышено время выполнения запроса: " + query.lastError().text().toStdString());
+        }
         throw DbException(query.lastError().text().toStdString());
     }
+    profile.finish(affectedRows(query));
+}
+
+qint64 Database::affectedRows(const QSqlQuery& query)
+{
+    return qMax(query.isSelect() ? query.size() : query.numRowsAffected(), 0);
+}
+
+qint64 Database::affectedRows(PGresult* result)
+{
+    if (result == nullptr)
+    {
+        return 0;
+    }
+    return PQresultStatus(result) == PGRES_TUPLES_OK ? PQntuples(result) : QByteArray(PQcmdTuples(result)).toLongLong();
+}
+
+QByteArray Database::toPgText(const QVariant& value)
+{
+    if (value.isNull())
+    {
+        return QByteArray();
+    }
+    switch (value.type())
+    {
+    case QVariant::Bool:
+        return value.toBool() ? "t" : "f";
+    case QVariant::DateTime:
+        return value.toDateTime().toString(Qt::ISODateWithMs).toUtf8();
+    case QVariant::Date:
+        return value.toDate().toString(Qt::ISODate).toUtf8();
+    case QVariant::Time:
+        return value.toTime().toString(Qt::ISODateWithMs).toUtf8();
+    default:
+        return value.toString().toUtf8();
+    }
+}
+
+PgResult Database::execParams(const QString& queryText, const QVector <QVariant>& params, qint32 timeout)
+{
+    QVector <QByteArray> values;
+    QVector <const char*> valuePtrs;
+    values.reserve(params.size());
+    for (const auto& i : params)
+    {
+        values.append(toPgText(i));
+        valuePtrs.append(values.last().isNull() ? nullptr : values.last().constData());
+    }
+    return execParams(queryText.toUtf8(), params.size(), valuePtrs.constData(), timeout);
+}
+
+PgResult Database::execParams(const QByteArray& queryText, qint32 count, const char* const* values, qint32 timeout)
+{
+    checkConnection();
+    PGconn* rawConn = rawConnection(getQSqlDatabase());
+    if (rawConn == nullptr)
+    {
+        throw DbException("Драйвер не предоставляет подключение libpq");
+    }
+    QueryDeadline deadline(connId, effectiveTimeout(timeout));
+    TraceSpan span("query", "db");
+    QueryProfile profile(queryText);
+    PgResult result(PQexecParams(rawConn, queryText.constData(), count, nullptr,
+                                 values, nullptr, nullptr, 0), PQclear);
+    ExecStatusType status = PQresultStatus(result.data());
+    if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK)
+    {
+        QString error = result.isNull() ? QString(PQerrorMessage(rawConn)) : QString(PQresultErrorMessage(result.data()));
+        if (!outsideTransaction && PQtransactionStatus(rawConn) == PQTRANS_INERROR)
+        {
+            cancelTransaction();
+        }
+        if (takeTimedOut())
+        {
+            throw DbTimeoutException("Превышено время выполнения запроса: " + error.toStdString());
+        }
+        throw DbException(error.toStdString());
+    }
+    profile.finish(affectedRows(result.data()));
+    return result;
+}
+
+QVector <PgResult> Database::execReadConcurrent(const QVector <QPair <Database*, QString>>& queries,
+                                                const QVector <QVariant>& params, qint32 timeout)
+{
+    QVector <QByteArray> values;
+    QVector <const char*> valuePtrs;
+    values.reserve(params.size());
+    for (const auto& i : params)
+    {
+        values.append(toPgText(i));
+        valuePtrs.append(values.last().isNull() ? nullptr : values.last().constData());
+    }
+    struct Sent
+    {
+        PGconn* conn = nullptr;
+        bool replica = false;
+        QSharedPointer <QueryDeadline> deadline;
+        QSharedPointer <QueryProfile> profile;
+    };
+    TraceSpan span("query", "db");
+    QVector <Sent> sent(queries.size());
+    // проверки подключений могут бросить исключение, поэтому до отправки первого запроса
+    QVector <const QSqlDatabase*> sources(queries.size());
+    for (qint32 i = 0; i < queries.size(); i++)
+    {
+        Database* conn = queries[i].first;
+        sources[i] = conn->outsideTransaction ? nullptr : conn->readReplica();
+        sent[i].replica = sources[i] != nullptr;
+        if (sources[i] == nullptr)
+        {
+            conn->checkConnection();
+            sources[i] = conn->getQSqlDatabase();
+        }
+    }
+    for (qint32 i = 0; i < queries.size(); i++)
+    {
+        Database* conn = queries[i].first;
+        const QByteArray text = queries[i].second.toUtf8();
+        PGconn* rawConn = rawConnection(sources[i]);
+        if (rawConn == nullptr || PQsendQueryParams(rawConn, text.constData(), params.size(), nullptr,
+                                                    valuePtrs.constData(), nullptr, nullptr, 0) != 1)
+        {
+            // не отправленный запрос выполняется обычным образом после получения остальных ответов
+            continue;
+        }
+        sent[i].conn = rawConn;
+        sent[i].profile.reset(new QueryProfile(text));
+        if (!sent[i].replica)
+        {
+            // срок запросов на реплике задает statement_timeout
+            sent[i].deadline.reset(new QueryDeadline(conn->connId, conn->effectiveTimeout(timeout)));
+        }
+    }
+    QVector <PgResult> results(queries.size());
+    std::exception_ptr error;
+    for (qint32 i = 0; i < queries.size(); i++)
+    {
+        Database* conn = queries[i].first;
+        if (sent[i].conn != nullptr)
+        {
+            PgResult result(PQgetResult(sent[i].conn), PQclear);
+            while (PGresult* rest = PQgetResult(sent[i].conn))
+            {
+                PQclear(rest);
+            }
+            sent[i].deadline.reset();
+            ExecStatusType status = PQresultStatus(result.data());
+            if (status == PGRES_TUPLES_OK || status == PGRES_COMMAND_OK)
+            {
+                sent[i].profile->finish(affectedRows(result.data()));
+                results[i] = result;
+                continue;
+            }
+            QString message = result.isNull() ? QString(PQerrorMessage(sent[i].conn))
+                                              : QString(PQresultErrorMessage(result.data()));
+            if (sent[i].replica)
+            {
+                // до следующей проверки читаем с основного сервера
+                conn->setReplicaUsable(false, "replica query failed: " + message);
+            }
+            else
+            {
+                if (!conn->outsideTransaction && PQtransactionStatus(sent[i].conn) == PQTRANS_INERROR)
+                {
+                    conn->cancelTransaction();
+                }
+                if (!error)
+                {
+                    error = conn->takeTimedOut()
+                            ? std::make_exception_ptr(DbTimeoutException("Превышено время выполнения запроса: " + message.toStdString()))
+                            : std::make_exception_ptr(DbException(message.toStdString()));
+                }
+                continue;
+            }
+        }
+        if (!error)
+        {
+            try
+            {
+                results[i] = conn->execParams(queries[i].second, params, timeout);
+            }
+            catch (std::exception&)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    return results;
+}
+
+DbTask <PgResult> Database::queryAsync(const QString& queryText, const QVector <QVariant>& params, DbCancelToken token)
+{
+    if (asyncQueries == nullptr)
+    {
+        asyncQueries = new AsyncQueryQueue(this);
+    }
+    return asyncQueries->enqueue(queryText, params, token);
 }
 
 qint32 Database::activeConnectionsCount()
@@ -360,14 +914,55 @@ qint32 Database::activeConnectionsCount()
 
 void Database::cancelQuery(const QUuid &connId)
 {
-    mutex.lock();
+    QMutexLocker lock(&mutex);
     QMap <QUuid, QPair<QSqlDatabase*,bool>>::iterator it = connections.find(connId);
     if (it != connections.end())
     {
         cancelQueryPrivate(it.value().first);
         it.value().second = true;
     }
-    mutex.unlock();
+}
+
+bool Database::takeTimedOut()
+{
+    QMutexLocker lock(&mutex);
+    return timedOutConnections.remove(connId);
+}
+
+void Database::resetTimedOut(const QUuid& id)
+{
+    QMutexLocker lock(&mutex);
+    timedOutConnections.remove(id);
+}
+
+bool Database::cancelOnDeadline(const QUuid& id)
+{
+    PGcancel* cancel = nullptr;
+    {
+        QMutexLocker lock(&mutex);
+        auto it = connections.find(id);
+        if (it == connections.end())
+        {
+            return true;
+        }
+        timedOutConnections.insert(id);
+        PGconn* rawConn = rawConnection(it.value().first);
+        if (rawConn == nullptr)
+        {
+            return true;
+        }
+        // объект отмены не зависит от подключения и остается годным после его закрытия
+        cancel = PQgetCancel(rawConn);
+    }
+    if (cancel == nullptr)
+    {
+        return false;
+    }
+    // сетевой запрос - вне блокировки списка подключений; повторы выполняет QueryDeadlineService
+    char errorMsg[256];
+    bool cancelled = PQcancel(cancel, errorMsg, sizeof(errorMsg)) == 1;
+    PQfreeCancel(cancel);
+    return cancelled;
 }
 
 
@@ -416,7 +1011,7 @@ QVector <QVariant> Database::getValueByRelation
             .arg(tableName)
             .arg(joinCond)
             .arg(whereCond);
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     QVector <QVariant> res;
     query.next();
     for (int i = 0; i < values.size(); i++)
@@ -442,7 +1037,7 @@ QVector <QVariant> Database::getValueByRelationManyToManyClosed
             .arg(relFieldName)
             .arg(values[0].toString())
             .arg(values[1].toString());
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     QVector <QVariant> res;
     query.next();
     for (int i = 0; i < values.size(); i++)
@@ -463,7 +1058,7 @@ QVector <QString> Database::getTablePrimaryKey(const QString& tableName)
                                 " WHERE  i.indrelid = '%1'::regclass "
                                 " AND    i.indisprimary;")
             .arg(tableName);
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     QVector <QString> names;
     while (query.next())
     {
@@ -512,7 +1107,7 @@ QVector<QPair <QString, QString>> Database::getTablesRelation(const QString& tab
                                 "WHERE constraint_type = 'FOREIGN KEY' ");
     queryText.append(addquery);
 
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     QVector <QPair <QString, QString>> columns;
     while (query.next())
     {
@@ -528,7 +1123,7 @@ QVector <QString> Database::getTableColumnNames(const QString& tableName, QStrin
                                 " table_name='%1' AND table_schema = '%2';")
             .arg(tableName)
             .arg(schema);
-    QSqlQuery query = execAndCheck(queryText);
+    QSqlQuery query = execRead(queryText);
     QVector <QString> names;
     while (query.next())
     {
@@ -538,35 +1133,80 @@ QVector <QString> Database::getTableColumnNames(const QString& tableName, QStrin
 }
 
 
-void Database::cancelQueryPrivate(QSqlDatabase* _db)
+PGconn* Database::rawConnection(const QSqlDatabase* _db)
 {
     QVariant v = _db->driver()->handle();
     if (qstrcmp(v.typeName(), "PGconn*") == 0)
     {
-        PGconn* rawConn = *static_cast<PGconn **>(v.data());
-        if (rawConn != nullptr)
-        {
-            PGcancel* cancelQuery = PQgetCancel(rawConn);
-            constexpr const quint16 tryCount = 10;
-            int result = 0;
-            quint16 tryCounter = 0;
-            char errorMsg[256];
-            while (result!= 1 && tryCounter < tryCount)
-            {
-                result = PQcancel(cancelQuery, errorMsg, 256);
-            }
-            if (result != 1)
-            {
-                throw DbException(errorMsg);
-            }
-            queryCancel = true;
-        }
+        return *static_cast<PGconn **>(v.data());
+    }
+    return nullptr;
+}
+
+
+void Database::cancelQueryPrivate(QSqlDatabase* _db)
+{
+    QString error;
+    if (!cancelRawQuery(_db, error))
+    {
+        throw DbException(error.toStdString());
     }
+    queryCancel = true;
+}
+
+bool Database::cancelRawQuery(QSqlDatabase* _db, QString& error)
+{
+    PGconn* rawConn = rawConnection(_db);
+    if (rawConn == nullptr)
+    {
+        return true;
+    }
+    PGcancel* cancelQuery = PQgetCancel(rawConn);
+    if (cancelQuery == nullptr)
+    {
+        error = "Не удалось получить объект отмены запроса";
+        return false;
+    }
+    constexpr const quint16 tryCount = 10;
+    int result = 0;
+    quint16 tryCounter = 0;
+    char errorMsg[256];
+    while (result!= 1 && tryCounter < tryCount)
+    {
+        result = PQcancel(cancelQuery, errorMsg, 256);
+        ++tryCounter;
+    }
+    PQfreeCancel(cancelQuery);
+    if (result != 1)
+    {
+        error = errorMsg;
+        return false;
+    }
+    return true;
 }
 
 
 Database::~Database()
 {
+    // очередь асинхронных запросов использует подключение, удаляем ее до его закрытия
+    delete asyncQueries;
+    asyncQueries = nullptr;
+    if (replica != nullptr)
+    {
+        QString connectionName = replica->connectionName();
+        replica->close();
+        delete replica;
+        replica = nullptr;
+        QSqlDatabase::removeDatabase(connectionName);
+    }
+    if (standby != nullptr)
+    {
+        QString connectionName = standby->connectionName();
+        standby->close();
+        delete standby;
+        standby = nullptr;
+        QSqlDatabase::removeDatabase(connectionName);
+    }
     if (db != nullptr)
     {
         if (isLocal)
@@ -13,8 +13,18 @@
 #include <QSqlRecord>
 #include <QSqlField>
 #include <utility.h>
+#include <querydeadline.h>
+#include <dbtask.h>
+#include <array>
+#include <QElapsedTimer>
 using namespace std;
 
+class DbPipeline;
+class AsyncQueryQueue;
+
+// результат запроса, выполненного напрямую через libpq; PQclear вызывается при удалении
+using PgResult = QSharedPointer <PGresult>;
+
 struct ConnectionData
 {
     QString dbName;
@@ -111,8 +121,19 @@ public:
 
     void disconnectDb();
 
+    // при обрыве переподключается (резервным подключением или заново) с растущей паузой между попытками;
+    // пока пауза не истекла, сразу бросает DbException
     void checkConnection();
 
+    // резервное подключение открывается заранее и при обрыве основного подменяет его
+    // без установки соединения; задать до connectDb
+    void setStandbyEnabled(bool enabled) {standbyEnabled = enabled;}
+
+    // реплика только для чтения: списки, справочные запросы и поиск метаданных идут на нее,
+    // пока ее отставание не больше maxLag мс, иначе и при ее недоступности - на основной сервер.
+    // Изменения всегда выполняются на основном. Отставание проверяется не чаще раза в checkInterval мс
+    void setReplica(const ConnectionData& replicaData, qint32 maxLag, qint32 checkInterval = 5000);
+
     qint32 activeConnectionsCount();
 
     void cancelQuery(const QUuid& connId);
@@ -129,6 +150,40 @@ public:
 
     void simpleDelete(const DbRecord& rec, const QString& tableName);
 
+    // то же, но запрос ставится в конвейер и выполняется вместе с остальными при pipeline.exec()
+    qint32 simpleInsert(const DbRecord& rec, const QString& tableName, DbPipeline& pipeline);
+
+    qint32 simpleUpdate(const DbRecord& rec, const QString& tableName, DbPipeline& pipeline);
+
+    qint32 simpleDelete(const DbRecord& rec, const QString& tableName, DbPipeline& pipeline);
+
+    // запрос с параметрами ($1, $2, ...) за один обмен с сервером, минуя PREPARE/EXECUTE драйвера Qt
+    PgResult execParams(const QString& queryText, const QVector <QVariant>& params, qint32 timeout = -1);
+
+    // то же для запроса и параметров, уже закодированных в текст libpq (см. TypedRecord), nullptr - NULL
+    PgResult execParams(const QByteArray& queryText, qint32 count, const char* const* values, qint32 timeout = -1);
+
+    template <size_t N>
+    PgResult execParams(const QByteArray& queryText, const std::array <QByteArray, N>& params, qint32 timeout = -1)
+    {
+        std::array <const char*, N> valuePtrs;
+        for (size_t i = 0; i < N; i++)
+        {
+            valuePtrs[i] = params[i].isNull() ? nullptr : params[i].constData();
+        }
+        return execParams(queryText, static_cast <qint32> (N), valuePtrs.data(), timeout);
+    }
+
+    static PGconn* rawConnection(const QSqlDatabase* _db);
+
+    // текстовое представление параметра для libpq, NULL - пустой QByteArray
+    static QByteArray toPgText(const QVariant& value);
+
+    // строк в результате запроса выборки или затронутых изменением
+    static qint64 affectedRows(const QSqlQuery& query);
+
+    static qint64 affectedRows(PGresult* result);
+
     QVector <QVariant> getValueByRelation
     (const QString& tableName, const QVector<QVariant> &values, const QStringList& relTables, const QStringList& relFieldNames, const QStringList& fieldNames);
 
@@ -138,27 +193,38 @@ public:
 
     QVector<QPair<QString, QString> > getTablesRelation(const QString& table1, const QString& table2);
 
+    // срок выполнения запросов по умолчанию, мс; 0 - без ограничения.
+    // Сервер прерывает запрос сам через удвоенный срок, если отмена по сроку до него не дошла
+    void setQueryTimeout(qint32 timeout);
+
+    qint32 getQueryTimeout() const {return queryTimeout;}
+
+    QUuid getConnId() const noexcept {return connId;}
+
     QString getUserName()
     {
         return connData->userName;
     }
 
-    template <typename DB, typename Function , typename ...Args, typename CallBack,typename ReturnValue>
-    static QUuid callAsync(DB* db, QSharedPointer<QFutureWatcher<ReturnValue>> watcher, Function&& query,CallBack&& callBack, Args&& ...args);
-
-    template <typename DB, typename Function , typename ...Args, typename CallBack, typename ReturnValue, typename ConnSetter>
-    static QUuid callAsync(DB* db, QSharedPointer<QFutureWatcher<ReturnValue>> watcher, Function&& query, CallBack&& callBack, ConnSetter&& setter, Args&& ...args);
-
-
-    //    template <typename DB, typename Function , typename ...Args, typename CallBack,typename ReturnValue>
-    //    static QUuid callAsync(DB* db, QFutureWatcher<ReturnValue>& watcher, Function&& query,CallBack&& callBack, Args&& ...args);
-
+    // неблокирующий запрос с параметрами $1, $2, ...: поток не ждет ответа сервера,
+    // результат приходит через цикл событий потока подключения. До ответа подключение
+    // занято: синхронные запросы (execAndCheck, execParams, конвейер) бросают DbException
+    DbTask <PgResult> queryAsync(const QString& queryText, const QVector <QVariant>& params = QVector <QVariant>(),
+                                 DbCancelToken token = DbCancelToken());
 
     virtual ~Database();
 
 signals:
     void queryCanceled();
 
+    void connectionLost();
+
+    // outage - мс от обнаружения обрыва до восстановления; открытые транзакции при обрыве потеряны
+    void connectionRestored(qint64 outage, qint32 attempts);
+
+    // чтение переключилось на реплику (replica == true) или вернулось на основной сервер
+    void readRoutingChanged(bool replica, const QString& reason);
+
 protected:
 
     void internalStartTransaction();
@@ -169,19 +235,21 @@ protected:
 
     bool checkQueryValueNull(const QVariant& value);
 
-    template <typename DB, typename ReturnValue, typename Function , typename ...Args>
-    static auto exceptionWrapper (QUuid id, QSharedPointer<QFutureWatcher<ReturnValue>> w, DB* db, Function function, Args& ...args)
-    -> decltype((db->*function)(args...));
-
-    template <typename DB, typename ReturnValue, typename Function , typename ConnSetter, typename ...Args>
-    static auto exceptionWrapper (QUuid id, QSharedPointer<QFutureWatcher<ReturnValue>> w, DB* db, Function function, ConnSetter setter,  Args& ...args)
-    -> decltype((db->*function)(args...));
-
     QSqlDatabase* getDb();
 
-    QSqlQuery execAndCheck(const QString& queryText);
+    // timeout < 0 - срок по умолчанию (setQueryTimeout); по его истечении бросается DbTimeoutException
+    QSqlQuery execAndCheck(const QString& queryText, qint32 timeout = -1);
 
-    QUuid getConnId() const noexcept {return connId;}
+    // запрос только на чтение: на реплике, если она задана и успевает за основным, иначе как execAndCheck.
+    // bindings - значения параметров :имя; ошибка на реплике повторяет запрос на основном сервере
+    QSqlQuery execRead(const QString& queryText, const QVector <QPair <QString, QVariant>>& bindings = {},
+                       qint32 timeout = -1);
+
+    // запросы только на чтение с общими параметрами $1, $2, ..., каждый на своем подключении (first):
+    // все отправляются до ожидания первого ответа, поэтому сервер выполняет их одновременно.
+    // Читают с реплики, как execRead; ошибка бросается после получения всех ответов
+    static QVector <PgResult> execReadConcurrent(const QVector <QPair <Database*, QString>>& queries,
+                                                 const QVector <QVariant>& params, qint32 timeout = -1);
 
     QStringList getSimpleList(const QString& queryText);
 
@@ -189,7 +257,11 @@ protected:
 
     QVariant getSomeInfo(const QString& queryText);
 
-    void execPreparedQuery(QSqlQuery &query);
+    void execPreparedQuery(QSqlQuery &query, qint32 timeout = -1);
+
+    // positional - параметры $1, $2, ... в порядке полей записи, иначе :имя_поля
+    static QString insertQueryText(const DbRecord &rec, const QString& tableName, const QString& addQuery, bool positional);
+    static QString updateQueryText(const DbRecord &rec, const QString& tableName, bool positional);
 
     explicit Database(QUuid id);
 
@@ -198,189 +270,76 @@ protected:
     bool outsideTransaction = false;
 
 private:
+    friend class QueryDeadlineService;
+    friend class QueryDeadline;
+    friend class AsyncQueryQueue;
+    friend class DbPipeline;
 
-    QSqlQuery simpleInsertPrivate(const DbRecord &rec, const QString& tableName, const QString& addQuery = QString());
-    void cancelQueryPrivate(QSqlDatabase* _db);
-    QVector <QVariant> getValueByRelationManyToManyClosed
-    (const QString& tableName, const QVector<QVariant> &values, const QString& relTable, const QString& relFieldName);
-    static QMap <QUuid, QPair<QSqlDatabase*, bool>> connections;
-    static int connectionsCount;
-    static int localConnCount;
-    bool isLocal = false;
-    static QMutex mutex;
-    QSqlDatabase* db = nullptr;
-    QUuid connId;
-    QSharedPointer <ConnectionData> connData;
-};
+    qint32 effectiveTimeout(qint32 timeout) const {return timeout < 0 ? queryTimeout : timeout;}
 
-// Добавить Uuid для отмены запросов, хранить в connections
-template <typename DB, typename Function , typename ...Args, typename CallBack, typename ReturnValue>
-QUuid Database::callAsync(DB* db, QSharedPointer <QFutureWatcher<ReturnValue>> watcher, Function&& query,CallBack&& callBack, Args&& ...args)
-{
-    static void* prevFuture = nullptr;
-    if(prevFuture != watcher.data()) {
-        auto conn = QSharedPointer <QMetaObject::Connection>::create();
-        *conn = QObject::connect(watcher.data(), &QFutureWatcher <ReturnValue>::finished, callBack);
-        QObject::connect(watcher.data(), &QFutureWatcher <ReturnValue>::finished, [conn](){QObject::disconnect(*conn);});
-    }
-    prevFuture = reinterpret_cast <void*> (watcher.data());
-    auto id = QUuid::createUuid();
-    QFuture <ReturnValue> futureValue =
-            QtConcurrent::run(
-                bind(
-                    exceptionWrapper <DB,ReturnValue,Function,Args...>, watcher, id, db, forward<Function>(query), forward<Args>(args)...));
-    watcher->setFuture(futureValue);
-    return id;
-}
-
-template <typename DB, typename Function , typename ...Args, typename CallBack, typename ReturnValue, typename ConnSetter>
-QUuid Database::callAsync(DB* db, QSharedPointer<QFutureWatcher<ReturnValue>> watcher, Function&& query, CallBack&& callBack, ConnSetter&& setter, Args&& ...args)
-{
+    // проверяет и сбрасывает признак отмены запроса по сроку
+    bool takeTimedOut();
 
-    static void* prevFuture = nullptr;
-    if(prevFuture != watcher.data()) {
-        auto conn = QSharedPointer <QMetaObject::Connection>::create();
-        *conn = QObject::connect(watcher.data(), &QFutureWatcher <ReturnValue>::finished, callBack);
-        QObject::connect(watcher.data(), &QFutureWatcher <ReturnValue>::finished, [conn](){QObject::disconnect(*conn);});
-    }
-    prevFuture = reinterpret_cast <void*> (watcher.data());
-    auto id = QUuid::createUuid();
-    QFuture<ReturnValue> futureValue
-            = QtConcurrent::run(
-                bind(
-                    exceptionWrapper <DB,ReturnValue,Function,ConnSetter,Args...>, id, watcher, db, forward<Function>(query), setter, forward<Args>(args)...));
-    watcher->setFuture(futureValue);
-    return id;
-}
-
-
-// версия для статичного QFutureWatcher, для нее нужно перегрузить exceptionWrapper-ы без QSharedPointer
-//template <typename DB, typename Function , typename ...Args, typename CallBack, typename ReturnValue>
-//QUuid Database::callAsync(DB* db, QFutureWatcher <ReturnValue>& watcher, Function&& query, CallBack&& callBack, Args&& ...args)
-//{
-//    static void* prevFuture = nullptr;
-//    if(prevFuture != &watcher) {
-//        QObject::connect(&watcher, &QFutureWatcher <ReturnValue>::finished, callBack);
-//        auto conn = QSharedPointer <QMetaObject::Connection>::create();
-//        *conn = QObject::connect(&watcher, &QFutureWatcher <ReturnValue>::finished, [conn](){QObject::disconnect(*conn);});
-//    }
-//    prevFuture = reinterpret_cast <void*> (&watcher);
-//    auto id = QUuid::createUuid();
-//    QFuture <ReturnValue> futureValue =
-//            QtConcurrent::run(
-//                bind(
-//                    exceptionWrapper <DB,ReturnValue,Function,Args...>, id, watcher, db, forward<Function>(query),forward<Args>(args)...));
-//    watcher.setFuture(futureValue);
-//    return id;
-//}
-
-
-
-template <typename DB ,typename ReturnValue, typename Function ,typename ConnSetter, typename ...Args>
-auto Database::exceptionWrapper (QUuid id, QSharedPointer<QFutureWatcher<ReturnValue>> w, DB* db, Function function, ConnSetter setter, Args& ...args)
--> decltype((db->*function)(args...))
-{
-    try
-    {
-        QScopedPointer <DB> tempDbConn(new DB(id));
-        setter(tempDbConn.data());
-        QObject::connect(tempDbConn.data(), &Database::queryCanceled, tempDbConn.data(),
-                         [w](){w->disconnect(); w->cancel();}, Qt::DirectConnection);
-        db->setConnectionOptions(tempDbConn.data());
-        return (tempDbConn.data()->*function)(args...);
-    }
-    catch (std::exception& e)
-    {
-        throw ThreadDbException(e);
-    }
-}
+    static bool cancelOnDeadline(const QUuid& id);
 
+    // DbException, если на подключении выполняется запрос queryAsync или конвейер DbPipeline
+    void checkNoAsyncQuery() const;
 
-template <typename DB, typename ReturnValue, typename Function , typename ...Args>
-auto Database::exceptionWrapper (QUuid id, QSharedPointer<QFutureWatcher<ReturnValue>> w, DB* db, Function function, Args& ...args)
--> decltype((db->*function)(args...))
-{
-    try
-    {
-        QScopedPointer <DB> tempDbConn(new DB(id));
-        QObject::connect(tempDbConn.data(), &Database::queryCanceled, tempDbConn.data(),
-                         [w](){w->disconnect(); w->cancel();}, Qt::DirectConnection);
-        db->setConnectionOptions(tempDbConn.data());
-        return (tempDbConn.data()->*function)(args...);
-    }
-    catch (std::exception& e)
-    {
-        throw ThreadDbException(e);
-    }
-}
+    void reconnect();
 
+    // подменяет оборванное подключение резервным, если оно живо
+    bool promoteStandby();
 
-class QueryWatcher : public QObject
-{
-    Q_OBJECT
-signals:
-    void queryStarted();
-    void stillActiveQueries();
-public:
-    explicit QueryWatcher(Database* _d) : d(_d)
-    {}
+    // состояние нового сеанса сервера после подключения, переподключения и подмены резервным
+    void restoreSession();
 
-    QueryWatcher(const QueryWatcher&)                   = delete;
+    // параметры сеанса: statement_timeout основного подключения или реплики
+    void applySessionSettings(QSqlDatabase& conn, bool replicaSession);
 
-    QueryWatcher(QueryWatcher&& )                       = delete;
+    void openStandby();
 
-    QueryWatcher& operator=(const QueryWatcher&)        = delete;
+    // реплика, если ее сейчас можно читать, иначе nullptr
+    QSqlDatabase* readReplica();
 
-    QueryWatcher& operator=(QueryWatcher&&)             = delete;
+    bool checkReplica(QString& reason);
 
-    void add(const QUuid& id)
-    {
-        activeQueries.append(id);
-    }
+    void setReplicaUsable(bool usable, const QString& reason);
 
+    static void resetTimedOut(const QUuid& id);
 
-    qint32 count() {return activeQueries.size();}
+    // ограниченное число попыток PQcancel
+    static bool cancelRawQuery(QSqlDatabase* _db, QString& error);
 
-    void checkActiveQueries()
-    {
-        QVector<QUuid>::iterator it = activeQueries.begin();
-        while (it != activeQueries.end())
-        {
-            if (!d->isQueryActive(*it))
-            {
-                it = activeQueries.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
-        }
-        if (activeQueries.isEmpty())
-        {
-            emit stillActiveQueries();
-        }
-    }
-    void cancelActiveQueries()
-    {
-        for(auto i : activeQueries)
-        {
-            d->cancelQuery(i);
-        }
-    }
-
-    template  <typename T>
-    void updateActiveQueries(QFutureWatcher <T>* w)
-    {
-        emit queryStarted();
-        connect(w, &QFutureWatcher <T>::finished, [this]()
-        {
-            checkActiveQueries();
-        });
-    }
-private:
-    QVector <QUuid> activeQueries;
-    Database* d;
+    QSqlQuery simpleInsertPrivate(const DbRecord &rec, const QString& tableName, const QString& addQuery = QString());
+    static QString deleteQueryText(const DbRecord &rec, const QString& tableName, bool positional);
+    static QVector <QVariant> recordValues(const DbRecord &rec);
+    void cancelQueryPrivate(QSqlDatabase* _db);
+    QVector <QVariant> getValueByRelationManyToManyClosed
+    (const QString& tableName, const QVector<QVariant> &values, const QString& relTable, const QString& relFieldName);
+    static QMap <QUuid, QPair<QSqlDatabase*, bool>> connections;
+    static QSet <QUuid> timedOutConnections;
+    static int connectionsCount;
+    static int localConnCount;
+    bool isLocal = false;
+    static QMutex mutex;
+    QSqlDatabase* db = nullptr;
+    QSqlDatabase* standby = nullptr;
+    bool standbyEnabled = false;
+    // идет, пока подключение оборвано
+    QElapsedTimer outageClock;
+    qint64 nextAttemptAt = 0;
+    qint32 reconnectAttempts = 0;
+    QSqlDatabase* replica = nullptr;
+    qint32 maxReplicaLag = 0;
+    qint32 replicaCheckInterval = 5000;
+    QElapsedTimer replicaCheckClock;
+    bool replicaUsable = false;
+    QUuid connId;
+    QSharedPointer <ConnectionData> connData;
+    qint32 queryTimeout = 0;
+    AsyncQueryQueue* asyncQueries = nullptr;
+    // конвейер, держащий подключение в режиме pipeline
+    DbPipeline* activePipeline = nullptr;
 };
 
-
 #endif // DATABASE_H
@@ -1,4 +1,6 @@
 #include "dbfilewatcher.h"
+#include "dbpipeline.h"
+#include <typedrecord.h>
 #include <QDebug>
 DbFileWatcher::DbFileWatcher(QString dbDriver, QObject* parent):
     Database(dbDriver, parent) {}
@@ -7,74 +9,450 @@ void DbFileWatcher::setConnectionOptions(Database* newConn)  {Q_UNUSED(newConn);
 
 
 
-QStringList DbFileWatcher::getDirectroriesList()
+QString DbFileWatcher::partitionKeyExpression(const PathTable& table)
 {
+    // родительский каталог пути: строки одного каталога попадают в одну часть
+    return QString("regexp_replace(rtrim(%1, '/'), '/[^/]*$', '')").arg(table.pathColumn);
+}
+
+
+// условие принадлежности строки частям: $countParam - число частей, $countParam + 1 - массив своих частей.
+// Знаковый бит хэша сбрасывается маской: abs(hashtext()) для INT_MIN дает ошибку переполнения
+static QString partitionCondition(const PathTable& t, qint32 countParam)
+{
+    return QString(" AND (hashtext(%1) & 2147483647) % $%2 = ANY($%3::int[])")
+            .arg(DbFileWatcher::partitionKeyExpression(t)).arg(countParam).arg(countParam + 1);
+}
+
+static void appendPartitionParams(QVector <QVariant>& params, const PathPartition& partition)
+{
+    QStringList owned;
+    for (auto i : partition.owned)
+    {
+        owned.append(QString::number(i));
+    }
+    params << partition.count << Utility::toPgArray(owned);
+}
+
+// отбор строк частей partition (без деления - всех); параметры добавляются в конец params
+static void appendPartitionCondition(QString& queryText, QVector <QVariant>& params, const PathTable& t,
+                                     const PathPartition& partition)
+{
+    if (partition.count <= 0)
+    {
+        return;
+    }
+    queryText.append(partitionCondition(t, params.size() + 1));
+    appendPartitionParams(params, partition);
+}
+
+
+// строковая константа SQL
+static QString sqlLiteral(const QString& value)
+{
+    return "'" + QString(value).replace("'", "''") + "'";
+}
+
+// column начинается с value; starts_with появилась только в PostgreSQL 11
+static QString prefixCondition(const QString& column, const QString& value)
+{
+    return QString("left(%1, length(%2)) = %2").arg(column, value);
+}
+
+// строки таблицы, ссылающиеся на файл (путь не заглушка)
+static QString referencedCondition(const PathTable& table)
+{
+    return "NOT " + prefixCondition(table.pathColumn, sqlLiteral(table.placeholder));
+}
+
+// шаблон LIKE для значений, начинающихся с param. В отличие от left() условие с известным
+// значением параметра (неименованный запрос libpq планируется с ним) может использовать индекс text_pattern_ops
+static QString likePrefix(const QString& param)
+{
+    return QString(R"(replace(replace(replace(%1, '\', '\\'), '%', '\%'), '_', '\_') || '%')").arg(param);
+}
+
+// обновление всех таблиц реестра одним запросом: $1 - новый путь (NULL - файл удален), $2 - прежний;
+// пути заканчиваются "/", поэтому при переименовании каталога меняется и начало путей всех строк под ним.
+// Строки результата помечены таблицей
+static QByteArray updatePathQuery(const QVector <PathTable>& tables)
+{
+    QString updates;
+    QString selects;
+    for (int i = 0; i < tables.size(); i++)
+    {
+        const PathTable& t = tables[i];
+        updates.append(QString("%1t%2 AS (UPDATE %3 SET %4 = COALESCE($1 || substr(%4, length($2) + 1), %5) "
+                               "WHERE %4 LIKE %6 RETURNING %7 AS id)")
+                       .arg(i == 0 ? "WITH " : ", ", QString::number(i), t.table, t.pathColumn,
+                            sqlLiteral(t.deletedValue()), likePrefix("$2"), t.idColumn));
+        selects.append(QString("%1SELECT %2, id FROM t%3")
+                       .arg(i == 0 ? " " : " UNION ALL ").arg(sqlLiteral(t.table)).arg(i));
+    }
+    return (updates + selects).toUtf8();
+}
+
+// реестр и построенные по нему запросы; меняется только до запуска потоков
+struct PathTableRegistry
+{
+    QVector <PathTable> tables;
+    QByteArray updateQuery;
+
+    explicit PathTableRegistry(const QVector <PathTable>& _tables) : tables(_tables), updateQuery(updatePathQuery(_tables)) {}
+};
+
+static PathTableRegistry& registry()
+{
+    static PathTableRegistry instance({PathTable {"testing.life_cycle_e"}, PathTable {"testing.attr_value"}});
+    return instance;
+}
+
+// параметры запроса обновления путей: $1 - новый путь (NULL - файл удален), $2 - прежний;
+// пути в БД хранятся с "/" на конце
+static std::array <QByteArray, 2> updatePathParams(const QString& updatePathOld, const QString& updatePathNew)
+{
+    return {{updatePathNew.isEmpty() ? QByteArray() : pgText(updatePathNew + "/"), pgText(updatePathOld + "/")}};
+}
+
+static void appendUpdatedRows(UpdatedRows& rows, const PgResult& result)
+{
+    for (int i = 0; i < PQntuples(result.data()); i++)
+    {
+        rows.append(qMakePair(QString(PQgetvalue(result.data(), i, 0)),
+                              QString(PQgetvalue(result.data(), i, 1)).toInt()));
+    }
+}
+
+QStringList DbFileWatcher::getDirectroriesList(const QString& dbPrefix, bool* ok, const PathPartition& partition,
+                                               const QVector <DbFileWatcher*>& helpers)
+{
+    if (ok != nullptr)
+    {
+        *ok = false;
+    }
     try
     {
-        //qDebug() << "QQ";
-        checkConnection();
-        return getSimpleList("SELECT filepath FROM testing.life_cycle_e filepath WHERE filepath NOT LIKE 'Не указан%';")
-                + getSimpleList("SELECT filepath FROM testing.attr_value filepath WHERE filepath NOT LIKE 'Не указан%';");
+        QVector <QVariant> params;
+        if (!dbPrefix.isEmpty())
+        {
+            params << dbPrefix;
+        }
+        const qint32 countParam = params.size() + 1;
+        if (partition.count > 0)
+        {
+            appendPartitionParams(params, partition);
+        }
+        // таблицы распределяются по подключениям поровну, таблицы одного подключения - одним запросом
+        QVector <DbFileWatcher*> connections {this};
+        for (auto i : helpers)
+        {
+            if (i != nullptr && i != this)
+            {
+                connections.append(i);
+            }
+        }
+        const QVector <PathTable>& tables = pathTables();
+        QVector <QPair <Database*, QString>> queries;
+        for (qint32 i = 0; i < tables.size(); i++)
+        {
+            const PathTable& t = tables[i];
+            QString queryText = QString("SELECT %1 FROM %2 WHERE %3").arg(t.pathColumn, t.table, referencedCondition(t));
+            if (!dbPrefix.isEmpty())
+            {
+                queryText.append(" AND " + prefixCondition(t.pathColumn, "$1"));
+            }
+            if (partition.count > 0)
+            {
+                // параметры частей общие для всех таблиц
+                queryText.append(partitionCondition(t, countParam));
+            }
+            if (i < connections.size())
+            {
+                queries.append(qMakePair(static_cast <Database*> (connections[i]), queryText));
+            }
+            else
+            {
+                queries[i % connections.size()].second.append(" UNION ALL " + queryText);
+            }
+        }
+        QStringList list;
+        for (const auto& result : execReadConcurrent(queries, params))
+        {
+            const qint32 rows = PQntuples(result.data());
+            list.reserve(list.size() + rows);
+            for (qint32 i = 0; i < rows; i++)
+            {
+                list.append(QString::fromUtf8(PQgetvalue(result.data(), i, 0)));
+            }
+        }
+        if (ok != nullptr)
+        {
+            *ok = true;
+        }
+        return list;
     }
     catch (std::exception& e)
     {
         //qDebug() << QString(e.what());
         emit errorOccured(QString(e.what()));
     }
+    return QStringList();
 }
 
+UpdatedRows DbFileWatcher::tryToUpdatePath(const QString& updatePathOld, const QString& updatePathNew)
+{
+    UpdatedRows rows;
+    try
+    {
+       // qDebug() << "try TO UPDATE";
+        appendUpdatedRows(rows, execParams(registry().updateQuery, updatePathParams(updatePathOld, updatePathNew)));
+    }
+    catch (std::exception& e)
+    {
+        //qDebug() << QString(e.what());
+        emit errorOccured(QString(e.what()));
+    }
+    return rows;
+}
 
+UpdatedRows DbFileWatcher::tryToUpdatePaths(const QVector <QPair <QString, QString>>& changes, QVector <qint32>* failed)
+{
+    UpdatedRows rows;
+    try
+    {
+        DbPipeline pipeline(this);
+        addPathUpdates(pipeline, changes);
+        rows = pathUpdateResults(pipeline.exec(), failed);
+    }
+    catch (std::exception& e)
+    {
+        emit errorOccured(QString(e.what()));
+        if (failed != nullptr)
+        {
+            failed->clear();
+            for (qint32 i = 0; i < changes.size(); i++)
+            {
+                failed->append(i);
+            }
+        }
+    }
+    return rows;
+}
 
-void DbFileWatcher::updateFilepath(const QString& tableName, const QString& updatePathNew, QSqlQuery& query)
+void DbFileWatcher::addPathUpdates(DbPipeline& pipeline, const QVector <QPair <QString, QString>>& changes)
 {
-    DbRecord rec;
-    query.next();
-    rec.insertValue("id", query.value(0).toInt());
-    rec.setGenerated("id", true);
-    if (updatePathNew.isEmpty())
+    for (const auto& i : changes)
     {
-        rec.insertValue("filepath", "Не указан (был удален)");
+        pipeline.addEncoded(registry().updateQuery, updatePathParams(i.first, i.second));
     }
-    else
+}
+
+UpdatedRows DbFileWatcher::pathUpdateResults(const QVector <PipelineResult>& results, QVector <qint32>* failed)
+{
+    UpdatedRows rows;
+    for (qint32 i = 0; i < results.size(); i++)
     {
-        rec.insertValue("filepath", updatePathNew);
+        if (results[i].isOk())
+        {
+            appendUpdatedRows(rows, results[i].result);
+        }
+        else
+        {
+            emit errorOccured(results[i].error);
+            if (failed != nullptr)
+            {
+                failed->append(i);
+            }
+        }
     }
-    simpleUpdate(rec, tableName);
+    return rows;
 }
 
+// размер и время изменения записанного файла; строка ищется по пути
+struct FileMetadata : TypedRecord <FileMetadata, KeyColumn <QString>, SetColumn <qint64>, SetColumn <QDateTime>>
+{
+    using TypedRecord::TypedRecord;
 
+    static const char* const* columnNames()
+    {
+        static const char* const names[] = {"filepath", "size", "mtime"};
+        return names;
+    }
+};
 
-void DbFileWatcher::tryToUpdatePath(const QString& updatePathOld, const QString& updatePathNew)
+void DbFileWatcher::upsertFileMetadata(const QString& tableName, const QVector <SettledFile>& files)
 {
+    if (files.isEmpty())
+    {
+        return;
+    }
     try
     {
+        // каждый файл - своей строкой конвейера: ошибка одной записи не теряет остальные
+        const QByteArray& queryText = FileMetadata::upsertText(tableName);
+        DbPipeline pipeline(this);
+        for (const auto& i : files)
+        {
+            pipeline.addEncoded(queryText, FileMetadata(i.path, i.size, i.mtime.toUTC()).params());
+        }
+        for (const auto& i : pipeline.exec())
+        {
+            if (!i.isOk())
+            {
+                emit errorOccured(i.error);
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        emit errorOccured(QString(e.what()));
+    }
+}
 
-        QString oldFile = updatePathOld;
-        QString newFile = updatePathNew;
-
-        oldFile.append("/").remove("//Camera20/DATA/");
-        newFile.append("/").remove("//Camera20/DATA/");;
+QVector <PathRow> DbFileWatcher::getPathsUnder(const QString& dbPrefix)
+{
+    QString queryText;
+    for (const auto& i : pathTables())
+    {
+        queryText.append(queryText.isEmpty() ? "" : " UNION ALL ");
+        queryText.append(QString("SELECT %1, %2, %3 FROM %4 WHERE %5")
+                         .arg(sqlLiteral(i.table), i.idColumn, i.pathColumn, i.table, prefixCondition(i.pathColumn, "$1")));
+    }
+    QVector <PathRow> rows;
+    try
+    {
+        PgResult result = execParams(queryText, {dbPrefix});
+        for (int i = 0; i < PQntuples(result.data()); i++)
+        {
+            rows.append(PathRow {QString(PQgetvalue(result.data(), i, 0)),
+                                 QString(PQgetvalue(result.data(), i, 1)).toInt(),
+                                 QString(PQgetvalue(result.data(), i, 2))});
+        }
+    }
+    catch (std::exception& e)
+    {
+        emit errorOccured(QString(e.what()));
+    }
+    return rows;
+}
 
-       // qDebug() << "try TO UPDATE";
-        auto query = execAndCheck(QString("SELECT id FROM testing.life_cycle_e WHERE filepath = '%1'")
-                                  .arg(oldFile));
-        if (query.size() == 0)
+void DbFileWatcher::markDeleted(const QVector <PathRow>& rows)
+{
+    if (rows.isEmpty())
+    {
+        return;
+    }
+    QMap <QString, QPair <QStringList, QStringList>> byTable;
+    for (const auto& i : rows)
+    {
+        byTable[i.table].first.append(QString::number(i.id));
+        byTable[i.table].second.append(i.filepath);
+    }
+    try
+    {
+        DbPipeline pipeline(this);
+        for (auto it = byTable.begin(); it != byTable.end(); ++it)
+        {
+            const PathTable& t = pathTable(it.key());
+            pipeline.add(QString("UPDATE %1 t SET %2 = %3 "
+                                 "FROM unnest($1::int[], $2::text[]) AS m(id, filepath) "
+                                 "WHERE t.%4 = m.id AND t.%2 = m.filepath")
+                         .arg(t.table).arg(t.pathColumn).arg(sqlLiteral(t.deletedValue())).arg(t.idColumn),
+                         {Utility::toPgArray(it.value().first), Utility::toPgArray(it.value().second)});
+        }
+        for (const auto& i : pipeline.exec())
         {
-            auto query = execAndCheck(QString("SELECT id FROM testing.attr_value WHERE filepath = '%1'")
-                                      .arg(oldFile));
-            if (query.size() != 0)
+            if (!i.isOk())
             {
-                updateFilepath("testing.attr_value", newFile, query);
+                emit errorOccured(i.error);
             }
         }
-        else
+    }
+    catch (std::exception& e)
+    {
+        emit errorOccured(QString(e.what()));
+    }
+}
+
+QVector <PathRow> DbFileWatcher::getPathsPage(const QString& tableName, qint32 afterId, qint32 limit, const QString& dbPrefix,
+                                              const PathPartition& partition)
+{
+    QVector <PathRow> rows;
+    try
+    {
+        const PathTable& t = pathTable(tableName);
+        QString queryText = QString("SELECT %1, %2 FROM %3 WHERE %1 > $1 AND %4 AND %5")
+                .arg(t.idColumn, t.pathColumn, t.table, referencedCondition(t), prefixCondition(t.pathColumn, "$2"));
+        QVector <QVariant> params {afterId, dbPrefix};
+        appendPartitionCondition(queryText, params, t, partition);
+        queryText.append(QString(" ORDER BY %1 LIMIT $%2").arg(t.idColumn).arg(params.size() + 1));
+        params << limit;
+        PgResult result = execParams(queryText, params);
+        for (int i = 0; i < PQntuples(result.data()); i++)
         {
-            updateFilepath("testing.life_cycle_e", newFile, query);
+            rows.append(PathRow {tableName,
+                                 QString(PQgetvalue(result.data(), i, 0)).toInt(),
+                                 QString(PQgetvalue(result.data(), i, 1))});
         }
     }
     catch (std::exception& e)
     {
-        //qDebug() << QString(e.what());
         emit errorOccured(QString(e.what()));
     }
+    return rows;
+}
+
+DbTask <QVector <PathRow>> DbFileWatcher::getDirectoriesPageAsync(const QString& tableName, qint32 beforeId, qint32 limit,
+                                                                  const QString& dbPrefix, const PathPartition& partition,
+                                                                  DbCancelToken token)
+{
+    const PathTable* t = nullptr;
+    try
+    {
+        t = &pathTable(tableName);
+    }
+    catch (std::exception&)
+    {
+        return DbTask <QVector <PathRow>>::fromError(std::current_exception());
+    }
+    QString queryText = QString("SELECT %1, %2 FROM %3 WHERE %1 < $1 AND %4 AND %5")
+            .arg(t->idColumn, t->pathColumn, t->table, referencedCondition(*t), prefixCondition(t->pathColumn, "$2"));
+    QVector <QVariant> params {beforeId, dbPrefix};
+    appendPartitionCondition(queryText, params, *t, partition);
+    queryText.append(QString(" ORDER BY %1 DESC LIMIT $%2").arg(t->idColumn).arg(params.size() + 1));
+    params << limit;
+    return queryAsync(queryText, params, token).then([tableName](PgResult result)
+    {
+        QVector <PathRow> rows;
+        rows.reserve(PQntuples(result.data()));
+        for (int i = 0; i < PQntuples(result.data()); i++)
+        {
+            rows.append(PathRow {tableName,
+                                 QString(PQgetvalue(result.data(), i, 0)).toInt(),
+                                 QString(PQgetvalue(result.data(), i, 1))});
+        }
+        return rows;
+    });
+}
+
+const QVector <PathTable>& DbFileWatcher::pathTables()
+{
+    return registry().tables;
+}
+
+void DbFileWatcher::setPathTables(const QVector <PathTable>& tables)
+{
+    registry() = PathTableRegistry(tables);
+}
+
+const PathTable& DbFileWatcher::pathTable(const QString& tableName)
+{
+    for (const auto& i : registry().tables)
+    {
+        if (i.table == tableName)
+        {
+            return i;
+        }
+    }
+    throw DbException(("Таблица не зарегистрирована: " + tableName).toStdString());
 }
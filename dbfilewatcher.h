@@ -4,6 +4,41 @@
 #include <QObject>
 #include <database.h>
 #include <QString>
+#include <settledetector.h>
+
+class DbPipeline;
+struct PipelineResult;
+
+// (таблица, id) строк, в которых был изменен путь
+using UpdatedRows = QVector <QPair <QString, qint32>>;
+
+// строка БД, ссылающаяся на путь
+struct PathRow
+{
+    QString table;
+    qint32 id;
+    QString filepath;
+};
+
+// таблица, хранящая пути к файлам
+struct PathTable
+{
+    QString table;
+    QString idColumn = "id";
+    QString pathColumn = "filepath";
+    // начало значения строки, не ссылающейся на файл
+    QString placeholder = "Не указан";
+
+    QString deletedValue() const {return placeholder + " (был удален)";}
+};
+
+// части пространства путей, принадлежащие экземпляру сервиса (см. PartitionCoordinator);
+// count == 0 - без деления
+struct PathPartition
+{
+    qint32 count = 0;
+    QVector <qint32> owned;
+};
 
 class DbFileWatcher : public Database
 {
@@ -11,18 +46,65 @@ class DbFileWatcher : public Database
 public:
     explicit DbFileWatcher(QString dbDriver = "QPSQL", QObject* parent = nullptr);
 
-    QStringList getDirectroriesList();
+    // пути из всех таблиц реестра; если задан dbPrefix, то только начинающиеся с него, если задано деление - только своих частей.
+    // Таблицы читаются одновременно через это подключение и helpers (свободные подключения пула)
+    QStringList getDirectroriesList(const QString& dbPrefix = QString(), bool* ok = nullptr,
+                                    const PathPartition& partition = PathPartition(),
+                                    const QVector <DbFileWatcher*>& helpers = QVector <DbFileWatcher*>());
+
+    // пути передаются в формате БД (без локального префикса корня наблюдения);
+    // обновляет одним запросом все строки всех таблиц реестра с этим путем и под ним (переименование каталога)
+    UpdatedRows tryToUpdatePath(const QString& updatePathOld, const QString& updatePathNew);
 
-    void tryToUpdatePath(const QString& updatePathOld, const QString& updatePathNew);
+    // пакет изменений (старый путь, новый путь) за один конвейер запросов;
+    // ошибка в одном изменении не отменяет остальные. failed - номера невыполненных изменений
+    UpdatedRows tryToUpdatePaths(const QVector <QPair <QString, QString>>& changes, QVector <qint32>* failed = nullptr);
+
+    // запросы tryToUpdatePaths для выполнения в своем конвейере (например, через execAsync)
+    static void addPathUpdates(DbPipeline& pipeline, const QVector <QPair <QString, QString>>& changes);
+
+    // строки, измененные запросами addPathUpdates; ошибки запросов уходят в errorOccured, их номера - в failed
+    UpdatedRows pathUpdateResults(const QVector <PipelineResult>& results, QVector <qint32>* failed = nullptr);
+
+    // все строки всех таблиц реестра, пути которых начинаются с dbPrefix
+    QVector <PathRow> getPathsUnder(const QString& dbPrefix);
+
+    // очередная страница путей таблицы (id > afterId по возрастанию), только начинающиеся с dbPrefix
+    // и, если задано деление, только своих частей
+    QVector <PathRow> getPathsPage(const QString& tableName, qint32 afterId, qint32 limit, const QString& dbPrefix,
+                                   const PathPartition& partition = PathPartition());
+
+    // страница путей таблицы от новых строк к старым (id < beforeId по убыванию) без блокировки потока;
+    // фильтры те же, что у getDirectroriesList
+    DbTask <QVector <PathRow>> getDirectoriesPageAsync(const QString& tableName, qint32 beforeId, qint32 limit,
+                                                       const QString& dbPrefix, const PathPartition& partition,
+                                                       DbCancelToken token = DbCancelToken());
+
+    // помечает строки как удаленные (PathTable::deletedValue), по одному запросу на таблицу;
+    // строка не меняется, если ее путь успели изменить после чтения
+    void markDeleted(const QVector <PathRow>& rows);
+
+    // окончательные размер и время изменения записанных файлов одним запросом на пакет;
+    // таблица (filepath text уникальный, size bigint, mtime timestamptz), пути в формате БД
+    void upsertFileMetadata(const QString& tableName, const QVector <SettledFile>& files);
+
+    // выражение SQL над путем строки таблицы, по хэшу которого путь относится к части
+    static QString partitionKeyExpression(const PathTable& table);
+
+    // реестр таблиц, хранящих пути к файлам
+    static const QVector <PathTable>& pathTables();
+
+    // заменяет реестр; вызывать до создания подключений и потоков наблюдения
+    static void setPathTables(const QVector <PathTable>& tables);
+
+    // описание таблицы реестра по имени; DbException, если таблица не зарегистрирована
+    static const PathTable& pathTable(const QString& tableName);
 
     void setConnectionOptions(Database* newConn) override ;
 
 signals:
 
     void errorOccured(const QString& str);
-
-private:
-    void updateFilepath(const QString& tableName, const QString& updatePathNew, QSqlQuery &query);
 };
 
 #endif // DBFILEWATCHER_H
@@ -1,7 +1,10 @@
 QT -= gui
-QT += sql
+QT += sql concurrent network
 
-CONFIG += c++11 c++14 console
+# C++20 - для co_await над DbTask (dbtask.h)
+CONFIG += c++11 c++14 c++2a console
+# GCC 10 включает сопрограммы только отдельным флагом
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
 CONFIG -= app_bundle
 
 # The following define makes your compiler emit warnings if you use
@@ -20,7 +23,21 @@ SOURCES += \
     database.cpp \
     modifiedfilesystemwatcher.cpp \
     dbfilewatcher.cpp \
-    utility.cpp
+    utility.cpp \
+    connectionpool.cpp \
+    watchservice.cpp \
+    dbpipeline.cpp \
+    querydeadline.cpp \
+    asyncquery.cpp \
+    eventqueue.cpp \
+    reconciler.cpp \
+    tracer.cpp \
+    settledetector.cpp \
+    eventpublisher.cpp \
+    partitioncoordinator.cpp \
+    fsguard.cpp \
+    queryprofiler.cpp \
+    signalwatcher.cpp
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -33,9 +50,30 @@ HEADERS += \
     utility.h \
     modifiedfilesystemwatcher.h \
     dbfilewatcher.h \
-    utility.h
+    utility.h \
+    watchroot.h \
+    connectionpool.h \
+    watchservice.h \
+    dbpipeline.h \
+    querydeadline.h \
+    dbtask.h \
+    asyncquery.h \
+    watchersettings.h \
+    ratelimiter.h \
+    eventqueue.h \
+    reconciler.h \
+    tracer.h \
+    fileidentity.h \
+    settledetector.h \
+    eventpublisher.h \
+    partitioncoordinator.h \
+    fsguard.h \
+    typedrecord.h \
+    queryprofiler.h \
+    signalwatcher.h
 
 win32: LIBS += -L$$PWD/../../../../PostgreSQL/9.6/lib/ -llibpq
+unix: LIBS += -lpq
 
 INCLUDEPATH += $$PWD/../../../../PostgreSQL/9.6/include
 DEPENDPATH += $$PWD/../../../../PostgreSQL/9.6/include
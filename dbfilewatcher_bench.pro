@@ -0,0 +1,64 @@
+# микробенчмарки горячих участков наблюдателя (QTest QBENCHMARK).
+# Результаты в машиночитаемом виде: ./dbfilewatcher_bench -o results.xml,xml (или -csv, -o results.txt,txt)
+QT -= gui
+QT += sql concurrent testlib
+
+# C++20 - для co_await над DbTask (dbtask.h)
+CONFIG += c++11 c++14 c++2a console
+# GCC 10 включает сопрограммы только отдельным флагом
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+CONFIG -= app_bundle
+
+TARGET = dbfilewatcher_bench
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    benchmarks/hotpaths_bench.cpp \
+    database.cpp \
+    modifiedfilesystemwatcher.cpp \
+    dbfilewatcher.cpp \
+    utility.cpp \
+    dbpipeline.cpp \
+    querydeadline.cpp \
+    asyncquery.cpp \
+    eventqueue.cpp \
+    tracer.cpp \
+    settledetector.cpp \
+    connectionpool.cpp \
+    partitioncoordinator.cpp \
+    fsguard.cpp \
+    queryprofiler.cpp \
+    signalwatcher.cpp
+
+HEADERS += \
+    bokzdbexceptions.h \
+    database.h \
+    utility.h \
+    modifiedfilesystemwatcher.h \
+    dbfilewatcher.h \
+    watchroot.h \
+    dbpipeline.h \
+    querydeadline.h \
+    dbtask.h \
+    asyncquery.h \
+    watchersettings.h \
+    ratelimiter.h \
+    eventqueue.h \
+    tracer.h \
+    fileidentity.h \
+    settledetector.h \
+    connectionpool.h \
+    partitioncoordinator.h \
+    fsguard.h \
+    typedrecord.h \
+    queryprofiler.h \
+    signalwatcher.h
+
+win32: LIBS += -L$$PWD/../../../../PostgreSQL/9.6/lib/ -llibpq
+unix: LIBS += -lpq
+
+INCLUDEPATH += $$PWD/../../../../PostgreSQL/9.6/include
+DEPENDPATH += $$PWD/../../../../PostgreSQL/9.6/include
@@ -0,0 +1,64 @@
+# интеграционные тесты с БД (QTest). Подключение из переменных PGHOST, PGPORT, PGDATABASE, PGUSER, PGPASSWORD;
+# без PGDATABASE тесты пропускаются. Запуск: ./dbfilewatcher_dbtest [имя теста]
+QT -= gui
+QT += sql concurrent testlib
+
+# C++20 - для co_await над DbTask (dbtask.h)
+CONFIG += c++11 c++14 c++2a console
+# GCC 10 включает сопрограммы только отдельным флагом
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+CONFIG -= app_bundle
+
+TARGET = dbfilewatcher_dbtest
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    tests/dbtests.cpp \
+    database.cpp \
+    modifiedfilesystemwatcher.cpp \
+    dbfilewatcher.cpp \
+    utility.cpp \
+    dbpipeline.cpp \
+    querydeadline.cpp \
+    asyncquery.cpp \
+    eventqueue.cpp \
+    tracer.cpp \
+    settledetector.cpp \
+    connectionpool.cpp \
+    partitioncoordinator.cpp \
+    fsguard.cpp \
+    queryprofiler.cpp \
+    signalwatcher.cpp
+
+HEADERS += \
+    bokzdbexceptions.h \
+    database.h \
+    utility.h \
+    modifiedfilesystemwatcher.h \
+    dbfilewatcher.h \
+    watchroot.h \
+    dbpipeline.h \
+    querydeadline.h \
+    dbtask.h \
+    asyncquery.h \
+    watchersettings.h \
+    ratelimiter.h \
+    eventqueue.h \
+    tracer.h \
+    fileidentity.h \
+    settledetector.h \
+    connectionpool.h \
+    partitioncoordinator.h \
+    fsguard.h \
+    typedrecord.h \
+    queryprofiler.h \
+    signalwatcher.h
+
+win32: LIBS += -L$$PWD/../../../../PostgreSQL/9.6/lib/ -llibpq
+unix: LIBS += -lpq
+
+INCLUDEPATH += $$PWD/../../../../PostgreSQL/9.6/include
+DEPENDPATH += $$PWD/../../../../PostgreSQL/9.6/include
@@ -0,0 +1,344 @@
+#include "dbpipeline.h"
+#include <tracer.h>
+#include <queryprofiler.h>
+
+DbPipeline::DbPipeline(Database* _db, QObject* parent) :
+    QObject(parent), db(_db) {}
+
+
+qint32 DbPipeline::add(const QString& queryText, const QVector <QVariant>& params)
+{
+    QVector <QByteArray> values;
+    values.reserve(params.size());
+    for (const auto& i : params)
+    {
+        values.append(Database::toPgText(i));
+    }
+    return addEncoded(queryText.toUtf8(), values);
+}
+
+qint32 DbPipeline::addEncoded(const QByteArray& queryText, const QVector <QByteArray>& params)
+{
+    if (active)
+    {
+        throw DbException("Нельзя добавить запрос в выполняющийся конвейер");
+    }
+    statements.append(Statement {queryText, params});
+    return statements.size() - 1;
+}
+
+void DbPipeline::clear()
+{
+    if (active)
+    {
+        throw DbException("Нельзя очистить выполняющийся конвейер");
+    }
+    statements.clear();
+    results.clear();
+}
+
+const QVector <PipelineResult>& DbPipeline::exec()
+{
+    // общий срок на весь конвейер: по его истечении прерывается запрос, выполняемый в этот момент
+    QueryDeadline deadline(db->getConnId(), db->getQueryTimeout());
+    TraceSpan span("pipeline", "db");
+    start(false);
+#ifdef LIBPQ_HAS_PIPELINING
+    while (active && (collected < statements.size() || pendingSyncs > 0))
+    {
+        PGresult* res = PQgetResult(rawConn);
+        if (res == nullptr && !awaitingEnd && PQstatus(rawConn) == CONNECTION_BAD)
+        {
+            failAll(PQerrorMessage(rawConn));
+            break;
+        }
+        handleResult(res);
+    }
+#endif
+    finish();
+    return results;
+}
+
+void DbPipeline::execAsync()
+{
+    start(true);
+    // как и в exec, срок общий на весь конвейер
+    asyncDeadline.reset(new QueryDeadline(db->getConnId(), db->getQueryTimeout()));
+#ifdef LIBPQ_HAS_PIPELINING
+    int socket = PQsocket(rawConn);
+    readNotifier.reset(new QSocketNotifier(socket, QSocketNotifier::Read));
+    writeNotifier.reset(new QSocketNotifier(socket, QSocketNotifier::Write));
+    connect(readNotifier.data(), &QSocketNotifier::activated, this, [this]() {readResults();});
+    connect(writeNotifier.data(), &QSocketNotifier::activated, this, [this]() {flushOutput();});
+    flushOutput();
+#else
+    for (int i = 0; i < results.size(); i++)
+    {
+        emit statementFinished(i);
+    }
+    finish();
+#endif
+}
+
+void DbPipeline::start(bool nonBlocking)
+{
+    if (active)
+    {
+        throw DbException("Конвейер уже выполняется");
+    }
+    db->checkConnection();
+    rawConn = Database::rawConnection(db->getQSqlDatabase());
+    if (rawConn == nullptr)
+    {
+        throw DbException("Драйвер не предоставляет подключение libpq");
+    }
+    results = QVector <PipelineResult>(statements.size());
+    if (QueryProfiler::isEnabled())
+    {
+        profileClock.start();
+        profileMark = 0;
+    }
+    else
+    {
+        profileClock.invalidate();
+    }
+    collected = 0;
+    pendingSyncs = 0;
+    awaitingEnd = false;
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQenterPipelineMode(rawConn) != 1)
+    {
+        throw DbException(PQerrorMessage(rawConn));
+    }
+    PQsetnonblocking(rawConn, nonBlocking ? 1 : 0);
+    active = true;
+    // до выхода из режима конвейера синхронные и асинхронные запросы на подключении запрещены
+    db->activePipeline = this;
+    for (const auto& st : statements)
+    {
+        sendStatement(st);
+        if (PQpipelineSync(rawConn) != 1)
+        {
+            QString error = PQerrorMessage(rawConn);
+            failAll(error);
+            finish();
+            throw DbException(error.toStdString());
+        }
+        ++pendingSyncs;
+        if (!nonBlocking)
+        {
+            // забираем уже пришедшие ответы, чтобы сервер не уперся в заполненный буфер отправки
+            PQconsumeInput(rawConn);
+            while (!PQisBusy(rawConn) && (collected < statements.size() || pendingSyncs > 0))
+            {
+                PGresult* res = PQgetResult(rawConn);
+                if (res == nullptr && !awaitingEnd)
+                {
+                    break;
+                }
+                handleResult(res);
+            }
+        }
+    }
+#else
+    // libpq без поддержки конвейера: запросы выполняются последовательно
+    Q_UNUSED(nonBlocking);
+    active = true;
+    for (int i = 0; i < statements.size(); i++)
+    {
+        try
+        {
+            QVector <const char*> valuePtrs;
+            for (const auto& value : statements[i].params)
+            {
+                valuePtrs.append(value.isNull() ? nullptr : value.constData());
+            }
+            results[i].result = db->execParams(statements[i].text, valuePtrs.size(), valuePtrs.constData());
+        }
+        catch (std::exception& e)
+        {
+            results[i].error = e.what();
+        }
+    }
+    collected = statements.size();
+#endif
+}
+
+void DbPipeline::sendStatement(const Statement& st)
+{
+    QVector <const char*> valuePtrs;
+    valuePtrs.reserve(st.params.size());
+    for (const auto& i : st.params)
+    {
+        valuePtrs.append(i.isNull() ? nullptr : i.constData());
+    }
+    if (PQsendQueryParams(rawConn, st.text.constData(), st.params.size(), nullptr,
+                          valuePtrs.constData(), nullptr, nullptr, 0) != 1)
+    {
+        QString error = PQerrorMessage(rawConn);
+        failAll(error);
+        finish();
+        throw DbException(error.toStdString());
+    }
+}
+
+void DbPipeline::handleResult(PGresult* res)
+{
+    if (res == nullptr)
+    {
+        // конец результатов текущего запроса
+        if (awaitingEnd)
+        {
+            awaitingEnd = false;
+            lastStatementEnd = Tracer::isEnabled() ? Tracer::now() : -1;
+            if (profileClock.isValid() && collected < results.size())
+            {
+                qint64 now = profileClock.nsecsElapsed() / 1000;
+                const PipelineResult& r = results[collected];
+                QueryProfiler::record(QString::fromUtf8(statements[collected].text), now - profileMark,
+                                      r.isOk() ? Database::affectedRows(r.result.data()) : 0, !r.isOk());
+                profileMark = now;
+            }
+            emit statementFinished(collected);
+            ++collected;
+        }
+        return;
+    }
+    switch (PQresultStatus(res))
+    {
+    case PGRES_PIPELINE_SYNC:
+        PQclear(res);
+        --pendingSyncs;
+        if (Tracer::isEnabled() && lastStatementEnd >= 0)
+        {
+            // без явной транзакции запрос фиксируется в точке синхронизации
+            Tracer::complete("commit", "db", lastStatementEnd, Tracer::now() - lastStatementEnd);
+        }
+        return;
+    case PGRES_COMMAND_OK:
+    case PGRES_TUPLES_OK:
+        if (collected < results.size())
+        {
+            results[collected].result = PgResult(res, PQclear);
+        }
+        else
+        {
+            PQclear(res);
+        }
+        break;
+    case PGRES_PIPELINE_ABORTED:
+        if (collected < results.size())
+        {
+            results[collected].error = "Запрос не выполнен из-за ошибки предыдущего запроса конвейера";
+        }
+        PQclear(res);
+        break;
+    default:
+        if (collected < results.size())
+        {
+            results[collected].error = PQresultErrorMessage(res);
+        }
+        PQclear(res);
+        break;
+    }
+    awaitingEnd = true;
+}
+
+void DbPipeline::readResults()
+{
+    if (PQconsumeInput(rawConn) != 1)
+    {
+        failAll(PQerrorMessage(rawConn));
+        finish();
+        return;
+    }
+    while (active && !PQisBusy(rawConn))
+    {
+        if (collected >= statements.size() && pendingSyncs == 0)
+        {
+            finish();
+            return;
+        }
+        PGresult* res = PQgetResult(rawConn);
+        if (res == nullptr && !awaitingEnd)
+        {
+            break;
+        }
+        handleResult(res);
+    }
+    if (active && collected >= statements.size() && pendingSyncs == 0)
+    {
+        finish();
+    }
+}
+
+void DbPipeline::flushOutput()
+{
+    int flushResult = PQflush(rawConn);
+    if (flushResult == -1)
+    {
+        failAll(PQerrorMessage(rawConn));
+        finish();
+        return;
+    }
+    // 1 - в буфере еще остались данные, ждем готовности сокета к записи
+    writeNotifier->setEnabled(flushResult == 1);
+}
+
+void DbPipeline::failAll(const QString& error)
+{
+    for (int i = collected; i < results.size(); i++)
+    {
+        if (results[i].isOk() && results[i].result.isNull())
+        {
+            results[i].error = error;
+        }
+    }
+    collected = results.size();
+    pendingSyncs = 0;
+}
+
+void DbPipeline::finish()
+{
+    if (!active)
+    {
+        return;
+    }
+    // finish может вызываться из обработчика сигнала самого уведомителя
+    if (readNotifier)
+    {
+        readNotifier->setEnabled(false);
+        readNotifier.take()->deleteLater();
+    }
+    if (writeNotifier)
+    {
+        writeNotifier->setEnabled(false);
+        writeNotifier.take()->deleteLater();
+    }
+    asyncDeadline.reset();
+#ifdef LIBPQ_HAS_PIPELINING
+    PQexitPipelineMode(rawConn);
+    PQsetnonblocking(rawConn, 0);
+    db->activePipeline = nullptr;
+#endif
+    active = false;
+    emit finished();
+}
+
+DbPipeline::~DbPipeline()
+{
+    if (active)
+    {
+        // дочитываем оставшиеся ответы, иначе подключение останется в режиме конвейера
+        while (collected < statements.size() || pendingSyncs > 0)
+        {
+            PGresult* res = PQgetResult(rawConn);
+            if (res == nullptr && !awaitingEnd)
+            {
+                break;
+            }
+            handleResult(res);
+        }
+        finish();
+    }
+}
@@ -0,0 +1,132 @@
+#ifndef DBPIPELINE_H
+#define DBPIPELINE_H
+
+#include <QObject>
+#include <QVector>
+#include <QVariant>
+#include <QSocketNotifier>
+#include <QScopedPointer>
+#include <QElapsedTimer>
+#include <database.h>
+
+// результат одного запроса конвейера; ошибка запроса не влияет на остальные
+struct PipelineResult
+{
+    PgResult result;
+    QString error;
+
+    bool isOk() const {return error.isEmpty();}
+
+    // результат или DbException с ошибкой этого запроса
+    PgResult value() const
+    {
+        if (!isOk())
+        {
+            throw DbException(error.toStdString());
+        }
+        return result;
+    }
+};
+
+
+// конвейерное выполнение запросов через libpq (pipeline mode):
+// все запросы отправляются без ожидания ответов, результаты собираются по мере прихода.
+// Каждый запрос выполняется в своей неявной транзакции (после каждого ставится точка синхронизации),
+// если соединение не находится внутри startTransaction().
+// Пока конвейер активен, подключение нельзя использовать через QSqlQuery.
+class DbPipeline : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DbPipeline(Database* _db, QObject* parent = nullptr);
+
+    DbPipeline(const DbPipeline&)                   = delete;
+
+    DbPipeline(DbPipeline&& )                       = delete;
+
+    DbPipeline& operator=(const DbPipeline&)        = delete;
+
+    DbPipeline& operator=(DbPipeline&&)             = delete;
+
+    // добавляет запрос с параметрами $1, $2, ...; возвращает его номер в конвейере
+    qint32 add(const QString& queryText, const QVector <QVariant>& params = QVector <QVariant>());
+
+    // то же для запроса и параметров, уже закодированных в текст libpq (см. TypedRecord)
+    qint32 addEncoded(const QByteArray& queryText, const QVector <QByteArray>& params);
+
+    template <size_t N>
+    qint32 addEncoded(const QByteArray& queryText, const std::array <QByteArray, N>& params)
+    {
+        QVector <QByteArray> values;
+        values.reserve(static_cast <qint32> (N));
+        for (const auto& i : params)
+        {
+            values.append(i);
+        }
+        return addEncoded(queryText, values);
+    }
+
+    qint32 size() const {return statements.size();}
+
+    bool isActive() const {return active;}
+
+    // отправляет все запросы и ждет результаты
+    const QVector <PipelineResult>& exec();
+
+    // отправляет все запросы и сразу возвращает управление,
+    // результаты приходят через statementFinished/finished (нужен цикл событий потока)
+    void execAsync();
+
+    const QVector <PipelineResult>& getResults() const {return results;}
+
+    // очищает очередь и результаты для повторного использования
+    void clear();
+
+    ~DbPipeline();
+
+signals:
+    void statementFinished(qint32 index);
+
+    void finished();
+
+private:
+    // запрос хранится уже закодированным для libpq
+    struct Statement
+    {
+        QByteArray text;
+        QVector <QByteArray> params;
+    };
+
+    void start(bool nonBlocking);
+
+    void sendStatement(const Statement& st);
+
+    void handleResult(PGresult* res);
+
+    void readResults();
+
+    void flushOutput();
+
+    void finish();
+
+    void failAll(const QString& error);
+
+    Database* db;
+    PGconn* rawConn = nullptr;
+    QVector <Statement> statements;
+    QVector <PipelineResult> results;
+    qint32 collected = 0;
+    qint32 pendingSyncs = 0;
+    bool awaitingEnd = false;
+    bool active = false;
+    qint64 lastStatementEnd = -1;
+    // для QueryProfiler время запроса - от окончания предыдущего результата (или отправки) до окончания своего
+    QElapsedTimer profileClock;
+    qint64 profileMark = 0;
+    QScopedPointer <QSocketNotifier> readNotifier;
+    QScopedPointer <QSocketNotifier> writeNotifier;
+    // срок асинхронного выполнения, снимается в finish
+    QScopedPointer <QueryDeadline> asyncDeadline;
+};
+
+#endif // DBPIPELINE_H
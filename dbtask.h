@@ -0,0 +1,271 @@
+#ifndef DBTASK_H
+#define DBTASK_H
+
+#include <QSharedPointer>
+#include <QVector>
+#include <QMap>
+#include <functional>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <coroutine>
+
+// токен отмены асинхронных запросов; один токен можно передать нескольким запросам.
+// Как и DbTask, используется в потоке, которому принадлежит подключение
+class DbCancelToken
+{
+public:
+    DbCancelToken() : state(QSharedPointer <State>::create()) {}
+
+    void cancel()
+    {
+        if (state->canceled)
+        {
+            return;
+        }
+        state->canceled = true;
+        auto callbacks = state->callbacks;
+        state->callbacks.clear();
+        for (auto& i : callbacks)
+        {
+            i();
+        }
+    }
+
+    bool isCanceled() const {return state->canceled;}
+
+    qint32 onCancel(std::function <void()> callback)
+    {
+        if (state->canceled)
+        {
+            callback();
+            return -1;
+        }
+        state->callbacks.insert(state->nextId, std::move(callback));
+        return state->nextId++;
+    }
+
+    void removeCallback(qint32 id)
+    {
+        state->callbacks.remove(id);
+    }
+
+private:
+    struct State
+    {
+        bool canceled = false;
+        qint32 nextId = 0;
+        QMap <qint32, std::function <void()>> callbacks;
+    };
+
+    QSharedPointer <State> state;
+};
+
+
+// результат асинхронной операции: значение или исключение.
+// Продолжения вызываются в потоке, где операция завершилась (в потоке подключения).
+// DbTask можно ожидать через co_await и возвращать из сопрограммы
+template <typename T>
+class DbTask
+{
+public:
+    DbTask() : state(QSharedPointer <State>::create()) {}
+
+    static DbTask fromValue(T value)
+    {
+        DbTask task;
+        task.setValue(std::move(value));
+        return task;
+    }
+
+    static DbTask fromError(std::exception_ptr error)
+    {
+        DbTask task;
+        task.setError(error);
+        return task;
+    }
+
+    bool isReady() const {return state->ready;}
+
+    bool hasError() const {return static_cast <bool> (state->error);}
+
+    // значение или исключение операции; вызывать только после isReady()
+    T get() const
+    {
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+        return state->value;
+    }
+
+    void setValue(T value)
+    {
+        if (state->ready)
+        {
+            return;
+        }
+        state->value = std::move(value);
+        markReady();
+    }
+
+    void setError(std::exception_ptr error)
+    {
+        if (state->ready)
+        {
+            return;
+        }
+        state->error = error;
+        markReady();
+    }
+
+    void onReady(std::function <void()> callback) const
+    {
+        if (state->ready)
+        {
+            callback();
+        }
+        else
+        {
+            state->continuations.append(std::move(callback));
+        }
+    }
+
+    // продолжение с обычной функцией: DbTask<T> -> DbTask<U>; исключения передаются дальше
+    template <typename Function, typename U = decltype(std::declval <Function&>()(std::declval <T>()))>
+    DbTask <U> then(Function&& function) const
+    {
+        DbTask <U> next;
+        DbTask self = *this;
+        onReady([self, next, function]() mutable
+        {
+            try
+            {
+                next.setValue(function(self.get()));
+            }
+            catch (...)
+            {
+                next.setError(std::current_exception());
+            }
+        });
+        return next;
+    }
+
+    // продолжение с асинхронной функцией: T -> DbTask<U>, например следующий запрос
+    template <typename Function, typename Next = decltype(std::declval <Function&>()(std::declval <T>()))>
+    Next thenAsync(Function&& function) const
+    {
+        Next next;
+        DbTask self = *this;
+        onReady([self, next, function]() mutable
+        {
+            try
+            {
+                Next inner = function(self.get());
+                inner.onReady([inner, next]() mutable
+                {
+                    try
+                    {
+                        next.setValue(inner.get());
+                    }
+                    catch (...)
+                    {
+                        next.setError(std::current_exception());
+                    }
+                });
+            }
+            catch (...)
+            {
+                next.setError(std::current_exception());
+            }
+        });
+        return next;
+    }
+
+    struct promise_type
+    {
+        DbTask task;
+
+        DbTask get_return_object() {return task;}
+
+        std::suspend_never initial_suspend() noexcept {return {};}
+
+        std::suspend_never final_suspend() noexcept {return {};}
+
+        void return_value(T value) {task.setValue(std::move(value));}
+
+        void unhandled_exception() {task.setError(std::current_exception());}
+    };
+
+    bool await_ready() const noexcept {return isReady();}
+
+    void await_suspend(std::coroutine_handle <> handle) const
+    {
+        onReady([handle]() {handle.resume();});
+    }
+
+    T await_resume() const {return get();}
+
+private:
+    struct State
+    {
+        bool ready = false;
+        T value {};
+        std::exception_ptr error;
+        QVector <std::function <void()>> continuations;
+    };
+
+    void markReady()
+    {
+        state->ready = true;
+        auto continuations = state->continuations;
+        state->continuations.clear();
+        for (auto& i : continuations)
+        {
+            i();
+        }
+    }
+
+    QSharedPointer <State> state;
+};
+
+
+// завершается, когда завершены все задачи; ошибка - первая по порядку из задач
+template <typename T>
+DbTask <QVector <T>> whenAll(const QVector <DbTask <T>>& tasks)
+{
+    DbTask <QVector <T>> all;
+    if (tasks.isEmpty())
+    {
+        all.setValue(QVector <T>());
+        return all;
+    }
+    auto remaining = QSharedPointer <qint32>::create(tasks.size());
+    for (const auto& i : tasks)
+    {
+        i.onReady([tasks, all, remaining]() mutable
+        {
+            if (--(*remaining) != 0)
+            {
+                return;
+            }
+            QVector <T> values;
+            values.reserve(tasks.size());
+            try
+            {
+                for (const auto& task : tasks)
+                {
+                    values.append(task.get());
+                }
+                all.setValue(values);
+            }
+            catch (...)
+            {
+                all.setError(std::current_exception());
+            }
+        });
+    }
+    return all;
+}
+
+#endif // DBTASK_H
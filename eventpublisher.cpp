@@ -0,0 +1,155 @@
+#include "eventpublisher.h"
+#include <QDataStream>
+#include <QtEndian>
+#include <modifiedfilesystemwatcher.h>
+
+constexpr const qint32 flushInterval = 50;
+constexpr const qint32 maxBatch = 1000;
+
+EventPublisher::EventPublisher(qint32 _history, qint32 _maxBacklog, QObject* parent) :
+    QObject(parent), history(qMax(_history, 1)), maxBacklog(_maxBacklog), server(this), flushTimer(this)
+{
+    connect(&server, &QLocalServer::newConnection, this, &EventPublisher::onConnection);
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(flushInterval);
+    connect(&flushTimer, &QTimer::timeout, this, &EventPublisher::flush);
+}
+
+bool EventPublisher::listen(const QString& name)
+{
+    // сокет от аварийно завершенного экземпляра
+    QLocalServer::removeServer(name);
+    return server.listen(name);
+}
+
+void EventPublisher::publish(EventType type, const QString& from, const QString& to)
+{
+    events.enqueue(Event {nextSeq++, type, from.toUtf8(), to.toUtf8()});
+    while (events.size() > history)
+    {
+        events.dequeue();
+    }
+    // события копятся в пакет, чтобы не писать в сокеты на каждое
+    if (nextSeq - unsentSeq >= maxBatch)
+    {
+        flush();
+    }
+    else if (!flushTimer.isActive())
+    {
+        flushTimer.start();
+    }
+}
+
+void EventPublisher::flush()
+{
+    flushTimer.stop();
+    const quint64 from = unsentSeq;
+    unsentSeq = nextSeq;
+    const auto sockets = subscribers.keys();
+    for (auto* socket : sockets)
+    {
+        if (subscribers.value(socket).subscribed)
+        {
+            sendFrom(socket, from);
+        }
+    }
+}
+
+void EventPublisher::onConnection()
+{
+    while (QLocalSocket* socket = server.nextPendingConnection())
+    {
+        subscribers.insert(socket, Subscriber());
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() {onHello(socket);});
+        connect(socket, &QLocalSocket::disconnected, this, [this, socket]()
+        {
+            subscribers.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void EventPublisher::onHello(QLocalSocket* socket)
+{
+    auto it = subscribers.find(socket);
+    if (it == subscribers.end() || it->subscribed)
+    {
+        // после приветствия подписчик ничего не присылает
+        socket->readAll();
+        return;
+    }
+    it->hello.append(socket->read(sizeof(quint64) - it->hello.size()));
+    if (it->hello.size() < static_cast <int> (sizeof(quint64)))
+    {
+        return;
+    }
+    quint64 resumeFrom = qFromBigEndian <quint64> (reinterpret_cast <const uchar*> (it->hello.constData()));
+    it->subscribed = true;
+    // новые события, еще не разосланные, подписчик получит со следующим пакетом
+    if (resumeFrom != 0 && resumeFrom < unsentSeq)
+    {
+        sendFrom(socket, resumeFrom);
+    }
+}
+
+bool EventPublisher::sendFrom(QLocalSocket* socket, quint64 from)
+{
+    if (events.isEmpty() || from >= unsentSeq)
+    {
+        return true;
+    }
+    const quint64 oldest = events.head().seq;
+    if (from < oldest)
+    {
+        if (!send(socket, encodeFrame(2, oldest, {})))
+        {
+            return false;
+        }
+        from = oldest;
+    }
+    QVector <const Event*> batch;
+    for (qint32 i = static_cast <qint32> (from - oldest); i < events.size() && events[i].seq < unsentSeq; i++)
+    {
+        batch.append(&events[i]);
+        if (batch.size() == maxBatch)
+        {
+            if (!send(socket, encodeFrame(1, batch.first()->seq, batch)))
+            {
+                return false;
+            }
+            batch.clear();
+        }
+    }
+    return batch.isEmpty() || send(socket, encodeFrame(1, batch.first()->seq, batch));
+}
+
+bool EventPublisher::send(QLocalSocket* socket, const QByteArray& frame)
+{
+    if (socket->bytesToWrite() + frame.size() > maxBacklog)
+    {
+        ModifiedFileSystemWatcher::writeLog("Event subscriber is too slow, disconnected");
+        subscribers.remove(socket);
+        socket->abort();
+        socket->deleteLater();
+        return false;
+    }
+    socket->write(frame);
+    return true;
+}
+
+QByteArray EventPublisher::encodeFrame(quint8 frameType, quint64 firstSeq, const QVector <const Event*>& events)
+{
+    QByteArray frame;
+    QDataStream stream(&frame, QIODevice::WriteOnly);
+    stream << quint32(0) << frameType << firstSeq << quint32(events.size());
+    for (const auto* i : events)
+    {
+        stream << static_cast <quint8> (i->type) << i->from;
+        if (i->type == Renamed)
+        {
+            stream << i->to;
+        }
+    }
+    qToBigEndian <quint32> (static_cast <quint32> (frame.size() - sizeof(quint32)), reinterpret_cast <uchar*> (frame.data()));
+    return frame;
+}
@@ -0,0 +1,101 @@
+#ifndef EVENTPUBLISHER_H
+#define EVENTPUBLISHER_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTimer>
+#include <QHash>
+#include <QQueue>
+#include <QByteArray>
+
+// рассылка событий файловой системы другим процессам хоста через локальный сокет (QLocalServer).
+//
+// Подписчик после подключения отправляет 8 байт quint64 (big endian) - номер первого нужного события,
+// 0 - только новые. Сервер отвечает кадрами:
+//   quint32 длина кадра без этого поля
+//   quint8  тип кадра: 1 - события, 2 - разрыв (запрошенные события уже вытеснены из буфера)
+//   quint64 номер первого события кадра (для разрыва - самого раннего доступного)
+//   quint32 число событий
+//   события: quint8 тип (0 - появление, 1 - удаление, 2 - переименование),
+//            путь (quint32 длина + UTF-8), для переименования еще новый путь в том же виде
+// Номера событий идут подряд, по ним подписчик возобновляет прием после переподключения.
+// Подписчик, не успевающий забирать данные, отключается: наблюдение его не ждет
+class EventPublisher : public QObject
+{
+    Q_OBJECT
+public:
+    enum EventType : quint8
+    {
+        Added = 0,
+        Deleted = 1,
+        Renamed = 2
+    };
+
+    // history - сколько последних событий хранится для возобновления; maxBacklog - байт
+    // неотправленных данных, после которых подписчик отключается
+    EventPublisher(qint32 _history = 65536, qint32 _maxBacklog = 4 * 1024 * 1024, QObject* parent = nullptr);
+
+    EventPublisher(const EventPublisher&)                   = delete;
+
+    EventPublisher(EventPublisher&& )                       = delete;
+
+    EventPublisher& operator=(const EventPublisher&)        = delete;
+
+    EventPublisher& operator=(EventPublisher&&)             = delete;
+
+    bool listen(const QString& name);
+
+    QString errorString() const {return server.errorString();}
+
+    quint64 lastSequence() const {return nextSeq - 1;}
+
+public slots:
+    void publishAdded(const QString& path) {publish(Added, path, QString());}
+
+    void publishDeleted(const QString& path) {publish(Deleted, path, QString());}
+
+    void publishRenamed(const QString& from, const QString& to) {publish(Renamed, from, to);}
+
+private:
+    struct Event
+    {
+        quint64 seq;
+        EventType type;
+        QByteArray from;
+        QByteArray to;
+    };
+
+    struct Subscriber
+    {
+        bool subscribed = false;
+        QByteArray hello;
+    };
+
+    void publish(EventType type, const QString& from, const QString& to);
+
+    void flush();
+
+    void onConnection();
+
+    void onHello(QLocalSocket* socket);
+
+    // отправка событий начиная с номера from; false - подписчик отключен
+    bool sendFrom(QLocalSocket* socket, quint64 from);
+
+    bool send(QLocalSocket* socket, const QByteArray& frame);
+
+    static QByteArray encodeFrame(quint8 frameType, quint64 firstSeq, const QVector <const Event*>& events);
+
+    qint32 history;
+    qint32 maxBacklog;
+    quint64 nextSeq = 1;
+    // первый номер, еще не разосланный подписчикам
+    quint64 unsentSeq = 1;
+    QQueue <Event> events;
+    QLocalServer server;
+    QHash <QLocalSocket*, Subscriber> subscribers;
+    QTimer flushTimer;
+};
+
+#endif // EVENTPUBLISHER_H
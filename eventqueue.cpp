@@ -0,0 +1,160 @@
+#include "eventqueue.h"
+#include <tracer.h>
+
+// сколько последних изменений просматривается при склеивании
+constexpr const qint32 coalesceWindow = 256;
+
+// один путь совпадает с другим или лежит под ним
+static bool related(const QString& a, const QString& b)
+{
+    if (a.isEmpty() || b.isEmpty())
+    {
+        return false;
+    }
+    if (a.size() == b.size())
+    {
+        return a == b;
+    }
+    const QString& shorter = a.size() < b.size() ? a : b;
+    const QString& longer = a.size() < b.size() ? b : a;
+    return longer.startsWith(shorter) && (shorter.endsWith('/') || longer[shorter.size()] == '/');
+}
+
+void PathEventQueue::push(const QString& from, const QString& to)
+{
+    ++stats.enqueued;
+    QString dir = directoryOf(from);
+    const bool deletion = to.isEmpty();
+    if (deletion && dirty.contains(dir))
+    {
+        // каталог все равно будет сверен целиком
+        ++stats.dropped;
+        return;
+    }
+
+    if (!deletion)
+    {
+        auto same = coalesceTarget(to, from, to);
+        if (same != changes.end() && same.value().from == from)
+        {
+            // повтор того же изменения
+            ++stats.coalesced;
+            return;
+        }
+    }
+    auto it = coalesceTarget(from, from, to);
+    if (it != changes.end())
+    {
+        ++stats.coalesced;
+        forgetTarget(it);
+        it.value().to = to;
+        if (to == it.value().from)
+        {
+            // переименовали обратно
+            changes.erase(it);
+            --depth;
+        }
+        else if (!deletion)
+        {
+            byTarget.insert(to, it.key());
+        }
+        return;
+    }
+
+    if (deletion && depth >= capacity)
+    {
+        markDirty(dir);
+        return;
+    }
+
+    const qint64 seq = nextSeq++;
+    changes.insert(seq, PathChange {from, to, Tracer::isEnabled() ? Tracer::now() : -1});
+    if (!deletion)
+    {
+        byTarget.insert(to, seq);
+    }
+    ++depth;
+    stats.maxDepth = qMax(stats.maxDepth, depth);
+}
+
+QVector <PathChange> PathEventQueue::take(qint32 count)
+{
+    QVector <PathChange> result;
+    while (result.size() < count && !changes.isEmpty())
+    {
+        auto it = changes.begin();
+        forgetTarget(it);
+        result.append(it.value());
+        changes.erase(it);
+        --depth;
+    }
+    return result;
+}
+
+QMap <qint64, PathChange>::iterator PathEventQueue::coalesceTarget(const QString& target, const QString& from,
+                                                                   const QString& to)
+{
+    auto found = byTarget.find(target);
+    if (found == byTarget.end() || nextSeq - found.value() > coalesceWindow)
+    {
+        return changes.end();
+    }
+    auto it = changes.find(found.value());
+    // склеенное изменение встает на место более раннего: между ними не должно быть изменений тех же путей
+    auto later = it;
+    for (++later; later != changes.end(); ++later)
+    {
+        const PathChange& c = later.value();
+        if (related(c.from, from) || related(c.to, from) || related(c.from, to) || related(c.to, to))
+        {
+            return changes.end();
+        }
+    }
+    return it;
+}
+
+void PathEventQueue::forgetTarget(QMap <qint64, PathChange>::iterator it)
+{
+    auto target = byTarget.find(it.value().to);
+    if (target != byTarget.end() && target.value() == it.key())
+    {
+        byTarget.erase(target);
+    }
+}
+
+QString PathEventQueue::takeDirty()
+{
+    QString dir = dirtyOrder.dequeue();
+    dirty.remove(dir);
+    return dir;
+}
+
+void PathEventQueue::requestRescan(const QString& dir)
+{
+    if (!dirty.contains(dir))
+    {
+        dirty.insert(dir);
+        dirtyOrder.enqueue(dir);
+    }
+}
+
+EventQueueStats PathEventQueue::getStats() const
+{
+    EventQueueStats current = stats;
+    current.depth = depth;
+    current.dirtyDirs = dirty.size();
+    return current;
+}
+
+QString PathEventQueue::directoryOf(const QString& path)
+{
+    int pos = path.lastIndexOf("/");
+    return pos == -1 ? QString() : path.left(pos);
+}
+
+// принятые изменения каталога остаются в очереди: сверка только дополняет их удалениями
+void PathEventQueue::markDirty(const QString& dir)
+{
+    ++stats.dropped;
+    requestRescan(dir);
+}
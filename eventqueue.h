@@ -0,0 +1,86 @@
+#ifndef EVENTQUEUE_H
+#define EVENTQUEUE_H
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QQueue>
+#include <QMap>
+
+// изменение пути: to пустой - файл/каталог удален
+struct PathChange
+{
+    QString from;
+    QString to;
+    // время постановки в очередь для трассировки, мкс Tracer::now(); -1 - не трассируется
+    qint64 queuedAt = -1;
+};
+
+struct EventQueueStats
+{
+    qint64 enqueued = 0;
+    qint64 coalesced = 0;
+    qint64 dropped = 0;
+    qint64 applied = 0;
+    qint64 rescans = 0;
+    qint32 depth = 0;
+    qint32 maxDepth = 0;
+    qint32 dirtyDirs = 0;
+};
+
+// ограниченная очередь изменений между наблюдателем и БД.
+// Изменения выдаются в порядке поступления и склеиваются (a->b, b->c дает a->c; a->b, удаление b - удаление a),
+// если после склеиваемого изменения в очереди нет изменений тех же путей и путей под ними.
+// При переполнении отбрасываются только удаления, а их каталог помечается для повторной сверки с БД;
+// переименования принимаются всегда: сверка находит только отсутствующие файлы и записала бы их удаленными
+class PathEventQueue
+{
+public:
+    explicit PathEventQueue(qint32 _capacity) : capacity(_capacity) {}
+
+    void push(const QString& from, const QString& to);
+
+    // до count изменений в порядке поступления
+    QVector <PathChange> take(qint32 count);
+
+    bool isEmpty() const {return depth == 0;}
+
+    qint32 size() const {return depth;}
+
+    bool hasDirty() const {return !dirtyOrder.isEmpty();}
+
+    QString takeDirty();
+
+    // сверка каталога по внешней причине (например, потерян снимок); изменения в очереди сохраняются
+    void requestRescan(const QString& dir);
+
+    void markApplied(qint32 count) {stats.applied += count;}
+
+    void markRescanned() {++stats.rescans;}
+
+    EventQueueStats getStats() const;
+
+    static QString directoryOf(const QString& path);
+
+private:
+    void markDirty(const QString& dir);
+
+    // последнее изменение с новым путем target, если после него нет изменений путей from и to, иначе changes.end()
+    QMap <qint64, PathChange>::iterator coalesceTarget(const QString& target, const QString& from, const QString& to);
+
+    void forgetTarget(QMap <qint64, PathChange>::iterator it);
+
+    qint32 capacity;
+    qint32 depth = 0;
+    qint64 nextSeq = 0;
+    // изменения по номеру поступления
+    QMap <qint64, PathChange> changes;
+    // номер последнего изменения с данным новым путем
+    QHash <QString, qint64> byTarget;
+    QSet <QString> dirty;
+    QQueue <QString> dirtyOrder;
+    EventQueueStats stats;
+};
+
+#endif // EVENTQUEUE_H
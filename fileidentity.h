@@ -0,0 +1,52 @@
+#ifndef FILEIDENTITY_H
+#define FILEIDENTITY_H
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QString>
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+
+// идентичность файла для сопоставления удаления и появления при перемещении:
+// устройство и inode, где они есть, иначе размер и время изменения
+struct FileIdentity
+{
+    quint64 device = 0;
+    quint64 inode = 0;
+    qint64 size = -1;
+    qint64 mtime = 0;
+
+    bool isValid() const {return inode != 0 || size >= 0;}
+
+    bool matches(const FileIdentity& other) const
+    {
+        if (inode != 0 && other.inode != 0)
+        {
+            return device == other.device && inode == other.inode;
+        }
+        return size >= 0 && size == other.size && mtime == other.mtime;
+    }
+
+    static FileIdentity of(const QString& path)
+    {
+        FileIdentity id;
+#ifdef Q_OS_UNIX
+        struct stat st;
+        if (::stat(QFile::encodeName(path).constData(), &st) == 0)
+        {
+            id.device = static_cast <quint64> (st.st_dev);
+            id.inode = static_cast <quint64> (st.st_ino);
+        }
+#endif
+        QFileInfo info(path);
+        if (info.exists())
+        {
+            id.size = info.size();
+            id.mtime = info.lastModified().toMSecsSinceEpoch();
+        }
+        return id;
+    }
+};
+
+#endif // FILEIDENTITY_H
@@ -0,0 +1,127 @@
+#include "fsguard.h"
+#include <QFile>
+#include <QTextStream>
+#include <modifiedfilesystemwatcher.h>
+
+FsGuard& FsGuard::instance()
+{
+    // не разрушается при выходе: пул потоков дожидался бы операций на мертвой шаре
+    static FsGuard* guard = new FsGuard();
+    return *guard;
+}
+
+FsGuard::FsGuard()
+{
+#ifdef Q_OS_LINUX
+    // чтение списка монтирования не обращается к самим точкам
+    QFile file("/proc/self/mounts");
+    if (file.open(QIODevice::ReadOnly))
+    {
+        QTextStream in(&file);
+        for (QString line = in.readLine(); !line.isNull(); line = in.readLine())
+        {
+            QStringList fields = line.split(' ');
+            if (fields.size() > 1)
+            {
+                mountPoints.append(fields[1].replace("\\040", " "));
+            }
+        }
+    }
+#endif
+}
+
+void FsGuard::setTimeout(qint32 ms)
+{
+    timeout = ms;
+}
+
+QString FsGuard::mountOf(const QString& path)
+{
+    if (path.startsWith("//") || path.startsWith("\\\\"))
+    {
+        QStringList parts = QString(path).replace('\\', '/').split('/', QString::SkipEmptyParts);
+        return "//" + parts.mid(0, 2).join("/");
+    }
+    if (path.size() > 1 && path[1] == ':')
+    {
+        return path.left(2).toUpper();
+    }
+    QString best = "/";
+    for (const auto& i : mountPoints)
+    {
+        if (i.size() > best.size() && (path == i || path.startsWith(i + "/")))
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+QThreadPool* FsGuard::workerOf(const QString& mount)
+{
+    QMutexLocker lock(&mutex);
+    QThreadPool*& pool = workers[mount];
+    if (pool == nullptr)
+    {
+        pool = new QThreadPool();
+        pool->setMaxThreadCount(threadsPerMount);
+    }
+    return pool;
+}
+
+bool FsGuard::isHealthy(const QString& path)
+{
+    if (timeout <= 0)
+    {
+        return true;
+    }
+    const QString mount = mountOf(path);
+    QMutexLocker lock(&mutex);
+    return !mounts.value(mount).stalled;
+}
+
+bool FsGuard::begin(const QString& mount)
+{
+    QMutexLocker lock(&mutex);
+    MountState& state = mounts[mount];
+    if (state.stalled)
+    {
+        return false;
+    }
+    ++state.running;
+    return true;
+}
+
+void FsGuard::end(const QString& mount)
+{
+    QMutexLocker lock(&mutex);
+    --mounts[mount].running;
+}
+
+void FsGuard::stalled(const QString& mount)
+{
+    QMutexLocker lock(&mutex);
+    MountState& state = mounts[mount];
+    if (!state.stalled)
+    {
+        state.stalled = true;
+        state.stalledFor.start();
+        lock.unlock();
+        ModifiedFileSystemWatcher::writeLog("Mount stalled, skipping: " + mount);
+    }
+}
+
+// вызывается потоком ввода-вывода, когда зависшая операция все-таки завершилась
+void FsGuard::recovered(const QString& mount)
+{
+    QMutexLocker lock(&mutex);
+    MountState& state = mounts[mount];
+    --state.running;
+    if (state.stalled && state.running == 0)
+    {
+        state.stalled = false;
+        qint64 duration = state.stalledFor.elapsed();
+        lock.unlock();
+        ModifiedFileSystemWatcher::writeLog(QString("Mount recovered after %1 ms: %2").arg(duration).arg(mount));
+    }
+}
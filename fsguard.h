@@ -0,0 +1,159 @@
+#ifndef FSGUARD_H
+#define FSGUARD_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QtConcurrent>
+#include <functional>
+
+// обращения к файловой системе с ограничением времени: зависший сервер SMB не должен
+// останавливать поток наблюдателя. У каждой точки монтирования свой небольшой пул потоков
+// ввода-вывода, поэтому зависшая шара не задерживает обращения к остальным. Срок отсчитывается
+// с начала выполнения операции, а не с постановки в очередь. Не уложившаяся операция делает
+// точку монтирования зависшей: новые обращения к ней сразу отклоняются, ожидающие в ее очереди
+// отменяются, пока зависшие операции не завершатся. Общий для всех потоков сервиса
+class FsGuard
+{
+public:
+    static FsGuard& instance();
+
+    FsGuard(const FsGuard&)                   = delete;
+
+    FsGuard(FsGuard&& )                       = delete;
+
+    FsGuard& operator=(const FsGuard&)        = delete;
+
+    FsGuard& operator=(FsGuard&&)             = delete;
+
+    // срок одной операции, мс; 0 - операции выполняются в вызывающем потоке без ограничения
+    void setTimeout(qint32 ms);
+
+    // число потоков ввода-вывода каждой точки монтирования; задать до первого обращения
+    void setThreadCount(qint32 count) {threadsPerMount = qMax(count, 1);}
+
+    bool isHealthy(const QString& path);
+
+    // выполняет op для пути path; false - точка монтирования зависла или не ответила за срок.
+    // op не должна ссылаться на данные вызывающего: при превышении срока она продолжит выполняться
+    template <typename T>
+    bool call(const QString& path, std::function <T()> op, T& result)
+    {
+        qint32 deadline = timeout;
+        if (deadline <= 0)
+        {
+            result = op();
+            return true;
+        }
+        const QString mount = mountOf(path);
+        if (!begin(mount))
+        {
+            return false;
+        }
+        auto state = QSharedPointer <Call <T>>::create();
+        QtConcurrent::run(workerOf(mount), [this, state, op, mount]()
+        {
+            {
+                QMutexLocker lock(&state->mutex);
+                if (state->abandoned)
+                {
+                    // вызывающий перестал ждать, пока операция стояла в очереди зависшей шары
+                    lock.unlock();
+                    recovered(mount);
+                    return;
+                }
+                state->started = true;
+                state->clock.start();
+            }
+            T value = op();
+            QMutexLocker lock(&state->mutex);
+            state->value = value;
+            state->done = true;
+            state->finished.wakeAll();
+            if (state->abandoned)
+            {
+                lock.unlock();
+                recovered(mount);
+            }
+        });
+        QMutexLocker lock(&state->mutex);
+        while (!state->done)
+        {
+            if (!state->started)
+            {
+                // в очереди за другими операциями этой шары срок не идет, но если одна из них
+                // зависла, ожидание отменяется, а здоровой шара не объявляется
+                if (!isHealthy(path))
+                {
+                    state->abandoned = true;
+                    return false;
+                }
+                state->finished.wait(&state->mutex, static_cast <unsigned long> (deadline));
+                continue;
+            }
+            const qint64 remaining = deadline - state->clock.elapsed();
+            if (remaining <= 0)
+            {
+                state->abandoned = true;
+                lock.unlock();
+                stalled(mount);
+                return false;
+            }
+            state->finished.wait(&state->mutex, static_cast <unsigned long> (remaining));
+        }
+        result = state->value;
+        lock.unlock();
+        end(mount);
+        return true;
+    }
+
+    // точка монтирования пути: //сервер/ресурс, диск Windows или самая длинная точка из /proc/self/mounts
+    QString mountOf(const QString& path);
+
+private:
+    FsGuard();
+
+    template <typename T>
+    struct Call
+    {
+        QMutex mutex;
+        QWaitCondition finished;
+        bool started = false;
+        bool done = false;
+        bool abandoned = false;
+        QElapsedTimer clock;
+        T value {};
+    };
+
+    struct MountState
+    {
+        bool stalled = false;
+        qint32 running = 0;
+        QElapsedTimer stalledFor;
+    };
+
+    bool begin(const QString& mount);
+
+    void end(const QString& mount);
+
+    void stalled(const QString& mount);
+
+    void recovered(const QString& mount);
+
+    QThreadPool* workerOf(const QString& mount);
+
+    qint32 timeout = 5000;
+    qint32 threadsPerMount = 4;
+    QMutex mutex;
+    // пулы не удаляются: их потоки могут навсегда остаться в вызове к мертвой шаре
+    QHash <QString, QThreadPool*> workers;
+    QHash <QString, MountState> mounts;
+    QStringList mountPoints;
+};
+
+#endif // FSGUARD_H
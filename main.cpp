@@ -1,33 +1,293 @@
 #include <QCoreApplication>
-#include <modifiedfilesystemwatcher.h>
+#include <QCommandLineParser>
+#include <watchservice.h>
+#include <tracer.h>
+#include <fsguard.h>
+#include <queryprofiler.h>
+#include <signalwatcher.h>
 #include <QTimer>
 #include <QTextCodec>
 #include <QDebug>
 
 #define ONE_MINUTE 60000
-#define ARG_SIZE 6
+#define ARG_SIZE 5
+#define DEFAULT_ROOT "//Camera20/DATA/"
+#define DEFAULT_QUERY_TIMEOUT 30000
+#define PUBLISH_HISTORY 65536
+#define PUBLISH_MAX_BACKLOG (4 * 1024 * 1024)
 
 int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
-    if (a.arguments().size() == ARG_SIZE)
-    {
-        DbFileWatcher* db = new DbFileWatcher();
-        DbFileSystemWatcher* watcher = new DbFileSystemWatcher(db, &a);
+    // SIGTERM, SIGINT и закрытие консоли завершают цикл событий: без этого aboutToQuit не срабатывает,
+    // и при остановке не пишутся очередь, трассировка и профиль, а части не освобождаются
+    SignalWatcher::quitOnTermination(&a);
+
+    QCommandLineParser parser;
+    parser.addPositionalArgument("dbName", "Database name");
+    parser.addPositionalArgument("host", "Database host");
+    parser.addPositionalArgument("port", "Database port");
+    parser.addPositionalArgument("userName", "Database user");
+    parser.addPositionalArgument("password", "Database password");
+    QCommandLineOption rootOption("root", "Watch root with optional db path prefix, may be repeated",
+                                  "localPrefix[=dbPrefix]");
+    QCommandLineOption poolSizeOption("pool-size", "Max database connections shared by all roots", "count");
+    QCommandLineOption queryTimeoutOption("query-timeout", "Query deadline in ms, 0 disables", "ms",
+                                          QString::number(DEFAULT_QUERY_TIMEOUT));
+    QCommandLineOption queueSizeOption("queue-size", "Max pending path changes per root before directories "
+                                       "are left for a rescan", "count");
+    QCommandLineOption dbRateOption("db-rate", "Max path changes written to the DB per second per root, 0 disables",
+                                    "count");
+    QCommandLineOption reconcileWorkersOption("reconcile-workers", "Parallel file checks of the DB-vs-filesystem "
+                                              "reconciliation per root, 0 (default) disables", "count");
+    QCommandLineOption reconcileRateOption("reconcile-rate", "Max file checks per second of the reconciliation", "count");
+    QCommandLineOption filteredSnapshotsOption("filtered-snapshots", "Keep only DB-referenced names in directory "
+                                               "snapshots to save memory on large directories");
+    QCommandLineOption shardsOption("shards", "Watcher threads per root, directories are split between them "
+                                    "by path hash, 0 - one per core", "count");
+    QCommandLineOption traceOption("trace", "Write Chrome trace-event JSON of event processing stages to file", "file");
+    QCommandLineOption traceSampleOption("trace-sample", "Share of traced event chains, 0..1", "rate", "1");
+    QCommandLineOption traceWindowOption("trace-window", "Trace only the first ms after start and write the file then, "
+                                         "0 - until exit", "ms", "0");
+    QCommandLineOption moveWindowOption("move-window", "Window in ms to pair a delete in one directory with an add "
+                                        "in another as a move, 0 disables", "ms");
+    QCommandLineOption publishOption("publish", "Publish renamed/deleted/added events to local socket subscribers",
+                                     "name");
+    QCommandLineOption metadataTableOption("metadata-table", "Table (filepath unique, size, mtime) to upsert final "
+                                           "size and mtime of finished file writes into", "table");
+    QCommandLineOption settleTimeOption("settle-time", "Ms a file size and mtime must stay unchanged to count the write "
+                                        "as finished", "ms");
+    QCommandLineOption partitionsOption("partitions", "Split watched paths into this many parts shared between "
+                                        "instances using the same DB via advisory locks, 0 - watch everything", "count");
+    QCommandLineOption partitionKeyOption("partition-lock-key", "Advisory lock key of the instance group", "key");
+    QCommandLineOption snapshotLimitOption("snapshot-limit", "Max names kept in directory snapshots per watcher, "
+                                           "least recently changed directories are reduced to fingerprints, 0 - no limit",
+                                           "count");
+    QCommandLineOption fsTimeoutOption("fs-timeout", "Ms a single filesystem call may take before its mount is treated "
+                                       "as stalled and skipped until it answers, 0 - no limit", "ms");
+    QCommandLineOption applyConnectionsOption("apply-connections", "Extra DB connections per watcher to apply path changes "
+                                              "in parallel, split by directory hash, 0 - apply on the watcher connection",
+                                              "count");
+    QCommandLineOption profileOption("profile", "Collect per-statement latency grouped by SQL fingerprint; "
+                                     "the table is written to the log on SIGUSR1 and at exit");
+    QCommandLineOption standbyOption("standby", "Keep a pre-opened standby connection next to every pooled "
+                                     "connection and switch to it when the connection drops");
+    QCommandLineOption replicaOption("replica", "Read-only replica (same database and credentials) for watch-list "
+                                     "refreshes and lookups", "host:port");
+    QCommandLineOption replicaLagOption("replica-max-lag", "Replica lag in ms above which reads go to the primary",
+                                        "ms", "5000");
+    QCommandLineOption pathTableOption("path-table", "Table holding file paths, may be repeated; replaces the built-in "
+                                       "list", "table[:id_column[:path_column[:placeholder]]]");
+    parser.addOption(rootOption);
+    parser.addOption(poolSizeOption);
+    parser.addOption(queryTimeoutOption);
+    parser.addOption(queueSizeOption);
+    parser.addOption(dbRateOption);
+    parser.addOption(reconcileWorkersOption);
+    parser.addOption(reconcileRateOption);
+    parser.addOption(filteredSnapshotsOption);
+    parser.addOption(shardsOption);
+    parser.addOption(moveWindowOption);
+    parser.addOption(publishOption);
+    parser.addOption(metadataTableOption);
+    parser.addOption(settleTimeOption);
+    parser.addOption(partitionsOption);
+    parser.addOption(partitionKeyOption);
+    parser.addOption(snapshotLimitOption);
+    parser.addOption(fsTimeoutOption);
+    parser.addOption(applyConnectionsOption);
+    parser.addOption(profileOption);
+    parser.addOption(standbyOption);
+    parser.addOption(replicaOption);
+    parser.addOption(replicaLagOption);
+    parser.addOption(pathTableOption);
+    parser.addOption(traceOption);
+    parser.addOption(traceSampleOption);
+    parser.addOption(traceWindowOption);
+    parser.process(a);
 
+    const QStringList args = parser.positionalArguments();
+    if (args.size() == ARG_SIZE)
+    {
         ConnectionData connData;
-        connData.dbName = a.arguments().at(1);
-        connData.host = a.arguments().at(2);
-        connData.port = a.arguments().at(3).toInt();
-        connData.userName = a.arguments().at(4);
-        connData.password = a.arguments().at(5);
-
-        db->connectDb(connData);
-        QTimer* timer = new QTimer(&a);
-        timer->setInterval(ONE_MINUTE);
-        QTimer::singleShot(0, watcher, &DbFileSystemWatcher::updateWatchPath);
-        QObject::connect(timer, &QTimer::timeout, watcher, &DbFileSystemWatcher::updateWatchPath);
-        timer->start();
+        connData.dbName = args.at(0);
+        connData.host = args.at(1);
+        connData.port = args.at(2).toInt();
+        connData.userName = args.at(3);
+        connData.password = args.at(4);
+
+        WatchRoots roots;
+        for (const auto& i : parser.values(rootOption))
+        {
+            roots.append(WatchRoot::fromString(i));
+        }
+        if (roots.isEmpty())
+        {
+            roots.append(WatchRoot::fromString(DEFAULT_ROOT));
+        }
+
+        if (parser.isSet(pathTableOption))
+        {
+            QVector <PathTable> tables;
+            for (const auto& i : parser.values(pathTableOption))
+            {
+                const QStringList parts = i.split(':');
+                PathTable table;
+                table.table = parts.at(0);
+                if (parts.size() > 1 && !parts.at(1).isEmpty())
+                {
+                    table.idColumn = parts.at(1);
+                }
+                if (parts.size() > 2 && !parts.at(2).isEmpty())
+                {
+                    table.pathColumn = parts.at(2);
+                }
+                if (parts.size() > 3)
+                {
+                    // заглушка может содержать ':'
+                    table.placeholder = parts.mid(3).join(':');
+                }
+                tables.append(table);
+            }
+            DbFileWatcher::setPathTables(tables);
+        }
+
+        WatcherSettings settings;
+        settings.refreshInterval = ONE_MINUTE;
+        if (parser.isSet(queueSizeOption))
+        {
+            settings.queueCapacity = parser.value(queueSizeOption).toInt();
+        }
+        if (parser.isSet(dbRateOption))
+        {
+            settings.dbWriteRate = parser.value(dbRateOption).toDouble();
+        }
+        if (parser.isSet(reconcileWorkersOption))
+        {
+            settings.reconcileWorkers = parser.value(reconcileWorkersOption).toInt();
+        }
+        if (parser.isSet(reconcileRateOption))
+        {
+            settings.reconcileRate = parser.value(reconcileRateOption).toDouble();
+        }
+        settings.filteredSnapshots = parser.isSet(filteredSnapshotsOption);
+        settings.metadataTable = parser.value(metadataTableOption);
+        if (parser.isSet(snapshotLimitOption))
+        {
+            settings.snapshotLimit = parser.value(snapshotLimitOption).toInt();
+        }
+        if (parser.isSet(partitionsOption))
+        {
+            settings.partitions = parser.value(partitionsOption).toInt();
+        }
+        if (parser.isSet(partitionKeyOption))
+        {
+            settings.partitionLockKey = parser.value(partitionKeyOption).toInt();
+        }
+        if (parser.isSet(settleTimeOption))
+        {
+            settings.settleTime = parser.value(settleTimeOption).toInt();
+        }
+        if (parser.isSet(moveWindowOption))
+        {
+            settings.moveWindow = parser.value(moveWindowOption).toInt();
+        }
+        if (parser.isSet(applyConnectionsOption))
+        {
+            settings.applyConnections = qMax(parser.value(applyConnectionsOption).toInt(), 0);
+        }
+        if (parser.isSet(fsTimeoutOption))
+        {
+            settings.fsTimeout = parser.value(fsTimeoutOption).toInt();
+        }
+        FsGuard::instance().setTimeout(settings.fsTimeout);
+        if (parser.isSet(shardsOption))
+        {
+            qint32 shards = parser.value(shardsOption).toInt();
+            settings.shards = shards > 0 ? shards : QThread::idealThreadCount();
+        }
+
+        // по подключению (и подключениям параллельной записи) на каждый поток наблюдения,
+        // на сверку каждого корня и запас для вспомогательных запросов
+        qint32 watchers = roots.size() * settings.shards * (1 + settings.applyConnections) + (settings.partitions > 0 ? 1 : 0);
+        qint32 poolSize = parser.isSet(poolSizeOption) ? parser.value(poolSizeOption).toInt() : watchers + roots.size() + 2;
+        poolSize = qMax(poolSize, watchers);
+
+        DbConnectionPool* pool = new DbConnectionPool(connData, poolSize, &a);
+        pool->setQueryTimeout(parser.value(queryTimeoutOption).toInt());
+        pool->setStandbyEnabled(parser.isSet(standbyOption));
+        if (parser.isSet(replicaOption))
+        {
+            ConnectionData replicaData = connData;
+            const QStringList address = parser.value(replicaOption).split(':');
+            replicaData.host = address.at(0);
+            if (address.size() > 1)
+            {
+                replicaData.port = address.at(1).toInt();
+            }
+            pool->setReplica(replicaData, parser.value(replicaLagOption).toInt());
+        }
+        WatchService* service = new WatchService(pool, roots, settings, &a);
+        if (parser.isSet(publishOption))
+        {
+            EventPublisher* publisher = new EventPublisher(PUBLISH_HISTORY, PUBLISH_MAX_BACKLOG, &a);
+            if (publisher->listen(parser.value(publishOption)))
+            {
+                service->setPublisher(publisher);
+            }
+            else
+            {
+                ModifiedFileSystemWatcher::writeLog("Can't publish events: " + publisher->errorString());
+            }
+        }
+        QObject::connect(&a, &QCoreApplication::aboutToQuit, service, &WatchService::stop);
+        if (settings.partitions > 0)
+        {
+            PartitionCoordinator* coordinator = new PartitionCoordinator(pool, settings, &a);
+            service->setPartitionCoordinator(coordinator);
+            // части отдаются после остановки наблюдения
+            QObject::connect(&a, &QCoreApplication::aboutToQuit, coordinator, &PartitionCoordinator::stop);
+            coordinator->start();
+        }
+        if (parser.isSet(traceOption))
+        {
+            const QString traceFile = parser.value(traceOption);
+            const qint32 traceWindow = parser.value(traceWindowOption).toInt();
+            Tracer::enable(parser.value(traceSampleOption).toDouble(), traceWindow);
+            auto exportTrace = [traceFile]()
+            {
+                Tracer::disable();
+                if (!Tracer::exportJson(traceFile))
+                {
+                    ModifiedFileSystemWatcher::writeLog("Can't write trace file " + traceFile);
+                }
+                else if (Tracer::droppedCount() > 0)
+                {
+                    ModifiedFileSystemWatcher::writeLog(QString("Trace buffers overflowed, %1 events dropped")
+                                                        .arg(Tracer::droppedCount()));
+                }
+            };
+            if (traceWindow > 0)
+            {
+                QTimer::singleShot(traceWindow, &a, exportTrace);
+            }
+            else
+            {
+                // после остановки сервиса, чтобы в файл попали последние записи в БД
+                QObject::connect(&a, &QCoreApplication::aboutToQuit, exportTrace);
+            }
+        }
+        if (parser.isSet(profileOption))
+        {
+            QueryProfiler::enable();
+            auto dumpProfile = [](const QString& report) {ModifiedFileSystemWatcher::writeLog(report);};
+            if (!QueryProfiler::dumpOnSignal(&a, dumpProfile))
+            {
+                ModifiedFileSystemWatcher::writeLog("Query profile is written only at exit: SIGUSR1 is not available");
+            }
+            QObject::connect(&a, &QCoreApplication::aboutToQuit, [dumpProfile]() {dumpProfile(QueryProfiler::report());});
+        }
+        service->start();
     }
     else
     {
@@ -1,142 +1,1547 @@
 #include "modifiedfilesystemwatcher.h"
+#include <QDirIterator>
+#include <algorithm>
+#include <limits>
+#include <QPointer>
+#include <partitioncoordinator.h>
+#include <fsguard.h>
+#include <connectionpool.h>
 
+QFile ModifiedFileSystemWatcher::logFile;
+QTextStream ModifiedFileSystemWatcher::out;
+QDate ModifiedFileSystemWatcher::logDate;
+QMutex ModifiedFileSystemWatcher::logMutex;
 
+// 64-битный хэш имени для отпечатка неотслеживаемых файлов
+static quint64 nameHash(const QString& name)
+{
+    return (static_cast <quint64> (qHash(name, 0x9e3779b9u)) << 32) | qHash(name, 0x85ebca6bu);
+}
 
 
 void ModifiedFileSystemWatcher::addWatchPath(QString path)
 {
-    if (logFile.exists())
+    path = normalizedPath(path);
+    if (watchTree[path]++ > 0)
+    {
+        return;
+    }
+    registerWatch(path);
+}
+
+
+void ModifiedFileSystemWatcher::registerWatch(const QString& path)
+{
+    // регистрация на зависшей шаре блокирует поток, поэтому откладывается до ее восстановления
+    if (!FsGuard::instance().isHealthy(path))
     {
-        //qDebug() << "create log file";
-        QFileInfo info (logFile);
-        if (info.created().date() < QDate::currentDate())
+        pendingWatches.insert(path);
+        return;
+    }
+
+    // addPath сам обращается к шаре без срока, поэтому выполняется только после ответа guardedInfo
+    PathInfo info;
+    bool ok = guardedInfo(path, info);
+    if (ok && info.exists)
+    {
+        _sysWatcher->addPath(path);  //add path to watch
+    }
+    if (ok && info.isDir)
+    {
+        DirSnapshot snapshot = readDirectory(path, nullptr, &ok);
+        if (ok)
         {
-            logFile.close();
-            createLogFile();
+            fillIdentities(path, snapshot, nullptr);
+            storeSnapshot(path, snapshot);
         }
     }
-    else
+    if (!ok)
     {
-        createLogFile();
+        pendingWatches.insert(path);
+        return;
     }
+    pendingWatches.remove(path);
+
+    //qDebug() << "Add to watch: " << path;
+    log("Add to watch: " + path);
 
-    _sysWatcher->addPath(path);  //add path to watch
+}
 
-    QFileInfo f(path);
 
-    if(f.isDir())
+void ModifiedFileSystemWatcher::retryPendingWatches()
+{
+    const auto paths = pendingWatches.values();
+    for (const auto& path : paths)
+    {
+        if (FsGuard::instance().isHealthy(path))
+        {
+            registerWatch(path);
+        }
+    }
+    if (!pendingWatches.isEmpty())
     {
-        const QDir dirw(path);
-        _currContents[path] = dirw.entryList(QDir::NoDotAndDotDot | QDir::AllDirs | QDir::Files, QDir::DirsFirst);
+        log(QString("Watches waiting for stalled mounts: %1").arg(pendingWatches.size()));
     }
+}
 
-    //qDebug() << "Add to watch: " << path;
-    out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << "Add to watch: " << path << endl;
 
+void ModifiedFileSystemWatcher::removeWatchPath(QString path)
+{
+    path = normalizedPath(path);
+    auto it = watchTree.find(path);
+    if (it == watchTree.end() || --it.value() > 0)
+    {
+        return;
+    }
+    watchTree.erase(it);
+    pendingWatches.remove(path);
+    _sysWatcher->removePath(path);
+    dropSnapshot(path);
+    log("Remove from watch: " + path);
 }
 
-// Slot invoked whenever any of the watched directory is updated (some file in the watched dir is added, deleted or renamed)
 
-void ModifiedFileSystemWatcher::directoryUpdated(const QString & path)
+QString ModifiedFileSystemWatcher::normalizedPath(QString path)
 {
-    //qDebug() << "Directory updated: " << path;
-    out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << "Directory updated: " << path << endl;
+    while (path.size() > 1 && path.endsWith("/"))
+    {
+        path.chop(1);
+    }
+    return path;
+}
 
-    QStringList currEntryList = _currContents[path];
-    const QDir dir(path);
 
-    QStringList newEntryList = dir.entryList(QDir::NoDotAndDotDot  | QDir::AllDirs | QDir::Files, QDir::DirsFirst);
+QString ModifiedFileSystemWatcher::parentPath(QString path)
+{
+    path = normalizedPath(path);
+    int pos = path.indexOf(QRegExp("(/)(?!.+/)"), 0);
+    if (pos <= 0)
+    {
+        return QString();
+    }
+    path.remove(pos, path.size() - pos);
+    return path;
+}
 
-    QSet<QString> newDirSet = QSet<QString>::fromList( newEntryList );
 
-    QSet<QString> currentDirSet = QSet<QString>::fromList( currEntryList );
+DirectoryDiff ModifiedFileSystemWatcher::diffEntries(const QStringList& oldEntries, const QStringList& newEntries)
+{
+    QSet<QString> newDirSet = QSet<QString>::fromList( newEntries );
 
-    // Files that have been added
-    QSet<QString> newFiles = newDirSet - currentDirSet;
-    QStringList newFile = newFiles.toList();
+    QSet<QString> currentDirSet = QSet<QString>::fromList( oldEntries );
 
+    DirectoryDiff diff;
+    // Files that have been added
+    diff.added = (newDirSet - currentDirSet).toList();
     // Files that have been removed
-    QSet<QString> deletedFiles = currentDirSet - newDirSet;
-    QStringList deleteFile = deletedFiles.toList();
+    diff.deleted = (currentDirSet - newDirSet).toList();
+    return diff;
+}
 
-    // Update the current set
-    _currContents[path] = newEntryList;
 
-    if(!newFile.isEmpty() && !deleteFile.isEmpty())
+void ModifiedFileSystemWatcher::setMoveWindow(qint32 window)
+{
+    moveWindow = qMax(window, 0);
+    if (moveTimer == nullptr)
     {
-        // File/Dir is renamed
+        moveTimer = new QTimer(this);
+        connect(moveTimer, &QTimer::timeout, this, &ModifiedFileSystemWatcher::flushPendingMoves);
+        moveClock.start();
+    }
+    moveTimer->stop();
+    if (moveWindow > 0)
+    {
+        moveTimer->start(qMax(moveWindow / 4, 10));
+    }
+    else
+    {
+        flushPendingMoves();
+    }
+}
+
+
+void ModifiedFileSystemWatcher::fillIdentities(const QString& path, DirSnapshot& snapshot, const DirSnapshot* previous) const
+{
+    if (moveWindow == 0)
+    {
+        return;
+    }
+    for (const auto& name : snapshot.entries)
+    {
+        QString full = path + "/" + name;
+        if (!identityWanted(full))
+        {
+            continue;
+        }
+        // у оставшихся имен идентичность прежняя, stat только для новых
+        if (previous != nullptr && previous->identities.contains(name))
+        {
+            snapshot.identities.insert(name, previous->identities.value(name));
+        }
+        else
+        {
+            FileIdentity identity;
+            if (FsGuard::instance().call <FileIdentity> (full, [full]() {return FileIdentity::of(full);}, identity))
+            {
+                snapshot.identities.insert(name, identity);
+            }
+        }
+    }
+}
 
-        if(newFile.count() == 1 && deleteFile.count() == 1)
+
+void ModifiedFileSystemWatcher::fileDeleted(const QString& path, const FileIdentity& identity)
+{
+    if (moveWindow > 0 && identity.isValid())
+    {
+        qint64 now = moveClock.elapsed();
+        for (int i = 0; i < recentAdds.size(); i++)
         {
-            QString oldF = dir.absolutePath() + "/" + deleteFile.first();
-            QString newF = dir.absolutePath() + "/" + newFile.first();
-            emit renamed (oldF, newF);
-            //qDebug() << "File Renamed from " << deleteFile.first()  << " to " << newFile.first();
-            out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << "File/Dir renamed from: "
-                << oldF << " To:" << newF << endl;
+            if (recentAdds[i].path == path)
+            {
+                // появился и исчез в пределах окна: сообщения идут в порядке событий
+                recentAdds.removeAt(i--);
+                emit added(path);
+                log("New Files/Dirs added: " + path);
+                continue;
+            }
+            if (now - recentAdds[i].time <= moveWindow && recentAdds[i].identity.matches(identity))
+            {
+                QString newF = recentAdds.takeAt(i).path;
+                emit renamed(path, newF);
+                log("File/Dir moved from: " + path + " To:" + newF);
+                return;
+            }
         }
+        pendingDeletes.append(PendingMove {path, identity, now});
+        return;
     }
+    emit deleted(path);
+    log("Files/Dirs deleted: " + path);
+}
 
-    else
+
+void ModifiedFileSystemWatcher::fileAdded(const QString& path)
+{
+    FileIdentity identity;
+    if (moveWindow == 0 || !FsGuard::instance().call <FileIdentity> (path, [path]() {return FileIdentity::of(path);}, identity)
+            || !identity.isValid())
+    {
+        emit added(path);
+        log("New Files/Dirs added: " + path);
+        return;
+    }
+    qint64 now = moveClock.elapsed();
+    for (int i = 0; i < pendingDeletes.size(); i++)
+    {
+        if (pendingDeletes[i].identity.matches(identity))
+        {
+            QString oldF = pendingDeletes.takeAt(i).path;
+            emit renamed(oldF, path);
+            log("File/Dir moved from: " + oldF + " To:" + path);
+            return;
+        }
+    }
+    // удаление из другого каталога может прийти позже появления, поэтому о появлении
+    // сообщается только после окна, если пара не нашлась (flushPendingMoves)
+    recentAdds.append(PendingMove {path, identity, now});
+}
+
+
+void ModifiedFileSystemWatcher::flushPendingMoves()
+{
+    qint64 now = moveClock.isValid() ? moveClock.elapsed() : 0;
+    for (int i = 0; i < pendingDeletes.size(); )
+    {
+        if (moveWindow == 0 || now - pendingDeletes[i].time > moveWindow)
+        {
+            QString oldF = pendingDeletes.takeAt(i).path;
+            emit deleted(oldF);
+            log("Files/Dirs deleted: " + oldF);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    for (int i = 0; i < recentAdds.size(); )
+    {
+        if (moveWindow == 0 || now - recentAdds[i].time > moveWindow)
+        {
+            QString newF = recentAdds.takeAt(i).path;
+            emit added(newF);
+            log("New Files/Dirs added: " + newF);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+
+void ModifiedFileSystemWatcher::storeSnapshot(const QString& path, DirSnapshot snapshot)
+{
+    auto it = _currContents.find(path);
+    if (it != _currContents.end())
+    {
+        snapshotEntries -= it->entries.size();
+    }
+    coldSnapshots.remove(path);
+    snapshot.lastUsed = ++snapshotTick;
+    snapshotEntries += snapshot.entries.size();
+    _currContents[path] = snapshot;
+    enforceSnapshotLimit();
+}
+
+
+void ModifiedFileSystemWatcher::dropSnapshot(const QString& path)
+{
+    auto it = _currContents.find(path);
+    if (it != _currContents.end())
+    {
+        snapshotEntries -= it->entries.size();
+        _currContents.erase(it);
+    }
+    coldSnapshots.remove(path);
+}
+
+
+static DirFingerprint fingerprintOf(const DirSnapshot& snapshot)
+{
+    DirFingerprint fp;
+    fp.count = snapshot.entries.size() + snapshot.untrackedCount;
+    fp.nameHash = snapshot.untrackedHash;
+    for (const auto& i : snapshot.entries)
+    {
+        fp.nameHash ^= nameHash(i);
+    }
+    fp.mtime = snapshot.mtime;
+    return fp;
+}
+
+
+void ModifiedFileSystemWatcher::enforceSnapshotLimit()
+{
+    if (snapshotLimit <= 0 || snapshotEntries <= snapshotLimit)
+    {
+        return;
+    }
+    // вытесняем с запасом, чтобы не сортировать снимки на каждое изменение
+    const qint64 goal = snapshotLimit - snapshotLimit / 10;
+    QVector <QPair <quint64, QString>> byAge;
+    byAge.reserve(_currContents.size());
+    for (auto it = _currContents.cbegin(); it != _currContents.cend(); ++it)
+    {
+        byAge.append(qMakePair(it->lastUsed, it.key()));
+    }
+    std::sort(byAge.begin(), byAge.end());
+    qint32 evicted = 0;
+    for (const auto& i : byAge)
     {
-        // New File/Dir Added to Dir
-        if(!newFile.isEmpty())
+        if (snapshotEntries <= goal)
+        {
+            break;
+        }
+        const DirSnapshot& snapshot = _currContents[i.second];
+        DirFingerprint fp = fingerprintOf(snapshot);
+        // имена, нужные наблюдателю, остаются: по ним восстанавливаются переименования
+        for (const auto& name : snapshot.entries)
         {
-            //qDebug() << "New Files/Dirs added: " << newFile;
-            foreach(QString file, newFile)
+            if (identityWanted(i.second + "/" + name))
             {
-                QString newF = dir.absolutePath() + "/" + file;
-                emit added(newF);
-                out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << "New Files/Dirs added: "
-                    << newF << endl;
+                fp.identities.insert(name, snapshot.identities.value(name));
             }
         }
+        snapshotEntries -= snapshot.entries.size();
+        _currContents.remove(i.second);
+        coldSnapshots.insert(i.second, fp);
+        ++evicted;
+    }
+    log(QString("Snapshots evicted: %1, cold: %2, names in memory: %3")
+        .arg(evicted).arg(coldSnapshots.size()).arg(snapshotEntries));
+}
+
+
+void ModifiedFileSystemWatcher::rememberInColdSnapshot(const QString& path)
+{
+    auto it = coldSnapshots.find(parentPath(path));
+    const QString name = QFileInfo(path).fileName();
+    if (it == coldSnapshots.end() || it->identities.contains(name))
+    {
+        return;
+    }
+    PathInfo info;
+    if (!guardedInfo(path, info) || !info.exists)
+    {
+        return;
+    }
+    FileIdentity identity;
+    if (moveWindow > 0)
+    {
+        FsGuard::instance().call <FileIdentity> (path, [path]() {return FileIdentity::of(path);}, identity);
+    }
+    it->identities.insert(name, identity);
+}
+
+
+void ModifiedFileSystemWatcher::restoreSnapshot(const QString& path)
+{
+    DirFingerprint cold = coldSnapshots.value(path);
+    PathInfo info;
+    if (!guardedInfo(path, info) || info.mtime == cold.mtime)
+    {
+        // содержимое не менялось (например, изменились атрибуты) - снимок не нужен
+        return;
+    }
+    QStringList untracked;
+    bool ok = false;
+    DirSnapshot snapshot = readDirectory(path, &untracked, &ok);
+    if (!ok)
+    {
+        return;
+    }
+    DirFingerprint fp = fingerprintOf(snapshot);
 
-        // File/Dir is deleted from Dir
+    QSet <QString> names = QSet <QString>::fromList(snapshot.entries) + QSet <QString>::fromList(untracked);
+    QStringList missing;
+    for (auto it = cold.identities.cbegin(); it != cold.identities.cend(); ++it)
+    {
+        if (!names.contains(it.key()))
+        {
+            missing.append(it.key());
+        }
+    }
 
-        if(!deleteFile.isEmpty())
+    // события восстанавливаются по разнице отпечатков и известным именам
+    const QDir dir(path);
+    if (fp.count == cold.count && fp.nameHash == cold.nameHash)
+    {
+        storeSnapshot(path, snapshot);
+        return;
+    }
+    const quint64 hashDiff = fp.nameHash ^ cold.nameHash;
+    if (missing.size() == 1 && fp.count == cold.count - 1 && nameHash(missing.first()) == hashDiff)
+    {
+        // удалено ровно одно известное имя
+        fillIdentities(path, snapshot, nullptr);
+        storeSnapshot(path, snapshot);
+        fileDeleted(dir.absolutePath() + "/" + missing.first(), cold.identities.value(missing.first()));
+        return;
+    }
+    if (missing.size() == 1 && fp.count == cold.count)
+    {
+        // переименовано ровно одно известное имя: новое имя дает нужную разницу хэшей
+        const quint64 target = hashDiff ^ nameHash(missing.first());
+        for (const auto& name : names)
         {
-            //qDebug() << "Files/Dirs deleted: " << deleteFile;
-            foreach(QString file, deleteFile)
+            if (nameHash(name) == target)
             {
-                QString oldF = dir.absolutePath() + "/" + file;
-                emit deleted(oldF);
-                out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << "Files/Dirs deleted: "
-                    << oldF << endl;
+                if (snapshot.filtered && !snapshot.entries.contains(name))
+                {
+                    _trackedNames[path].insert(name);
+                    snapshot.entries.append(name);
+                    snapshot.untrackedHash ^= target;
+                    --snapshot.untrackedCount;
+                }
+                fillIdentities(path, snapshot, nullptr);
+                storeSnapshot(path, snapshot);
+                QString oldF = dir.absolutePath() + "/" + missing.first();
+                QString newF = dir.absolutePath() + "/" + name;
+                emit renamed(oldF, newF);
+                log("File/Dir renamed from: " + oldF + " To:" + newF);
+                return;
+            }
+        }
+    }
+    if (missing.isEmpty())
+    {
+        // известные имена на месте: изменения касаются только файлов, не нужных наблюдателю
+        fillIdentities(path, snapshot, nullptr);
+        storeSnapshot(path, snapshot);
+        return;
+    }
+    fillIdentities(path, snapshot, nullptr);
+    storeSnapshot(path, snapshot);
+    snapshotLost(path);
+}
+
+
+void ModifiedFileSystemWatcher::addTrackedName(const QString& dir, const QString& name)
+{
+    QSet <QString>& names = _trackedNames[dir];
+    if (names.contains(name))
+    {
+        return;
+    }
+    names.insert(name);
+    auto it = _currContents.find(dir);
+    PathInfo info;
+    if (it == _currContents.end() || !it->filtered || it->entries.contains(name)
+            || !guardedInfo(dir + "/" + name, info) || !info.exists)
+    {
+        return;
+    }
+    // имя уже учтено среди неотслеживаемых - переносим его в снимок
+    it->entries.append(name);
+    it->untrackedHash ^= nameHash(name);
+    --it->untrackedCount;
+    ++snapshotEntries;
+}
 
+
+void ModifiedFileSystemWatcher::setTrackedNames(const QHash <QString, QSet <QString>>& names)
+{
+    QHash <QString, QSet <QString>> old = _trackedNames;
+    _trackedNames = names;
+    if (!filteredSnapshots)
+    {
+        return;
+    }
+    // снимки без повторной регистрации: перечитываются только каталоги, где сменились имена
+    const QStringList paths = _currContents.keys();
+    for (const auto& path : paths)
+    {
+        if (old.value(path) != names.value(path))
+        {
+            bool ok = false;
+            DirSnapshot snapshot = readDirectory(path, nullptr, &ok);
+            if (ok)
+            {
+                fillIdentities(path, snapshot, &_currContents[path]);
+                storeSnapshot(path, snapshot);
             }
         }
+    }
+}
+
+
+void ModifiedFileSystemWatcher::setFilteredSnapshots(bool enabled, qint32 verifyInterval)
+{
+    filteredSnapshots = enabled;
+    if (verifyTimer == nullptr)
+    {
+        verifyTimer = new QTimer(this);
+        connect(verifyTimer, &QTimer::timeout, this, &ModifiedFileSystemWatcher::verifyFilteredSnapshots);
+    }
+    verifyTimer->stop();
+    if (enabled && verifyInterval > 0)
+    {
+        verifyTimer->start(verifyInterval);
+    }
+}
+
 
+// чтение каталога без обращения к состоянию наблюдателя: выполняется в потоке ввода-вывода FsGuard
+static QPair <DirSnapshot, QStringList> listDirectory(const QString& path, bool filtered, const QSet <QString>& tracked)
+{
+    DirSnapshot snapshot;
+    QStringList untracked;
+    if (!filtered)
+    {
+        const QDir dir(path);
+        snapshot.entries = dir.entryList(QDir::NoDotAndDotDot | QDir::AllDirs | QDir::Files, QDir::DirsFirst);
+        snapshot.mtime = QFileInfo(path).lastModified().toMSecsSinceEpoch();
+        return qMakePair(snapshot, untracked);
     }
+    snapshot.mtime = QFileInfo(path).lastModified().toMSecsSinceEpoch();
+    snapshot.filtered = true;
+    QDirIterator it(path, QDir::NoDotAndDotDot | QDir::AllDirs | QDir::Files);
+    while (it.hasNext())
+    {
+        it.next();
+        QString name = it.fileName();
+        if (tracked.contains(name) || it.fileInfo().isDir())
+        {
+            snapshot.entries.append(name);
+        }
+        else
+        {
+            snapshot.untrackedHash ^= nameHash(name);
+            ++snapshot.untrackedCount;
+            untracked.append(name);
+        }
+    }
+    return qMakePair(snapshot, untracked);
+}
+
 
+DirSnapshot ModifiedFileSystemWatcher::readDirectory(const QString& path, QStringList* untracked, bool* ok) const
+{
+    TraceSpan span("listing", "fs", path);
+    const bool filtered = filteredSnapshots;
+    const QSet <QString> tracked = _trackedNames.value(path);
+    QPair <DirSnapshot, QStringList> listing;
+    bool done = FsGuard::instance().call <QPair <DirSnapshot, QStringList>> (path, [path, filtered, tracked]()
+    {
+        return listDirectory(path, filtered, tracked);
+    }, listing);
+    if (ok != nullptr)
+    {
+        *ok = done;
+    }
+    if (untracked != nullptr)
+    {
+        untracked->append(listing.second);
+    }
+    return listing.first;
 }
 
 
-// Slot invoked whenever the watched file is modified
+bool ModifiedFileSystemWatcher::guardedInfo(const QString& path, PathInfo& info)
+{
+    return FsGuard::instance().call <PathInfo> (path, [path]()
+    {
+        QFileInfo file(path);
+        return PathInfo {file.exists(), file.isDir(), file.lastModified().toMSecsSinceEpoch()};
+    }, info);
+}
 
-void ModifiedFileSystemWatcher::fileUpdated(const QString & path)
+// Slot invoked whenever any of the watched directory is updated (some file in the watched dir is added, deleted or renamed)
+
+void ModifiedFileSystemWatcher::directoryUpdated(const QString & path)
 {
-    QFileInfo file(path);
+    //qDebug() << "Directory updated: " << path;
+    TraceSpan span("directoryUpdated", "notification", path);
+    log("Directory updated: " + path);
+
+    PathInfo info;
+    if (!guardedInfo(path, info))
+    {
+        // шара не отвечает: прежний снимок сохраняется, и следующее уведомление после
+        // восстановления покажет все накопившиеся изменения
+        return;
+    }
+
+    if (!info.isDir)
+    {
+        // сам каталог переименован или удален - об этом сообщит узел родителя, даже если родитель
+        // наблюдается другим потоком корня; иначе одно изменение пришло бы еще и как удаление всего содержимого
+        return;
+    }
 
-    QString path1 = file.absolutePath();
+    if (pendingWatches.contains(path))
+    {
+        registerWatch(path);
+        return;
+    }
 
-    QString name = file.fileName();
+    if (coldSnapshots.contains(path))
+    {
+        restoreSnapshot(path);
+        return;
+    }
 
-    //qDebug()<<"The file " << name <<" at path " << path1 << " is updated";
+    QStringList untracked;
+    bool ok = false;
+    DirSnapshot newSnapshot = readDirectory(path, &untracked, &ok);
+    if (ok)
+    {
+        applySnapshot(path, newSnapshot, untracked);
+    }
 }
 
 
-void ModifiedFileSystemWatcher::createLogFile()
+void ModifiedFileSystemWatcher::applySnapshot(const QString& path, DirSnapshot newSnapshot, const QStringList& untracked)
 {
-    logFile.setFileName("log_" + QDate::currentDate().toString(Qt::ISODate) + ".txt");
-    if (!logFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    TraceSpan span("diff", "fs", path);
+    DirSnapshot currSnapshot = _currContents.value(path);
+    const QDir dir(path);
+
+    DirectoryDiff diff = diffEntries(currSnapshot.entries, newSnapshot.entries);
+    QStringList& newFile = diff.added;
+    QStringList& deleteFile = diff.deleted;
+
+    if (newSnapshot.filtered && deleteFile.count() == 1 && newFile.isEmpty()
+            && newSnapshot.untrackedCount == currSnapshot.untrackedCount + 1)
     {
-        //qDebug() << "error create log file";
-        emit error();
+        // отслеживаемое имя исчезло и ровно одно неотслеживаемое появилось:
+        // разница хэшей указывает на новое имя
+        quint64 hashDiff = newSnapshot.untrackedHash ^ currSnapshot.untrackedHash;
+        for (const auto& i : untracked)
+        {
+            if (nameHash(i) == hashDiff)
+            {
+                newFile.append(i);
+                // новое имя теперь отслеживается
+                _trackedNames[path].insert(i);
+                newSnapshot.entries.append(i);
+                newSnapshot.untrackedHash ^= hashDiff;
+                --newSnapshot.untrackedCount;
+                break;
+            }
+        }
     }
-    else
+
+    // Update the current set
+    fillIdentities(path, newSnapshot, &currSnapshot);
+    storeSnapshot(path, newSnapshot);
+
+    if(newFile.count() == 1 && deleteFile.count() == 1)
+    {
+        // File/Dir is renamed
+        QString oldF = dir.absolutePath() + "/" + deleteFile.first();
+        QString newF = dir.absolutePath() + "/" + newFile.first();
+        emit renamed (oldF, newF);
+        //qDebug() << "File Renamed from " << deleteFile.first()  << " to " << newFile.first();
+        log("File/Dir renamed from: " + oldF + " To:" + newF);
+        return;
+    }
+
+    if (moveWindow == 0 && !newFile.isEmpty() && !deleteFile.isEmpty())
+    {
+        // несколько переименований сразу без идентичности не различить
+        return;
+    }
+
+    // остальное сопоставляется по идентичности файлов, в том числе с изменениями в других каталогах
+    foreach(QString file, deleteFile)
     {
-        //qDebug() << "OK log file";
-        out.setDevice(&logFile);
+        QString oldF = dir.absolutePath() + "/" + file;
+        fileDeleted(oldF, currSnapshot.identities.value(file));
     }
+
+    // New File/Dir Added to Dir
+    foreach(QString file, newFile)
+    {
+        fileAdded(dir.absolutePath() + "/" + file);
+    }
+}
+
+
+// Slot invoked whenever the watched file is modified
+
+void ModifiedFileSystemWatcher::fileUpdated(const QString & path)
+{
+    //qDebug()<<"The file " << path << " is updated";
+    emit modified(path);
+}
+
+
+// страховка отфильтрованного режима: изменения неотслеживаемых имен, пропущенные уведомлениями,
+// обнаруживаются по расхождению отпечатка
+void ModifiedFileSystemWatcher::verifyFilteredSnapshots()
+{
+    const QStringList paths = _currContents.keys();
+    for (const auto& path : paths)
+    {
+        const DirSnapshot& current = _currContents[path];
+        if (!current.filtered)
+        {
+            continue;
+        }
+        QStringList untracked;
+        bool ok = false;
+        DirSnapshot snapshot = readDirectory(path, &untracked, &ok);
+        if (ok && (snapshot.untrackedHash != current.untrackedHash
+                || snapshot.untrackedCount != current.untrackedCount
+                || QSet<QString>::fromList(snapshot.entries) != QSet<QString>::fromList(current.entries)))
+        {
+            log("Snapshot drift: " + path);
+            applySnapshot(path, snapshot, untracked);
+        }
+    }
+}
+
+
+void ModifiedFileSystemWatcher::log(const QString& message)
+{
+    if (!writeLog(message))
+    {
+        emit error();
+    }
+}
+
+
+bool ModifiedFileSystemWatcher::writeLog(const QString& message)
+{
+    QMutexLocker lock(&logMutex);
+    if (!logFile.isOpen() || logDate < QDate::currentDate())
+    {
+        if (!createLogFile())
+        {
+            return false;
+        }
+    }
+    out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << message << endl;
+    return true;
+}
+
+
+bool ModifiedFileSystemWatcher::createLogFile()
+{
+    if (logFile.isOpen())
+    {
+        logFile.close();
+    }
+    logDate = QDate::currentDate();
+    logFile.setFileName("log_" + logDate.toString(Qt::ISODate) + ".txt");
+    if (!logFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        //qDebug() << "error create log file";
+        return false;
+    }
+    //qDebug() << "OK log file";
+    out.setDevice(&logFile);
+    return true;
+}
+
+
+DbFileSystemWatcher::DbFileSystemWatcher(QSharedPointer <DbFileWatcher> _db, const WatchRoot& _root,
+                                         const WatcherSettings& _settings, QObject* parent) :
+    ModifiedFileSystemWatcher(parent), db(_db), root(_root), settings(_settings),
+    queue(_settings.queueCapacity), dbRateLimiter(_settings.dbWriteRate, _settings.dbWriteRate)
+{
+    // в БД уходят только изменения, затрагивающие ее строки
+    QObject::connect(this, &DbFileSystemWatcher::deleted, [this](auto& oldf)
+    {
+        TraceSpan span("dispatch", "queue", oldf);
+        if (hasInterestedRows(oldf))
+        {
+            queue.push(oldf, QString());
+        }
+    });
+    QObject::connect(this, &DbFileSystemWatcher::renamed, [this](auto& oldf, auto& newf)
+    {
+        TraceSpan span("dispatch", "queue", oldf);
+        if (hasInterestedRows(oldf))
+        {
+            queue.push(oldf, newf);
+            // до следующего обновления строки под новым путем известны только отсюда
+            renamedRows.insert(newf, QString());
+            rememberInColdSnapshot(normalizedPath(newf));
+        }
+    });
+    QObject::connect(db.data(), &DbFileWatcher::errorOccured, [this](auto& error)
+    {log("DB ERROR: " + error);});
+    QObject::connect(db.data(), &Database::connectionLost, this, [this]()
+    {log("DB connection lost, reconnecting");});
+    QObject::connect(db.data(), &Database::connectionRestored, this, [this](qint64 outage, qint32 attempts)
+    {log(QString("DB connection restored after %1 ms, %2 attempts").arg(outage).arg(attempts));});
+    QObject::connect(db.data(), &Database::readRoutingChanged, this, [this](bool replica, const QString& reason)
+    {log(QString("DB reads go to the %1: %2").arg(replica ? "replica" : "primary").arg(reason));});
+
+    drainTimer = new QTimer(this);
+    drainTimer->setInterval(settings.drainInterval);
+    connect(drainTimer, &QTimer::timeout, this, &DbFileSystemWatcher::processQueue);
+    drainTimer->start();
+    startupClock.start();
+
+    setFilteredSnapshots(settings.filteredSnapshots, settings.snapshotVerifyInterval);
+    setMoveWindow(settings.moveWindow);
+    setSnapshotLimit(settings.snapshotLimit);
+
+    if (!settings.metadataTable.isEmpty())
+    {
+        settle = new SettleDetector(settings.settleTime, this);
+        connect(this, &DbFileSystemWatcher::added, this, &DbFileSystemWatcher::watchWrites);
+        connect(this, &DbFileSystemWatcher::modified, this, &DbFileSystemWatcher::watchWrites);
+        connect(this, &DbFileSystemWatcher::deleted, settle, &SettleDetector::forget);
+        connect(this, &DbFileSystemWatcher::deleted, this, &DbFileSystemWatcher::unwatchWrites);
+        connect(this, &DbFileSystemWatcher::renamed, this, [this](const QString& from) {unwatchWrites(from);});
+        connect(settle, &SettleDetector::settled, this, [this](const SettledFile& file)
+        {
+            settledFiles.append(SettledFile {root.toDbPath(file.path), file.size, file.mtime});
+            // дальнейшие изменения найдет сравнение снимка каталога, наблюдение за файлом больше не нужно
+            unwatchWrite(file.path);
+        });
+    }
+}
+
+
+void DbFileSystemWatcher::watchWrites(const QString& path)
+{
+    if (!hasInterestedRows(PathEventQueue::directoryOf(path)) || !settle->watch(path))
+    {
+        return;
+    }
+    // продолжение записи приходит как fileChanged -> modified
+    const QString dir = PathEventQueue::directoryOf(path);
+    auto it = writtenFiles.find(dir);
+    if (it != writtenFiles.end() && it->contains(path))
+    {
+        return;
+    }
+    if (FsGuard::instance().isHealthy(path) && _sysWatcher->addPath(path))
+    {
+        writtenFiles[dir].insert(path);
+    }
+}
+
+
+void DbFileSystemWatcher::unwatchWrite(const QString& path)
+{
+    auto it = writtenFiles.find(PathEventQueue::directoryOf(path));
+    if (it != writtenFiles.end() && it->remove(path))
+    {
+        _sysWatcher->removePath(path);
+        if (it->isEmpty())
+        {
+            writtenFiles.erase(it);
+        }
+    }
+}
+
+
+void DbFileSystemWatcher::unwatchWrites(const QString& path)
+{
+    unwatchWrite(path);
+    // path - каталог: его файлы и файлы всех каталогов под ним
+    auto removeDir = [this](QMap <QString, QSet <QString>>::iterator it)
+    {
+        for (const auto& i : it.value())
+        {
+            _sysWatcher->removePath(i);
+        }
+        return writtenFiles.erase(it);
+    };
+    auto it = writtenFiles.find(path);
+    if (it != writtenFiles.end())
+    {
+        removeDir(it);
+    }
+    const QString prefix = path + "/";
+    it = writtenFiles.lowerBound(prefix);
+    while (it != writtenFiles.end() && it.key().startsWith(prefix))
+    {
+        it = removeDir(it);
+    }
+}
+
+
+void DbFileSystemWatcher::flushSettled(qint32 count)
+{
+    QVector <SettledFile> batch = settledFiles.mid(0, count);
+    settledFiles.remove(0, batch.size());
+    db->upsertFileMetadata(settings.metadataTable, batch);
+}
+
+
+constexpr const qint32 startupPageSize = 500;
+
+void DbFileSystemWatcher::updateWatchPath()
+{
+    if (startupLoading)
+    {
+        refreshPending = true;
+        return;
+    }
+    if (!startupDone)
+    {
+        startStreamingLoad();
+        return;
+    }
+    logQueueStats();
+    retryPendingWatches();
+    //qDebug() << "try to get dirs";
+    bool ok = false;
+    QStringList dirList;
+    {
+        // таблицы реестра читаются одновременно через свободные подключения пула; подключения возвращаются сразу после чтения
+        QVector <QSharedPointer <DbFileWatcher>> helpers;
+        QVector <DbFileWatcher*> helperConnections;
+        while (fetchPool != nullptr && helpers.size() < DbFileWatcher::pathTables().size() - 1)
+        {
+            QSharedPointer <DbFileWatcher> conn;
+            try
+            {
+                conn = fetchPool->tryAcquire(0);
+            }
+            catch (std::exception& e)
+            {
+                log("DB ERROR: " + QString(e.what()));
+            }
+            if (!conn)
+            {
+                break;
+            }
+            helpers.append(conn);
+            helperConnections.append(conn.data());
+        }
+        dirList = db->getDirectroriesList(root.dbPrefix, &ok, coordinator != nullptr ? coordinator->current() : PathPartition(),
+                                          helperConnections);
+    }
+    //qDebug() << "get dirs";
+    if (!ok)
+    {
+        // при ошибке БД наблюдение остается прежним
+        return;
+    }
+    // индекс содержит все строки корня: событие каталога этого потока может затрагивать строки глубже,
+    // чьи каталоги наблюдают другие потоки
+    QMap <QString, QString> rows;
+    for (const auto& i : dirList)
+    {
+        rows.insert(normalizedPath(root.toLocalPath(i)), i);
+    }
+    if (filteredSnapshots)
+    {
+        // в родительском каталоге отслеживается только имя каталога из БД
+        QHash <QString, QSet <QString>> tracked;
+        for (auto it = rows.cbegin(); it != rows.cend(); ++it)
+        {
+            const QString parent = parentPath(it.key());
+            if (ownsDirectory(parent))
+            {
+                tracked[parent].insert(QFileInfo(it.key()).fileName());
+            }
+        }
+        setTrackedNames(tracked);
+    }
+    // индекс обновляется до регистрации: по нему новые снимки решают, чья идентичность нужна
+    QMap <QString, QString> previous = rowIndex;
+    rowIndex = rows;
+    renamedRows.clear();
+    // каждая строка регистрирует свой каталог и родителя; общие узлы не перерегистрируются
+    for (auto it = previous.cbegin(); it != previous.cend(); ++it)
+    {
+        if (!rows.contains(it.key()))
+        {
+            unwatchRow(it.key());
+        }
+    }
+    for (auto it = rows.cbegin(); it != rows.cend(); ++it)
+    {
+        if (!previous.contains(it.key()))
+        {
+            watchRow(it.key());
+        }
+    }
+}
+
+
+// каталог наблюдает ровно один поток корня - тот, в чью часть попадает хэш пути самого каталога,
+// поэтому события каталога и их запись в БД упорядочены внутри одной очереди
+bool DbFileSystemWatcher::ownsDirectory(const QString& dir) const
+{
+    return shardCount == 1 || shardOf(dir, shardCount) == shardIndex;
+}
+
+
+void DbFileSystemWatcher::watchRow(const QString& local)
+{
+    rememberInColdSnapshot(local);
+    for (const auto& dir : {local, parentPath(local)})
+    {
+        if (ownsDirectory(dir))
+        {
+            addWatchPath(dir);
+        }
+    }
+}
+
+
+void DbFileSystemWatcher::unwatchRow(const QString& local)
+{
+    for (const auto& dir : {local, parentPath(local)})
+    {
+        if (ownsDirectory(dir))
+        {
+            removeWatchPath(dir);
+        }
+    }
+}
+
+
+void DbFileSystemWatcher::snapshotLost(const QString& path)
+{
+    log("Rescan of evicted directory: " + path);
+    queue.requestRescan(path);
+}
+
+
+void DbFileSystemWatcher::startStreamingLoad()
+{
+    startupLoading = true;
+    loadedRows = 0;
+    nextLoadTable = 0;
+    loadBefore = QVector <qint32> (DbFileWatcher::pathTables().size(), std::numeric_limits <qint32>::max());
+    loadFinished = QVector <bool> (DbFileWatcher::pathTables().size(), false);
+    streamingLoad();
+}
+
+
+DbTask <QVector <PathRow>> DbFileSystemWatcher::requestNextPage(qint32& table)
+{
+    // таблицы по очереди, чтобы первыми наблюдались новые строки каждой
+    const qint32 tables = DbFileWatcher::pathTables().size();
+    for (qint32 i = 0; i < tables; i++)
+    {
+        table = (nextLoadTable + i) % tables;
+        if (loadFinished[table])
+        {
+            continue;
+        }
+        nextLoadTable = (table + 1) % tables;
+        return db->getDirectoriesPageAsync(DbFileWatcher::pathTables()[table].table, loadBefore[table], startupPageSize,
+                                           root.dbPrefix, coordinator != nullptr ? coordinator->current() : PathPartition(),
+                                           loadCancel);
+    }
+    table = -1;
+    return DbTask <QVector <PathRow>>::fromValue(QVector <PathRow>());
+}
+
+
+DbTask <bool> DbFileSystemWatcher::streamingLoad()
+{
+    // подключение возвращается в пул вместе с незавершенным запросом, ответ может прийти после удаления наблюдателя
+    QPointer <DbFileSystemWatcher> self(this);
+    qint32 table = -1;
+    DbTask <QVector <PathRow>> next = requestNextPage(table);
+    while (table >= 0)
+    {
+        QVector <PathRow> page;
+        bool failed = false;
+        try
+        {
+            page = co_await next;
+        }
+        catch (std::exception& e)
+        {
+            if (self && startupLoading)
+            {
+                log("DB ERROR: " + QString(e.what()));
+            }
+            failed = true;
+        }
+        if (!self || !startupLoading)
+        {
+            co_return false;
+        }
+        if (failed)
+        {
+            finishStreamingLoad(false);
+            co_return false;
+        }
+        if (page.size() < startupPageSize)
+        {
+            loadFinished[table] = true;
+        }
+        else
+        {
+            loadBefore[table] = page.last().id;
+        }
+        // следующая страница читается сервером, пока регистрируется текущая
+        next = requestNextPage(table);
+        registerRows(page);
+    }
+    finishStreamingLoad(true);
+    co_return true;
+}
+
+
+void DbFileSystemWatcher::registerRows(const QVector <PathRow>& page)
+{
+    for (const auto& i : page)
+    {
+        QString local = normalizedPath(root.toLocalPath(i.filepath));
+        if (rowIndex.contains(local))
+        {
+            continue;
+        }
+        rowIndex.insert(local, i.filepath);
+        if (filteredSnapshots && ownsDirectory(parentPath(local)))
+        {
+            addTrackedName(parentPath(local), QFileInfo(local).fileName());
+        }
+        watchRow(local);
+        ++loadedRows;
+        if (firstWatchAt < 0)
+        {
+            firstWatchAt = startupClock.elapsed();
+            log(QString("Startup: first watch after %1 ms").arg(firstWatchAt));
+        }
+    }
+}
+
+
+void DbFileSystemWatcher::finishStreamingLoad(bool ok)
+{
+    if (!startupLoading)
+    {
+        return;
+    }
+    startupLoading = false;
+    startupDone = true;
+    if (ok)
+    {
+        log(QString("Startup: full coverage after %1 ms, %2 rows, %3 directories")
+            .arg(startupClock.elapsed()).arg(loadedRows).arg(watchTree.size()));
+    }
+    // при ошибке загрузки или изменении частей во время нее - обычное полное обновление
+    if (!ok || refreshPending)
+    {
+        refreshPending = false;
+        updateWatchPath();
+    }
+}
+
+
+bool DbFileSystemWatcher::identityWanted(const QString& path) const
+{
+    return hasInterestedRows(path);
+}
+
+
+bool DbFileSystemWatcher::hasInterestedRows(const QString& path) const
+{
+    const QString prefix = path + "/";
+    for (const auto* index : {&rowIndex, &renamedRows})
+    {
+        if (index->contains(path))
+        {
+            return true;
+        }
+        auto it = index->lowerBound(prefix);
+        if (it != index->cend() && it.key().startsWith(prefix))
+        {
+            return true;
+        }
+    }
+    // строки под переименованным каталогом до обновления известны только по его новому пути
+    if (!renamedRows.isEmpty())
+    {
+        for (QString dir = parentPath(path); !dir.isEmpty(); dir = parentPath(dir))
+        {
+            if (renamedRows.contains(dir))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+void DbFileSystemWatcher::setApplyConnections(const QVector <QSharedPointer <DbFileWatcher>>& connections)
+{
+    lanes.clear();
+    for (const auto& i : connections)
+    {
+        lanes.append(ApplyLane {i, nullptr});
+        QObject::connect(i.data(), &DbFileWatcher::errorOccured, this, [this](const QString& error)
+        {log("DB ERROR: " + error);});
+    }
+}
+
+
+qint32 DbFileSystemWatcher::laneOf(const QString& path) const
+{
+    // затравка отличается от shardOf, иначе при равном числе частей все каталоги части попали бы в одно подключение
+    return static_cast <qint32> (qHash(PathEventQueue::directoryOf(path), 0x5bd1e995u) % static_cast <uint> (lanes.size()));
+}
+
+
+// переименование и удаление меняют все строки под путем, поэтому изменение path через подключение lane
+// ждет конца волны, если в ней уже есть изменение этого пути, каталога над ним или пути под ним
+// через другое подключение
+static bool conflictsWithWave(const QMap <QString, qint32>& touched, const QString& path, qint32 lane)
+{
+    for (QString i = path; !i.isEmpty(); i = ModifiedFileSystemWatcher::parentPath(i))
+    {
+        auto it = touched.constFind(i);
+        if (it != touched.constEnd() && it.value() != lane)
+        {
+            return true;
+        }
+    }
+    const QString prefix = path + "/";
+    for (auto it = touched.lowerBound(prefix); it != touched.constEnd() && it.key().startsWith(prefix); ++it)
+    {
+        if (it.value() != lane)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void DbFileSystemWatcher::startApplyWave()
+{
+    QVector <QVector <QPair <QString, QString>>> perLane(lanes.size());
+    // пути изменений волны и их подключения
+    QMap <QString, qint32> touched;
+    while (applyPos < applyBatch.size())
+    {
+        const PathChange& change = applyBatch[applyPos];
+        qint32 lane = laneOf(change.from);
+        if (conflictsWithWave(touched, change.from, lane)
+                || (!change.to.isEmpty() && conflictsWithWave(touched, change.to, lane)))
+        {
+            break;
+        }
+        ++applyPos;
+        perLane[lane].append(qMakePair(root.toDbPath(change.from), change.to.isEmpty() ? QString() : root.toDbPath(change.to)));
+        lanes[lane].changes.append(change);
+        touched.insert(change.from, lane);
+        if (!change.to.isEmpty())
+        {
+            touched.insert(change.to, lane);
+        }
+    }
+    // счетчик выставляется до запуска: без поддержки конвейера в libpq execAsync завершается сразу
+    for (qint32 i = 0; i < lanes.size(); i++)
+    {
+        if (!perLane[i].isEmpty())
+        {
+            lanes[i].pipeline = new DbPipeline(lanes[i].db.data());
+            DbFileWatcher::addPathUpdates(*lanes[i].pipeline, perLane[i]);
+            connect(lanes[i].pipeline, &DbPipeline::finished, this, [this, i]() {laneFinished(i);});
+            ++lanesBusy;
+        }
+    }
+    for (qint32 i = 0; i < lanes.size(); i++)
+    {
+        if (lanes[i].pipeline != nullptr && !lanes[i].pipeline->isActive())
+        {
+            try
+            {
+                lanes[i].pipeline->execAsync();
+            }
+            catch (std::exception& e)
+            {
+                log("DB ERROR: " + QString(e.what()));
+                laneFinished(i);
+            }
+        }
+    }
+}
+
+
+void DbFileSystemWatcher::laneFinished(qint32 lane)
+{
+    DbPipeline* pipeline = lanes[lane].pipeline;
+    if (pipeline == nullptr)
+    {
+        return;
+    }
+    lanes[lane].pipeline = nullptr;
+    QVector <qint32> failed;
+    const QVector <PipelineResult>& results = pipeline->getResults();
+    lanes[lane].db->pathUpdateResults(results, &failed);
+    // конвейер не запустился: не выполнено ни одно изменение
+    for (qint32 i = results.size(); i < lanes[lane].changes.size(); i++)
+    {
+        failed.append(i);
+    }
+    deferFailed(lanes[lane].changes, failed, lanes[lane].db);
+    lanes[lane].changes.clear();
+    // сигнал finished испускается из обработчика самого конвейера
+    pipeline->deleteLater();
+    if (--lanesBusy > 0)
+    {
+        return;
+    }
+    if (applyPos < applyBatch.size() && deferred.isEmpty())
+    {
+        startApplyWave();
+        return;
+    }
+    // следующие волны могут зависеть от отложенных изменений, поэтому откладываются вместе с ними
+    finishBatch(applyBatch.size(), applyBatch.mid(applyPos));
+    applyBatch.clear();
+    applyPos = 0;
+}
+
+
+bool DbFileSystemWatcher::deferFailed(const QVector <PathChange>& changes, const QVector <qint32>& failed,
+                                      const QSharedPointer <DbFileWatcher>& connection)
+{
+    // ошибка самого запроса на живом подключении повтором не исправится - она только попадает в лог
+    if (failed.isEmpty() || connection->isConnected())
+    {
+        return false;
+    }
+    for (auto i : failed)
+    {
+        deferred.append(changes[i]);
+    }
+    retryConnection = connection;
+    return true;
+}
+
+
+void DbFileSystemWatcher::finishBatch(qint32 batchSize, const QVector <PathChange>& notStarted)
+{
+    if (deferred.isEmpty())
+    {
+        queue.markApplied(batchSize);
+        return;
+    }
+    queue.markApplied(batchSize - deferred.size() - notStarted.size());
+    log(QString("DB connection lost, %1 changes deferred until it is restored").arg(deferred.size() + notStarted.size()));
+    // отложенные раньше идут после только что отложенных: они из более поздних пакетов
+    retryChanges = deferred + notStarted + retryChanges;
+    deferred.clear();
+}
+
+
+QVector <QPair <QString, QString>> DbFileSystemWatcher::dbChangesOf(const QVector <PathChange>& changes) const
+{
+    QVector <QPair <QString, QString>> dbChanges;
+    dbChanges.reserve(changes.size());
+    for (const auto& i : changes)
+    {
+        dbChanges.append(qMakePair(root.toDbPath(i.from), i.to.isEmpty() ? QString() : root.toDbPath(i.to)));
+    }
+    return dbChanges;
+}
+
+
+void DbFileSystemWatcher::applyChanges(const QVector <PathChange>& changes)
+{
+    if (!lanes.isEmpty())
+    {
+        applyBatch = changes;
+        applyPos = 0;
+        startApplyWave();
+        return;
+    }
+    QVector <qint32> failed;
+    db->tryToUpdatePaths(dbChangesOf(changes), &failed);
+    deferFailed(changes, failed, db);
+    finishBatch(changes.size(), QVector <PathChange>());
+}
+
+
+void DbFileSystemWatcher::processQueue()
+{
+    // подключение занято чтением страниц загрузки; изменения ждут в очереди
+    if (startupLoading)
+    {
+        return;
+    }
+    // следующий пакет - только после ответа всех подключений на текущий
+    if (applyBusy())
+    {
+        return;
+    }
+    if (!retryChanges.isEmpty())
+    {
+        // изменения, отложенные из-за обрыва, пишутся раньше очереди и только после восстановления
+        // подключения: checkConnection переподключается не чаще, чем позволяет пауза между попытками
+        try
+        {
+            retryConnection->checkConnection();
+        }
+        catch (std::exception&)
+        {
+            return;
+        }
+        QVector <PathChange> changes = retryChanges.mid(0, settings.dbBatchSize);
+        retryChanges.remove(0, changes.size());
+        log(QString("Retrying %1 deferred changes, %2 left").arg(changes.size()).arg(retryChanges.size()));
+        applyChanges(changes);
+        return;
+    }
+    if (!queue.isEmpty())
+    {
+        qint32 count = qMin(dbRateLimiter.available(), settings.dbBatchSize);
+        if (count == 0)
+        {
+            return;
+        }
+        TraceSpan span("apply", "db");
+        QVector <PathChange> changes = queue.take(count);
+        dbRateLimiter.consume(changes.size());
+        if (Tracer::isEnabled())
+        {
+            qint64 now = Tracer::now();
+            for (const auto& i : changes)
+            {
+                if (i.queuedAt >= 0)
+                {
+                    Tracer::complete("queued", "queue", i.queuedAt, now - i.queuedAt, i.from);
+                }
+            }
+        }
+        applyChanges(changes);
+        return;
+    }
+    // сверка переполнившихся каталогов - только когда очередь разобрана
+    if (queue.hasDirty() && dbRateLimiter.tryAcquire())
+    {
+        rescanDirectory(queue.takeDirty());
+        return;
+    }
+    // записанные файлы - пакетом одним запросом
+    if (!settledFiles.isEmpty() && dbRateLimiter.tryAcquire())
+    {
+        flushSettled(settings.dbBatchSize);
+    }
+}
+
+
+DbFileSystemWatcher::~DbFileSystemWatcher()
+{
+    startupLoading = false;
+    loadCancel.cancel();
+    // отправленные волны дочитываются до возврата подключений в пул, остаток пакета пишется через основное
+    for (auto& i : lanes)
+    {
+        if (i.pipeline != nullptr)
+        {
+            disconnect(i.pipeline, nullptr, this, nullptr);
+            delete i.pipeline;
+            i.pipeline = nullptr;
+        }
+    }
+    lanesBusy = 0;
+    // отложенные из-за обрыва - первыми, за ними остаток пакета
+    QVector <PathChange> pending = deferred + applyBatch.mid(applyPos) + retryChanges;
+    deferred.clear();
+    applyBatch.clear();
+    retryChanges.clear();
+    if (!pending.isEmpty())
+    {
+        db->tryToUpdatePaths(dbChangesOf(pending));
+    }
+    // при остановке записываем накопленные изменения без ограничения скорости
+    while (!queue.isEmpty())
+    {
+        db->tryToUpdatePaths(dbChangesOf(queue.take(settings.dbBatchSize)));
+    }
+    while (!settledFiles.isEmpty())
+    {
+        flushSettled(settings.dbBatchSize);
+    }
+}
+
+
+void DbFileSystemWatcher::rescanDirectory(const QString& dir)
+{
+    log("Rescan after queue overflow: " + dir);
+    QVector <PathRow> missing;
+    for (const auto& i : db->getPathsUnder(root.toDbPath(dir) + "/"))
+    {
+        PathInfo info;
+        if (!guardedInfo(root.toLocalPath(i.filepath), info))
+        {
+            // без ответа шары отсутствие не доказано: сверка повторится позже
+            queue.requestRescan(dir);
+            return;
+        }
+        if (!info.exists)
+        {
+            missing.append(i);
+        }
+    }
+    db->markDeleted(missing);
+    queue.markRescanned();
+}
+
+
+void DbFileSystemWatcher::logQueueStats()
+{
+    EventQueueStats stats = queue.getStats();
+    log(QString("Queue: depth %1, max depth %2, enqueued %3, coalesced %4, dropped %5, applied %6, dirty dirs %7, rescans %8")
+        .arg(stats.depth)
+        .arg(stats.maxDepth)
+        .arg(stats.enqueued)
+        .arg(stats.coalesced)
+        .arg(stats.dropped)
+        .arg(stats.applied)
+        .arg(stats.dirtyDirs)
+        .arg(stats.rescans));
 }
@@ -5,6 +5,8 @@
 #include <QObject>
 #include <QStringList>
 #include <QMap>
+#include <QHash>
+#include <QSet>
 #include <QDebug>
 #include <QFileInfo>
 #include <QDir>
@@ -13,6 +15,60 @@
 #include <QDateTime>
 #include <QTextStream>
 #include <QScopedPointer>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <watchroot.h>
+#include <watchersettings.h>
+#include <eventqueue.h>
+#include <ratelimiter.h>
+#include <tracer.h>
+#include <fileidentity.h>
+#include <dbpipeline.h>
+
+class PartitionCoordinator;
+class DbConnectionPool;
+
+// снимок содержимого каталога. В отфильтрованном режиме хранятся только подкаталоги
+// и отслеживаемые имена, а остальные файлы - только их количеством и хэшем имен
+struct DirSnapshot
+{
+    QStringList entries;
+    bool filtered = false;
+    quint64 untrackedHash = 0;
+    qint32 untrackedCount = 0;
+    // идентичность имен, для которых identityWanted()
+    QHash <QString, FileIdentity> identities;
+    // время изменения каталога при чтении, мс
+    qint64 mtime = 0;
+    // номер последнего изменения снимка для вытеснения давно не менявшихся
+    quint64 lastUsed = 0;
+};
+
+// тип и время изменения пути
+struct PathInfo
+{
+    bool exists = false;
+    bool isDir = false;
+    qint64 mtime = 0;
+};
+
+// вытесненный снимок: отпечаток всего содержимого и только нужные наблюдателю имена
+struct DirFingerprint
+{
+    qint32 count = 0;
+    quint64 nameHash = 0;
+    qint64 mtime = 0;
+    QHash <QString, FileIdentity> identities;
+};
+
+// разница двух снимков каталога
+struct DirectoryDiff
+{
+    QStringList added;
+    QStringList deleted;
+};
 
 class ModifiedFileSystemWatcher : public QFileSystemWatcher
 {
@@ -25,11 +81,45 @@ public:
             _sysWatcher.reset(new QFileSystemWatcher());
             connect(_sysWatcher.data(), SIGNAL(directoryChanged( QString )), this, SLOT(directoryUpdated(QString)));
             connect(_sysWatcher.data(), SIGNAL(fileChanged( QString )), this, SLOT(fileUpdated(QString)));
-            createLogFile();
     }
 
+    // регистрация каталога с подсчетом ссылок: наблюдение и снимок создаются при первой
+    // регистрации и снимаются при последнем removeWatchPath
     void addWatchPath(QString path);
 
+    void removeWatchPath(QString path);
+
+    bool isWatched(const QString& path) const {return watchTree.contains(normalizedPath(path));}
+
+    // путь без завершающего "/"
+    static QString normalizedPath(QString path);
+
+    static QString parentPath(QString path);
+
+    static DirectoryDiff diffEntries(const QStringList& oldEntries, const QStringList& newEntries);
+
+    // отфильтрованные снимки: в снимке каталога только имена из setTrackedNames и подкаталоги;
+    // раз в verifyInterval мс снимки сверяются с каталогами на случай пропущенных изменений
+    void setFilteredSnapshots(bool enabled, qint32 verifyInterval);
+
+    // каталог -> имена в нем, которые нужно отслеживать
+    void setTrackedNames(const QHash <QString, QSet <QString>>& names);
+
+    // добавляет одно отслеживаемое имя без перечитывания каталога
+    void addTrackedName(const QString& dir, const QString& name);
+
+    // предел числа имен во всех снимках; при превышении давно не менявшиеся каталоги
+    // вытесняются до отпечатков и перечитываются при следующем изменении. 0 - без предела
+    void setSnapshotLimit(qint32 limit) {snapshotLimit = limit; enforceSnapshotLimit();}
+
+    // окно сопоставления удаления в одном каталоге с появлением в другом, мс; 0 - перемещения не отслеживаются.
+    // Удаления отслеживаемых имен и появления сообщаются с задержкой на это окно, а появление,
+    // сопоставленное с удалением, сообщается только как renamed
+    void setMoveWindow(qint32 window);
+
+    // запись в общий лог сервиса, потокобезопасна
+    static bool writeLog(const QString& message);
+
 signals:
 
     void renamed (const QString& from, const QString& to);
@@ -38,6 +128,8 @@ signals:
 
     void added (const QString& path);
 
+    void modified (const QString& path);
+
     void error ();
 
 public slots:
@@ -46,18 +138,103 @@ public slots:
 
     void fileUpdated(const QString & path);
 
+    void verifyFilteredSnapshots();
+
+    void flushPendingMoves();
+
 protected:
-    void createLogFile();
+    // нужна ли идентичность файла для распознавания его перемещения между каталогами
+    virtual bool identityWanted(const QString& path) const {Q_UNUSED(path); return false;}
+
+    // изменения вытесненного каталога не восстановить по отпечатку - нужна полная сверка
+    virtual void snapshotLost(const QString& path) {log("Snapshot lost: " + path);}
+
+    void storeSnapshot(const QString& path, DirSnapshot snapshot);
+
+    void dropSnapshot(const QString& path);
+
+    void enforceSnapshotLimit();
+
+    // восстанавливает вытесненный снимок по уведомлению об изменении каталога
+    void restoreSnapshot(const QString& path);
+
+    // имя стало нужно наблюдателю после вытеснения снимка его каталога: имя добавляется к известным
+    // именам отпечатка, иначе его удаление или переименование не восстановить
+    void rememberInColdSnapshot(const QString& path);
 
-    QFile logFile;
+    // лог общий для всех наблюдателей (по одному на корень и поток)
+    void log(const QString& message);
 
-    QTextStream out;
+    // ok == false - шара не ответила за срок FsGuard, снимок пустой
+    DirSnapshot readDirectory(const QString& path, QStringList* untracked = nullptr, bool* ok = nullptr) const;
 
-    QMap<QString, QStringList> _currContents;
+    static bool guardedInfo(const QString& path, PathInfo& info);
+
+    void registerWatch(const QString& path);
+
+    // регистрация каталогов, отложенная из-за зависшей шары
+    void retryPendingWatches();
+
+    void applySnapshot(const QString& path, DirSnapshot newSnapshot, const QStringList& untracked);
+
+    QMap<QString, DirSnapshot> _currContents;
+
+    QHash <QString, DirFingerprint> coldSnapshots;
+
+    qint32 snapshotLimit = 0;
+
+    qint64 snapshotEntries = 0;
+
+    quint64 snapshotTick = 0;
+
+    // зарегистрированные каталоги и число регистраций каждого
+    QHash <QString, qint32> watchTree;
+
+    // зарегистрированные каталоги без наблюдения или снимка: шара не отвечала
+    QSet <QString> pendingWatches;
+
+    QHash <QString, QSet <QString>> _trackedNames;
+
+    bool filteredSnapshots = false;
+
+    QTimer* verifyTimer = nullptr;
+
+    // удаление или появление, ожидающее пары из другого каталога
+    struct PendingMove
+    {
+        QString path;
+        FileIdentity identity;
+        qint64 time;
+    };
+
+    void fillIdentities(const QString& path, DirSnapshot& snapshot, const DirSnapshot* previous) const;
+
+    void fileDeleted(const QString& path, const FileIdentity& identity);
+
+    void fileAdded(const QString& path);
+
+    qint32 moveWindow = 0;
+
+    QVector <PendingMove> pendingDeletes;
+
+    QVector <PendingMove> recentAdds;
+
+    QElapsedTimer moveClock;
+
+    QTimer* moveTimer = nullptr;
 
     QScopedPointer<QFileSystemWatcher> _sysWatcher;
 
+private:
+    static bool createLogFile();
+
+    static QFile logFile;
 
+    static QTextStream out;
+
+    static QDate logDate;
+
+    static QMutex logMutex;
 };
 
 class DbFileSystemWatcher : public ModifiedFileSystemWatcher
@@ -65,39 +242,188 @@ class DbFileSystemWatcher : public ModifiedFileSystemWatcher
     Q_OBJECT
 public:
 
-    DbFileSystemWatcher(DbFileWatcher* _db, QObject* parent = nullptr) : ModifiedFileSystemWatcher(parent)
-    {
-            db.reset(_db);
-            ConnectionData data;
-            QObject::connect(this, &DbFileSystemWatcher::deleted, [this](auto& oldf) {db->tryToUpdatePath(oldf, QString());});
-            QObject::connect(this, &DbFileSystemWatcher::renamed, [this](auto& oldf, auto& newf) {db->tryToUpdatePath(oldf, newf);});
-            QObject::connect(db.data(), &DbFileWatcher::errorOccured, [this](auto& error)
-            {out << QDateTime::currentDateTime().toString(Qt::ISODate) << "     " << "DB ERROR: " << error << endl;});
-    }
+    DbFileSystemWatcher(QSharedPointer <DbFileWatcher> _db, const WatchRoot& _root,
+                        const WatcherSettings& _settings = WatcherSettings(), QObject* parent = nullptr);
 
-    void updateWatchPath()
-    {
-        _currContents.clear();
-        //qDebug() << "try to get dirs";
-        QStringList dirList = db->getDirectroriesList();
-        //qDebug() << "get dirs";
-        for (auto& i : dirList)
-        {
-            addWatchPath("//Camera20/DATA/" + i);
-            if (i[i.size() - 1] == "/")
-            {
-                i.remove(i.size() - 1, 1);
-            }
-            int pos = i.indexOf(QRegExp("(/)(?!.+/)"), 0);
-            //qDebug() << pos;
-            i.remove(pos, i.size() - pos);
-            addWatchPath("//Camera20/DATA/" + i);
-        }
-    }
+    const WatchRoot& getRoot() const {return root;}
+
+    EventQueueStats getQueueStats() const {return queue.getStats();}
+
+    // наблюдатель регистрирует только каталоги, чей путь попал в его часть по хэшу (shardOf);
+    // строки БД известны ему все, чтобы изменение каталога находило строки под ним
+    void setShard(qint32 index, qint32 count) {shardIndex = index; shardCount = qMax(count, 1);}
+
+    // источник частей путей этого экземпляра при работе нескольких экземпляров с одной БД
+    void setPartitionCoordinator(const PartitionCoordinator* _coordinator) {coordinator = _coordinator;}
+
+    static qint32 shardOf(const QString& dir, qint32 count) {return static_cast <qint32> (qHash(dir) % static_cast <uint> (count));}
+
+    // подключения для параллельной записи изменений; каталог всегда пишется через одно и то же,
+    // поэтому изменения одного каталога применяются строго по порядку. Задать до начала работы
+    void setApplyConnections(const QVector <QSharedPointer <DbFileWatcher>>& connections);
+
+    // пул, из которого на время чтения путей берутся свободные подключения, чтобы таблицы реестра читались одновременно
+    void setFetchPool(DbConnectionPool* pool) {fetchPool = pool;}
+
+    void updateWatchPath();
+
+    ~DbFileSystemWatcher();
+
+protected:
+    bool identityWanted(const QString& path) const override;
+
+    void snapshotLost(const QString& path) override;
+
+    // пакет изменений по порядку: волнами через подключения setApplyConnections или одним конвейером
+    // через основное подключение. Следующий пакет - только когда !applyBusy()
+    void applyChanges(const QVector <PathChange>& changes);
+
+    bool applyBusy() const {return applyPos < applyBatch.size() || lanesBusy > 0;}
 
 private:
 
-    QScopedPointer <DbFileWatcher> db;
+    // применяет очередной пакет изменений из очереди или сверяет помеченный каталог
+    void processQueue();
+
+    void rescanDirectory(const QString& dir);
+
+    // пакет раскладывается по подключениям волнами: изменение пути, который в этой волне уже менялся
+    // (сам, каталог над ним или путь под ним) через другое подключение, начинает следующую волну,
+    // а она начинается, когда все подключения ответили
+    void startApplyWave();
+
+    void laneFinished(qint32 lane);
+
+    // изменения, запросы которых не выполнились из-за обрыва подключения connection, откладываются
+    // до его восстановления; ошибки запросов на живом подключении не повторяются
+    bool deferFailed(const QVector <PathChange>& changes, const QVector <qint32>& failed,
+                     const QSharedPointer <DbFileWatcher>& connection);
+
+    // конец пакета: отложенные изменения и еще не начатые notStarted встают перед прежними отложенными
+    void finishBatch(qint32 batchSize, const QVector <PathChange>& notStarted);
+
+    QVector <QPair <QString, QString>> dbChangesOf(const QVector <PathChange>& changes) const;
+
+    qint32 laneOf(const QString& path) const;
+
+    // файлы каталогов из БД ставятся на ожидание окончания записи и наблюдаются, пока запись не закончится,
+    // чтобы продолжение записи обнаруживалось как modified
+    void watchWrites(const QString& path);
+
+    // снимает наблюдение за файлом или за всеми файлами под каталогом path
+    void unwatchWrites(const QString& path);
+
+    void unwatchWrite(const QString& path);
+
+    // первоначальная загрузка: страницы путей из БД от новых строк к старым,
+    // наблюдение включается по мере поступления строк, следующая страница запрашивается
+    // до регистрации текущей
+    void startStreamingLoad();
+
+    // сопрограмма загрузки; завершается при удалении наблюдателя или остановке загрузки
+    DbTask <bool> streamingLoad();
+
+    // запрос следующей страницы очередной таблицы; table = -1 - все таблицы прочитаны
+    DbTask <QVector <PathRow>> requestNextPage(qint32& table);
+
+    void finishStreamingLoad(bool ok);
+
+    void registerRows(const QVector <PathRow>& page);
+
+    bool ownsDirectory(const QString& dir) const;
+
+    // регистрация каталога строки и его родителя, если они принадлежат части этого потока
+    void watchRow(const QString& local);
+
+    void unwatchRow(const QString& local);
+
+    void flushSettled(qint32 count);
+
+    void logQueueStats();
+
+    // есть ли строки БД с путем path или под ним
+    bool hasInterestedRows(const QString& path) const;
+
+    QSharedPointer <DbFileWatcher> db;
+
+    WatchRoot root;
+
+    WatcherSettings settings;
+
+    PathEventQueue queue;
+
+    RateLimiter dbRateLimiter;
+
+    QTimer* drainTimer;
+
+    SettleDetector* settle = nullptr;
+
+    bool startupDone = false;
+
+    bool startupLoading = false;
+
+    // обновление, запрошенное во время загрузки
+    bool refreshPending = false;
+
+    QElapsedTimer startupClock;
+
+    qint64 firstWatchAt = -1;
+
+    qint32 loadedRows = 0;
+
+    qint32 nextLoadTable = 0;
+
+    // граница id и признак окончания для каждой таблицы
+    QVector <qint32> loadBefore;
+
+    QVector <bool> loadFinished;
+
+    DbCancelToken loadCancel;
+
+    // записанные файлы, ожидающие записи в БД, пути в формате БД
+    QVector <SettledFile> settledFiles;
+
+    // файлы, добавленные в наблюдение watchWrites, по каталогам; упорядочено, чтобы найти каталоги под путем
+    QMap <QString, QSet <QString>> writtenFiles;
+
+    const PartitionCoordinator* coordinator = nullptr;
+
+    DbConnectionPool* fetchPool = nullptr;
+
+    qint32 shardIndex = 0;
+
+    qint32 shardCount = 1;
+
+    // локальные пути строк БД последнего обновления -> путь в БД, упорядочены для поиска по префиксу
+    QMap <QString, QString> rowIndex;
+
+    // новые пути переименований, еще не полученные из БД
+    QMap <QString, QString> renamedRows;
+
+    struct ApplyLane
+    {
+        QSharedPointer <DbFileWatcher> db;
+        DbPipeline* pipeline = nullptr;
+        // изменения текущей волны в порядке запросов конвейера
+        QVector <PathChange> changes;
+    };
+
+    QVector <ApplyLane> lanes;
+
+    // применяемый пакет и позиция следующей волны
+    QVector <PathChange> applyBatch;
+
+    qint32 applyPos = 0;
+
+    qint32 lanesBusy = 0;
+
+    // изменения текущего пакета, не записанные из-за обрыва подключения
+    QVector <PathChange> deferred;
+
+    // отложенные изменения пишутся раньше очереди, когда восстановится подключение retryConnection
+    QVector <PathChange> retryChanges;
+
+    QSharedPointer <DbFileWatcher> retryConnection;
 };
 
 #endif // MODIFIEDFILESYSTEMWATCHER_H
@@ -0,0 +1,125 @@
+#include "partitioncoordinator.h"
+#include <modifiedfilesystemwatcher.h>
+#include <algorithm>
+
+PartitionCoordinator::PartitionCoordinator(DbConnectionPool* _pool, const WatcherSettings& _settings, QObject* parent) :
+    QObject(parent), pool(_pool), settings(_settings), timer(this)
+{
+    timer.setInterval(settings.partitionCheckInterval);
+    connect(&timer, &QTimer::timeout, this, &PartitionCoordinator::rebalance);
+}
+
+void PartitionCoordinator::start()
+{
+    rebalance();
+    timer.start();
+}
+
+void PartitionCoordinator::stop()
+{
+    timer.stop();
+    // блокировки снимаются вместе с сессией, но явное снятие отдает части остальным сразу
+    if (db)
+    {
+        try
+        {
+            db->execParams("SELECT pg_advisory_unlock_all()", {});
+        }
+        catch (std::exception&) {}
+        db.reset();
+    }
+    QMutexLocker lock(&mutex);
+    owned.clear();
+}
+
+PathPartition PartitionCoordinator::current() const
+{
+    QMutexLocker lock(&mutex);
+    return PathPartition {settings.partitions, owned};
+}
+
+// части, блокировки которых действительно держит сессия: после переподключения их нет
+QVector <qint32> PartitionCoordinator::heldPartitions()
+{
+    PgResult result = db->execParams("SELECT objid FROM pg_locks WHERE locktype = 'advisory' AND classid = $1 "
+                                     "AND objsubid = 2 AND granted AND pid = pg_backend_pid() ORDER BY objid",
+                                     {settings.partitionLockKey + 1});
+    QVector <qint32> held;
+    for (int i = 0; i < PQntuples(result.data()); i++)
+    {
+        held.append(QString(PQgetvalue(result.data(), i, 0)).toInt());
+    }
+    return held;
+}
+
+void PartitionCoordinator::rebalance()
+{
+    QVector <qint32> held;
+    try
+    {
+        if (!db)
+        {
+            db = pool->acquire();
+        }
+        db->execParams("SELECT pg_advisory_lock_shared($1, 0) WHERE NOT EXISTS (SELECT 1 FROM pg_locks "
+                       "WHERE locktype = 'advisory' AND classid = $1 AND objid = 0 AND objsubid = 2 "
+                       "AND pid = pg_backend_pid())", {settings.partitionLockKey});
+        // остаток от деления частей достается экземплярам с наименьшими pid сессий, остальные держат целую долю
+        PgResult live = db->execParams("SELECT count(*), count(*) FILTER (WHERE pid < pg_backend_pid()) FROM pg_locks "
+                                       "WHERE locktype = 'advisory' AND classid = $1 AND objid = 0 AND objsubid = 2 "
+                                       "AND granted", {settings.partitionLockKey});
+        qint32 instances = qMax(QString(PQgetvalue(live.data(), 0, 0)).toInt(), 1);
+        qint32 rank = QString(PQgetvalue(live.data(), 0, 1)).toInt();
+        qint32 target = settings.partitions / instances + (rank < settings.partitions % instances ? 1 : 0);
+
+        held = heldPartitions();
+        // лишние части отдаются, чтобы их забрали новые экземпляры
+        while (held.size() > target)
+        {
+            db->execParams("SELECT pg_advisory_unlock($1, $2)", {settings.partitionLockKey + 1, held.takeLast()});
+        }
+        for (qint32 p = 0; p < settings.partitions && held.size() < target; p++)
+        {
+            if (held.contains(p))
+            {
+                continue;
+            }
+            PgResult locked = db->execParams("SELECT pg_try_advisory_lock($1, $2)", {settings.partitionLockKey + 1, p});
+            if (QString(PQgetvalue(locked.data(), 0, 0)) == "t")
+            {
+                held.append(p);
+            }
+        }
+        std::sort(held.begin(), held.end());
+    }
+    catch (std::exception& e)
+    {
+        // без подключения принадлежность частей неизвестна: наблюдение прекращается до восстановления
+        ModifiedFileSystemWatcher::writeLog("DB ERROR: partition coordination: " + QString(e.what()));
+        db.reset();
+        held.clear();
+    }
+
+    bool changed = false;
+    {
+        QMutexLocker lock(&mutex);
+        changed = held != owned;
+        owned = held;
+    }
+    if (changed)
+    {
+        QStringList list;
+        for (auto i : held)
+        {
+            list.append(QString::number(i));
+        }
+        ModifiedFileSystemWatcher::writeLog(QString("Partitions owned (%1 of %2): %3")
+                                            .arg(held.size()).arg(settings.partitions).arg(list.join(",")));
+        emit partitionsChanged();
+    }
+}
+
+PartitionCoordinator::~PartitionCoordinator()
+{
+    stop();
+}
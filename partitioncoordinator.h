@@ -0,0 +1,58 @@
+#ifndef PARTITIONCOORDINATOR_H
+#define PARTITIONCOORDINATOR_H
+
+#include <QObject>
+#include <QTimer>
+#include <QMutex>
+#include <connectionpool.h>
+#include <watchersettings.h>
+
+// распределение путей между экземплярами сервиса, работающими с одной БД.
+// Пространство путей делится на settings.partitions частей по хэшу родительского каталога,
+// часть принадлежит экземпляру, держащему сессионную рекомендательную блокировку
+// (lockKey + 1, номер части). Каждый экземпляр держит общую блокировку (lockKey, 0), по числу
+// таких блокировок в pg_locks определяется число живых экземпляров и доля каждого: целая часть от деления,
+// остаток - по одной части экземплярам с наименьшими pid сессий.
+// Блокировки умершего экземпляра снимает сервер при разрыве сессии, его части
+// забирают остальные при следующей проверке
+class PartitionCoordinator : public QObject
+{
+    Q_OBJECT
+public:
+    PartitionCoordinator(DbConnectionPool* _pool, const WatcherSettings& _settings, QObject* parent = nullptr);
+
+    PartitionCoordinator(const PartitionCoordinator&)                   = delete;
+
+    PartitionCoordinator(PartitionCoordinator&& )                       = delete;
+
+    PartitionCoordinator& operator=(const PartitionCoordinator&)        = delete;
+
+    PartitionCoordinator& operator=(PartitionCoordinator&&)             = delete;
+
+    void start();
+
+    void stop();
+
+    // части этого экземпляра; потокобезопасно
+    PathPartition current() const;
+
+    ~PartitionCoordinator();
+
+signals:
+
+    void partitionsChanged();
+
+private:
+    void rebalance();
+
+    QVector <qint32> heldPartitions();
+
+    DbConnectionPool* pool;
+    WatcherSettings settings;
+    QSharedPointer <DbFileWatcher> db;
+    QTimer timer;
+    mutable QMutex mutex;
+    QVector <qint32> owned;
+};
+
+#endif // PARTITIONCOORDINATOR_H
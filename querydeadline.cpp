@@ -0,0 +1,112 @@
+#include "querydeadline.h"
+#include <database.h>
+
+// сколько раз служба повторяет отмену, если сервер не принял запрос отмены
+constexpr const qint32 maxCancelRounds = 3;
+constexpr const qint32 cancelRetryInterval = 1000;
+
+QueryDeadlineService::QueryDeadlineService()
+{
+    clock.start();
+    start();
+}
+
+QueryDeadlineService& QueryDeadlineService::instance()
+{
+    static QueryDeadlineService service;
+    return service;
+}
+
+quint64 QueryDeadlineService::arm(const QUuid& connId, qint32 timeout)
+{
+    if (timeout <= 0)
+    {
+        return 0;
+    }
+    QMutexLocker lock(&mutex);
+    quint64 ticket = nextTicket++;
+    entries.insert(ticket, Entry {connId, 0});
+    queue.insert(clock.elapsed() + timeout, ticket);
+    condition.wakeOne();
+    return ticket;
+}
+
+void QueryDeadlineService::disarm(quint64 ticket)
+{
+    if (ticket == 0)
+    {
+        return;
+    }
+    // отправляемая отмена этого запроса дожидается завершения, поэтому после disarm она уже не придет
+    QMutexLocker lock(&mutex);
+    while (cancelling == ticket)
+    {
+        cancelFinished.wait(&mutex);
+    }
+    entries.remove(ticket);
+}
+
+void QueryDeadlineService::run()
+{
+    QMutexLocker lock(&mutex);
+    while (!stopping)
+    {
+        if (queue.isEmpty())
+        {
+            condition.wait(&mutex);
+            continue;
+        }
+        auto first = queue.begin();
+        qint64 now = clock.elapsed();
+        if (first.key() > now)
+        {
+            condition.wait(&mutex, static_cast <unsigned long> (first.key() - now));
+            continue;
+        }
+        quint64 ticket = first.value();
+        queue.erase(first);
+        auto it = entries.find(ticket);
+        if (it == entries.end())
+        {
+            continue;
+        }
+        // запрос отмены идет по сети: без блокировки, чтобы зависший сервер не задерживал arm/disarm других потоков
+        const QUuid connId = it.value().connId;
+        cancelling = ticket;
+        lock.unlock();
+        bool cancelled = Database::cancelOnDeadline(connId);
+        lock.relock();
+        cancelling = 0;
+        cancelFinished.wakeAll();
+        // пока шла отмена, disarm этого срока ждал, поэтому запись на месте
+        it = entries.find(ticket);
+        if (!cancelled && it != entries.end() && ++it.value().cancelRounds < maxCancelRounds)
+        {
+            queue.insert(clock.elapsed() + cancelRetryInterval, ticket);
+        }
+    }
+}
+
+QueryDeadlineService::~QueryDeadlineService()
+{
+    mutex.lock();
+    stopping = true;
+    condition.wakeOne();
+    mutex.unlock();
+    wait();
+}
+
+
+QueryDeadline::QueryDeadline(const QUuid& connId, qint32 timeout)
+{
+    if (timeout > 0)
+    {
+        Database::resetTimedOut(connId);
+        ticket = QueryDeadlineService::instance().arm(connId, timeout);
+    }
+}
+
+QueryDeadline::~QueryDeadline()
+{
+    QueryDeadlineService::instance().disarm(ticket);
+}
@@ -0,0 +1,69 @@
+#ifndef QUERYDEADLINE_H
+#define QUERYDEADLINE_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QMultiMap>
+#include <QHash>
+#include <QUuid>
+#include <QElapsedTimer>
+
+// служба сроков выполнения запросов: отдельный поток, который по истечении срока
+// отправляет серверу запрос отмены (ограниченное число попыток) и помечает подключение,
+// чтобы ошибка запроса была выдана как DbTimeoutException
+class QueryDeadlineService : public QThread
+{
+    Q_OBJECT
+public:
+    static QueryDeadlineService& instance();
+
+    // возвращает номер срока для disarm; timeout <= 0 - без ограничения (возвращает 0)
+    quint64 arm(const QUuid& connId, qint32 timeout);
+
+    void disarm(quint64 ticket);
+
+    ~QueryDeadlineService();
+
+protected:
+    void run() override;
+
+private:
+    QueryDeadlineService();
+
+    struct Entry
+    {
+        QUuid connId;
+        qint32 cancelRounds;
+    };
+
+    QMutex mutex;
+    QWaitCondition condition;
+    // срок, отмена которого отправляется вне блокировки, и сигнал ее завершения для disarm
+    quint64 cancelling = 0;
+    QWaitCondition cancelFinished;
+    QElapsedTimer clock;
+    QMultiMap <qint64, quint64> queue;
+    QHash <quint64, Entry> entries;
+    quint64 nextTicket = 1;
+    bool stopping = false;
+};
+
+
+// срок выполнения одного запроса, снимается при выходе из области видимости
+class QueryDeadline
+{
+public:
+    QueryDeadline(const QUuid& connId, qint32 timeout);
+
+    QueryDeadline(const QueryDeadline&)                   = delete;
+
+    QueryDeadline& operator=(const QueryDeadline&)        = delete;
+
+    ~QueryDeadline();
+
+private:
+    quint64 ticket = 0;
+};
+
+#endif // QUERYDEADLINE_H
@@ -0,0 +1,161 @@
+#include "queryprofiler.h"
+#include <QRegularExpression>
+#include <QTextStream>
+#include <algorithm>
+#include <signalwatcher.h>
+
+std::atomic <bool> QueryProfiler::enabled {false};
+QMutex QueryProfiler::mutex;
+QHash <QString, QueryProfiler::Stats> QueryProfiler::stats;
+
+
+void QueryProfiler::record(const QString& queryText, qint64 durationUs, qint64 rows, bool failed)
+{
+    // нормализация - вне блокировки, она дороже обновления счетчиков
+    const QString key = fingerprint(queryText);
+    QMutexLocker lock(&mutex);
+    Stats& s = stats[key];
+    if (s.fingerprint.isEmpty())
+    {
+        s.fingerprint = key;
+    }
+    ++s.calls;
+    s.errors += failed ? 1 : 0;
+    s.rows += rows;
+    s.totalUs += durationUs;
+    s.maxUs = qMax(s.maxUs, durationUs);
+}
+
+QVector <QueryProfiler::Stats> QueryProfiler::snapshot()
+{
+    QVector <Stats> result;
+    {
+        QMutexLocker lock(&mutex);
+        result.reserve(stats.size());
+        for (const auto& i : stats)
+        {
+            result.append(i);
+        }
+    }
+    std::sort(result.begin(), result.end(), [](const Stats& a, const Stats& b) {return a.totalUs > b.totalUs;});
+    return result;
+}
+
+QString QueryProfiler::report()
+{
+    QString text;
+    QTextStream out(&text);
+    out << "Query profile: calls errors rows total_ms avg_ms max_ms fingerprint\n";
+    for (const auto& i : snapshot())
+    {
+        out << i.calls << ' ' << i.errors << ' ' << i.rows << ' '
+            << QString::number(i.totalUs / 1000.0, 'f', 1) << ' '
+            << QString::number(i.totalUs / 1000.0 / qMax(i.calls, qint64(1)), 'f', 2) << ' '
+            << QString::number(i.maxUs / 1000.0, 'f', 1) << ' ' << i.fingerprint << '\n';
+    }
+    out.flush();
+    return text;
+}
+
+void QueryProfiler::reset()
+{
+    QMutexLocker lock(&mutex);
+    stats.clear();
+}
+
+static bool isWordChar(QChar c)
+{
+    return c.isLetterOrNumber() || c == '_' || c == '$';
+}
+
+QString QueryProfiler::fingerprint(const QString& queryText)
+{
+    QString result;
+    result.reserve(queryText.size());
+    const qint32 size = queryText.size();
+    qint32 i = 0;
+    while (i < size)
+    {
+        const QChar c = queryText[i];
+        if (c == '\'')
+        {
+            // E'...' и подобные префиксы относятся к литералу
+            if (!result.isEmpty() && (result.endsWith('E') || result.endsWith('e'))
+                    && (result.size() == 1 || !isWordChar(result[result.size() - 2])))
+            {
+                result.chop(1);
+            }
+            ++i;
+            while (i < size)
+            {
+                if (queryText[i] == '\'')
+                {
+                    if (i + 1 < size && queryText[i + 1] == '\'')
+                    {
+                        i += 2;
+                        continue;
+                    }
+                    break;
+                }
+                i++;
+            }
+            ++i;
+            result.append('?');
+        }
+        else if (c == '"')
+        {
+            // идентификатор в кавычках сохраняется как есть
+            qint32 end = queryText.indexOf('"', i + 1);
+            end = end == -1 ? size : end + 1;
+            result.append(queryText.midRef(i, end - i));
+            i = end;
+        }
+        else if (c.isDigit() && (result.isEmpty() || !isWordChar(result[result.size() - 1])))
+        {
+            while (i < size && (queryText[i].isDigit() || queryText[i] == '.'))
+            {
+                i++;
+            }
+            result.append('?');
+        }
+        else if (c == '-' && i + 1 < size && queryText[i + 1] == '-')
+        {
+            while (i < size && queryText[i] != '\n')
+            {
+                i++;
+            }
+        }
+        else if (c.isSpace())
+        {
+            while (i < size && queryText[i].isSpace())
+            {
+                i++;
+            }
+            if (!result.isEmpty())
+            {
+                result.append(' ');
+            }
+        }
+        else
+        {
+            result.append(c);
+            i++;
+        }
+    }
+    // списки значений разной длины дают один отпечаток: IN (?, ?, ?) -> IN (?)
+    static const QRegularExpression valueList("\\?(\\s*,\\s*\\?)+");
+    result.replace(valueList, "?");
+    return result.trimmed();
+}
+
+
+bool QueryProfiler::dumpOnSignal(QObject* parent, std::function <void(const QString&)> sink)
+{
+#ifdef Q_OS_UNIX
+    return SignalWatcher::watch(SIGUSR1, parent, [sink]() {sink(report());});
+#else
+    Q_UNUSED(parent);
+    Q_UNUSED(sink);
+    return false;
+#endif
+}
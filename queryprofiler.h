@@ -0,0 +1,116 @@
+#ifndef QUERYPROFILER_H
+#define QUERYPROFILER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QVector>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QObject>
+#include <atomic>
+#include <functional>
+
+// статистика запросов на стороне клиента, сгруппированная по отпечатку SQL:
+// литералы (строки, числа) заменяются на ?, поэтому запросы, собранные через QString::arg,
+// попадают в одну строку таблицы. По умолчанию выключен: проверка сводится к чтению одного флага
+class QueryProfiler
+{
+public:
+    struct Stats
+    {
+        QString fingerprint;
+        qint64 calls = 0;
+        qint64 errors = 0;
+        qint64 rows = 0;
+        qint64 totalUs = 0;
+        qint64 maxUs = 0;
+    };
+
+    static void enable() {enabled.store(true, std::memory_order_relaxed);}
+
+    static void disable() {enabled.store(false, std::memory_order_relaxed);}
+
+    static bool isEnabled() {return enabled.load(std::memory_order_relaxed);}
+
+    static void record(const QString& queryText, qint64 durationUs, qint64 rows, bool failed);
+
+    // снимок статистики, по убыванию суммарного времени
+    static QVector <Stats> snapshot();
+
+    // таблица для журнала: вызовы, ошибки, строки, сумма и максимум времени, отпечаток
+    static QString report();
+
+    static void reset();
+
+    // SQL без литералов и лишних пробелов; $1, :имя и идентификаторы сохраняются
+    static QString fingerprint(const QString& queryText);
+
+    // по SIGUSR1 отчет передается в sink из потока parent (SignalWatcher);
+    // только Unix, в остальных системах возвращает false
+    static bool dumpOnSignal(QObject* parent, std::function <void(const QString&)> sink);
+
+private:
+    static std::atomic <bool> enabled;
+
+    static QMutex mutex;
+
+    static QHash <QString, Stats> stats;
+};
+
+
+// замер одного запроса от создания до finish(); без finish() запрос считается завершенным с ошибкой
+class QueryProfile
+{
+public:
+    explicit QueryProfile(const QString& _queryText) : active(QueryProfiler::isEnabled())
+    {
+        if (active)
+        {
+            queryText = _queryText;
+            clock.start();
+        }
+    }
+
+    // текст в UTF-8 (запросы libpq) переводится в QString, только если профилировщик включен
+    explicit QueryProfile(const QByteArray& _queryText) : active(QueryProfiler::isEnabled())
+    {
+        if (active)
+        {
+            queryText = QString::fromUtf8(_queryText);
+            clock.start();
+        }
+    }
+
+    QueryProfile(const QueryProfile&)                   = delete;
+
+    QueryProfile(QueryProfile&& )                       = delete;
+
+    QueryProfile& operator=(const QueryProfile&)        = delete;
+
+    QueryProfile& operator=(QueryProfile&&)             = delete;
+
+    void finish(qint64 rows)
+    {
+        if (active)
+        {
+            QueryProfiler::record(queryText, clock.nsecsElapsed() / 1000, rows, false);
+            active = false;
+        }
+    }
+
+    ~QueryProfile()
+    {
+        if (active)
+        {
+            QueryProfiler::record(queryText, clock.nsecsElapsed() / 1000, 0, true);
+        }
+    }
+
+private:
+    QString queryText;
+    bool active;
+    QElapsedTimer clock;
+};
+
+#endif // QUERYPROFILER_H
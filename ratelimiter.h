@@ -0,0 +1,60 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QElapsedTimer>
+#include <QtGlobal>
+#include <limits>
+
+// ограничитель скорости (token bucket): rate операций в секунду, не более burst подряд;
+// rate <= 0 - без ограничения. Не потокобезопасен
+class RateLimiter
+{
+public:
+    explicit RateLimiter(double _rate = 0, double _burst = 0) :
+        rate(_rate), burst(_burst > 0 ? _burst : qMax(_rate, 1.0)), tokens(burst)
+    {
+        clock.start();
+    }
+
+    qint32 available()
+    {
+        if (rate <= 0)
+        {
+            return std::numeric_limits <qint32>::max();
+        }
+        refill();
+        return static_cast <qint32> (tokens);
+    }
+
+    bool tryAcquire(qint32 count = 1)
+    {
+        if (available() < count)
+        {
+            return false;
+        }
+        consume(count);
+        return true;
+    }
+
+    void consume(qint32 count)
+    {
+        if (rate > 0)
+        {
+            tokens -= count;
+        }
+    }
+
+private:
+    void refill()
+    {
+        qint64 elapsed = clock.restart();
+        tokens = qMin(burst, tokens + elapsed * rate / 1000.0);
+    }
+
+    double rate;
+    double burst;
+    double tokens;
+    QElapsedTimer clock;
+};
+
+#endif // RATELIMITER_H
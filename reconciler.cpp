@@ -0,0 +1,244 @@
+#include "reconciler.h"
+#include <QtConcurrent/QtConcurrent>
+#include <QSettings>
+#include <QFileInfo>
+#include <modifiedfilesystemwatcher.h>
+#include <fsguard.h>
+
+constexpr const qint32 pageSize = 1000;
+constexpr const char* checkpointFile = "reconcile.ini";
+
+Reconciler::Reconciler(DbConnectionPool* _pool, const WatchRoot& _root, const WatcherSettings& _settings,
+                       const PartitionCoordinator* _coordinator, QObject* parent) :
+    QThread(parent), pool(_pool), coordinator(_coordinator), root(_root), settings(_settings), statLimiter(_settings.reconcileRate)
+{
+    statPool.setMaxThreadCount(settings.reconcileWorkers);
+}
+
+
+void Reconciler::run()
+{
+    while (!isInterruptionRequested())
+    {
+        try
+        {
+            QSharedPointer <DbFileWatcher> db = pool->acquire();
+            QObject::connect(db.data(), &DbFileWatcher::errorOccured, [](auto& error)
+            {ModifiedFileSystemWatcher::writeLog("DB ERROR (reconcile): " + error);});
+
+            ModifiedFileSystemWatcher::writeLog("Reconcile started: " + root.localPrefix);
+            checked = 0;
+            marked = 0;
+            missing.clear();
+            bool finished = true;
+            for (const auto& i : DbFileWatcher::pathTables())
+            {
+                if (!reconcileTable(db.data(), i.table))
+                {
+                    finished = false;
+                    break;
+                }
+            }
+            // непомеченные строки остались за позицией прохода и будут проверены в следующий раз
+            missing.clear();
+            ModifiedFileSystemWatcher::writeLog(QString("Reconcile %1: %2, checked %3, marked deleted %4")
+                                                .arg(finished ? "finished" : "interrupted")
+                                                .arg(root.localPrefix)
+                                                .arg(checked)
+                                                .arg(marked));
+        }
+        catch (std::exception& e)
+        {
+            ModifiedFileSystemWatcher::writeLog("DB ERROR (reconcile): " + QString(e.what()));
+        }
+        sleepInterruptible(settings.reconcileInterval);
+    }
+    statPool.waitForDone();
+}
+
+bool Reconciler::reconcileTable(DbFileWatcher* db, const QString& tableName)
+{
+    qint32 lastId = loadCheckpoint(tableName);
+    while (!isInterruptionRequested())
+    {
+        // части перечитываются на каждой странице: после перераспределения чужие строки не проверяются
+        PathPartition partition = coordinator != nullptr ? coordinator->current() : PathPartition();
+        if (partition.count > 0 && partition.owned.isEmpty())
+        {
+            // частей нет или их принадлежность неизвестна: позиция сохраняется до следующего прохода
+            break;
+        }
+        QVector <PathRow> rows = db->getPathsPage(tableName, lastId, pageSize, root.dbPrefix, partition);
+        if (rows.isEmpty())
+        {
+            if (!flushMissing(db, true))
+            {
+                break;
+            }
+            // проход по таблице завершен, следующий начнется сначала
+            saveCheckpoint(tableName, 0);
+            return true;
+        }
+        qint32 count = checkPage(rows);
+        if (count > 0)
+        {
+            lastId = rows[count - 1].id;
+        }
+        if (!flushMissing(db, false) || count == 0)
+        {
+            break;
+        }
+        // позиция не заходит за строки, ожидающие пометки: после прерывания они проверяются снова
+        saveCheckpoint(tableName, missing.isEmpty() ? lastId : missing.first().row.id - 1);
+    }
+    return false;
+}
+
+// 1 - файл есть, 0 - нет, -1 - шара не ответила за срок FsGuard
+static qint32 fileExists(const QString& localPath)
+{
+    bool exists = false;
+    if (!FsGuard::instance().call <bool> (localPath, [localPath]() {return QFileInfo::exists(localPath);}, exists))
+    {
+        return -1;
+    }
+    return exists ? 1 : 0;
+}
+
+qint32 Reconciler::checkPage(const QVector <PathRow>& rows)
+{
+    QVector <QFuture <qint32>> results;
+    results.reserve(rows.size());
+    for (const auto& i : rows)
+    {
+        while (!statLimiter.tryAcquire())
+        {
+            msleep(10);
+        }
+        if (isInterruptionRequested())
+        {
+            break;
+        }
+        QString localPath = root.toLocalPath(i.filepath);
+        results.append(QtConcurrent::run(&statPool, [localPath]() {return fileExists(localPath);}));
+    }
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    // ожидание ограничено сроком FsGuard, поэтому остановка не зависает на шаре
+    qint32 count = 0;
+    for (; count < results.size(); count++)
+    {
+        qint32 exists = results[count].result();
+        if (exists < 0)
+        {
+            // без ответа шары отсутствие не доказано: позиция остается перед этой строкой
+            ModifiedFileSystemWatcher::writeLog("Reconcile paused, mount not responding: " + root.toLocalPath(rows[count].filepath));
+            break;
+        }
+        if (exists == 0)
+        {
+            missing.append(Missing {rows[count], now});
+        }
+    }
+    // оставшиеся проверки дожидаются здесь: пул не должен пережить страницу
+    for (qint32 i = count; i < results.size(); i++)
+    {
+        results[i].waitForFinished();
+    }
+    checked += count;
+    return count;
+}
+
+qint32 Reconciler::checkFile(const QString& localPath)
+{
+    while (!statLimiter.tryAcquire())
+    {
+        msleep(10);
+    }
+    return fileExists(localPath);
+}
+
+bool Reconciler::flushMissing(DbFileWatcher* db, bool all)
+{
+    // выжидаем, чтобы переименование, уже стоящее в очереди наблюдателя, успело попасть в БД:
+    // markDeleted не трогает строку, путь которой изменился
+    if (all && !missing.isEmpty())
+    {
+        qint64 wait = missing.last().foundAt + settings.reconcileGraceTime - QDateTime::currentMSecsSinceEpoch();
+        if (wait > 0 && !sleepInterruptible(static_cast <qint32> (wait)))
+        {
+            return false;
+        }
+    }
+    qint64 border = QDateTime::currentMSecsSinceEpoch() - settings.reconcileGraceTime;
+    if (missing.isEmpty() || missing.first().foundAt > border)
+    {
+        return true;
+    }
+    // пустая точка монтирования или отключенная шара быстро отвечает "нет файла" на любой путь:
+    // без корня отсутствие ничего не доказывает
+    if (checkFile(root.localPrefix) != 1)
+    {
+        ModifiedFileSystemWatcher::writeLog("Reconcile paused, root not available: " + root.localPrefix);
+        return false;
+    }
+    QVector <PathRow> batch;
+    while (!missing.isEmpty() && missing.first().foundAt <= border)
+    {
+        // файл могли заменить записью во временный и переименованием, а каталог - переименовать:
+        // помечается только файл, которого по-прежнему нет в существующем каталоге
+        const QString localPath = root.toLocalPath(missing.first().row.filepath);
+        qint32 exists = checkFile(localPath);
+        qint32 parentExists = exists == 0 ? checkFile(ModifiedFileSystemWatcher::parentPath(localPath)) : 1;
+        if (exists < 0 || parentExists < 0)
+        {
+            ModifiedFileSystemWatcher::writeLog("Reconcile paused, mount not responding: " + localPath);
+            break;
+        }
+        PathRow row = missing.takeFirst().row;
+        if (exists == 0 && parentExists == 1)
+        {
+            batch.append(row);
+        }
+    }
+    if (!batch.isEmpty())
+    {
+        db->markDeleted(batch);
+        marked += batch.size();
+        for (const auto& i : batch)
+        {
+            ModifiedFileSystemWatcher::writeLog("Reconcile marked deleted: " + i.table + " " + i.filepath);
+        }
+    }
+    return missing.isEmpty() || missing.first().foundAt > border;
+}
+
+bool Reconciler::sleepInterruptible(qint32 msecs)
+{
+    constexpr const qint32 step = 200;
+    for (qint32 slept = 0; slept < msecs; slept += step)
+    {
+        if (isInterruptionRequested())
+        {
+            return false;
+        }
+        msleep(static_cast <unsigned long> (qMin(step, msecs - slept)));
+    }
+    return !isInterruptionRequested();
+}
+
+QString Reconciler::checkpointKey(const QString& tableName) const
+{
+    return QString(root.localPrefix).replace("/", "_") + "/" + tableName;
+}
+
+qint32 Reconciler::loadCheckpoint(const QString& tableName) const
+{
+    QSettings checkpoint(checkpointFile, QSettings::IniFormat);
+    return checkpoint.value(checkpointKey(tableName), 0).toInt();
+}
+
+void Reconciler::saveCheckpoint(const QString& tableName, qint32 lastId) const
+{
+    QSettings checkpoint(checkpointFile, QSettings::IniFormat);
+    checkpoint.setValue(checkpointKey(tableName), lastId);
+}
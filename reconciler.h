@@ -0,0 +1,68 @@
+#ifndef RECONCILER_H
+#define RECONCILER_H
+
+#include <QThread>
+#include <QThreadPool>
+#include <QDateTime>
+#include <connectionpool.h>
+#include <watchroot.h>
+#include <watchersettings.h>
+#include <ratelimiter.h>
+#include <partitioncoordinator.h>
+
+// сверка путей БД с файловой системой: находит записи, файлы которых удалили или переименовали,
+// пока сервис не работал или каталог не наблюдался. Пути читаются постранично по id,
+// существование проверяется ограниченным пулом потоков с ограничением числа обращений к шаре в секунду.
+// Отсутствующий файл перед пометкой проверяется еще раз вместе с корнем и родительским каталогом.
+// Позиция сохраняется после каждой страницы, но не дальше непомеченных строк; прерванный проход продолжается с нее.
+// При делении путей между экземплярами (coordinator) сверяются только строки своих частей
+class Reconciler : public QThread
+{
+    Q_OBJECT
+public:
+    Reconciler(DbConnectionPool* _pool, const WatchRoot& _root, const WatcherSettings& _settings,
+               const PartitionCoordinator* _coordinator = nullptr, QObject* parent = nullptr);
+
+protected:
+    void run() override;
+
+private:
+    struct Missing
+    {
+        PathRow row;
+        qint64 foundAt;
+    };
+
+    // false - проход прерван
+    bool reconcileTable(DbFileWatcher* db, const QString& tableName);
+
+    // возвращает число проверенных строк (меньше размера страницы, если сверку прервали или шара не ответила)
+    qint32 checkPage(const QVector <PathRow>& rows);
+
+    // перепроверяет и записывает в БД отсутствующие пути, найденные не позже чем graceTime назад;
+    // false - корень недоступен, шара не ответила или сверку прервали, строки остаются в missing
+    bool flushMissing(DbFileWatcher* db, bool all);
+
+    // проверка существования с ограничением числа обращений: 1 - есть, 0 - нет, -1 - шара не ответила
+    qint32 checkFile(const QString& localPath);
+
+    bool sleepInterruptible(qint32 msecs);
+
+    QString checkpointKey(const QString& tableName) const;
+
+    qint32 loadCheckpoint(const QString& tableName) const;
+
+    void saveCheckpoint(const QString& tableName, qint32 lastId) const;
+
+    DbConnectionPool* pool;
+    const PartitionCoordinator* coordinator;
+    WatchRoot root;
+    WatcherSettings settings;
+    QThreadPool statPool;
+    RateLimiter statLimiter;
+    QVector <Missing> missing;
+    qint64 checked = 0;
+    qint64 marked = 0;
+};
+
+#endif // RECONCILER_H
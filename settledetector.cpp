@@ -0,0 +1,97 @@
+#include "settledetector.h"
+#include <QFileInfo>
+#include <QVector>
+#include <fsguard.h>
+
+struct FileStat
+{
+    bool isFile = false;
+    qint64 size = 0;
+    QDateTime mtime;
+};
+
+// false - шара не ответила за срок FsGuard: поток наблюдателя не ждет зависший stat
+static bool statFile(const QString& path, FileStat& stat)
+{
+    return FsGuard::instance().call <FileStat> (path, [path]()
+    {
+        QFileInfo info(path);
+        return FileStat {info.isFile(), info.size(), info.lastModified()};
+    }, stat);
+}
+
+SettleDetector::SettleDetector(qint32 _settleTime, QObject* parent) :
+    QObject(parent), settleTime(qMax(_settleTime, 1)), timer(this)
+{
+    clock.start();
+    // опрос чаще окна, чтобы запись определялась не позже чем через полтора окна
+    timer.setInterval(qMax(settleTime / 2, 10));
+    connect(&timer, &QTimer::timeout, this, &SettleDetector::poll);
+}
+
+bool SettleDetector::watch(const QString& path)
+{
+    FileStat stat;
+    if (!statFile(path, stat))
+    {
+        // размер неизвестен: файл ждет ответа шары в poll
+        stat = FileStat {true, -1, QDateTime()};
+    }
+    if (!stat.isFile)
+    {
+        return false;
+    }
+    files.insert(path, State {stat.size, stat.mtime, clock.elapsed()});
+    if (!timer.isActive())
+    {
+        timer.start();
+    }
+    return true;
+}
+
+void SettleDetector::poll()
+{
+    const qint64 now = clock.elapsed();
+    // сигналы после обхода: обработчик может поставить на ожидание новый файл
+    QVector <SettledFile> done;
+    for (auto it = files.begin(); it != files.end(); )
+    {
+        FileStat stat;
+        if (!statFile(it.key(), stat))
+        {
+            // шара не отвечает: окончание записи не подтверждено, файл ждет следующего опроса
+            ++it;
+            continue;
+        }
+        if (!stat.isFile)
+        {
+            // удален или переименован до окончания записи
+            it = files.erase(it);
+            continue;
+        }
+        State& state = it.value();
+        if (stat.size != state.size || stat.mtime != state.mtime)
+        {
+            state.size = stat.size;
+            state.mtime = stat.mtime;
+            state.changedAt = now;
+            ++it;
+            continue;
+        }
+        if (now - state.changedAt >= settleTime)
+        {
+            done.append(SettledFile {it.key(), state.size, state.mtime});
+            it = files.erase(it);
+            continue;
+        }
+        ++it;
+    }
+    if (files.isEmpty())
+    {
+        timer.stop();
+    }
+    for (const auto& i : done)
+    {
+        emit settled(i);
+    }
+}
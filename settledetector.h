@@ -0,0 +1,62 @@
+#ifndef SETTLEDETECTOR_H
+#define SETTLEDETECTOR_H
+
+#include <QObject>
+#include <QHash>
+#include <QTimer>
+#include <QDateTime>
+#include <QElapsedTimer>
+
+// окончательные размер и время изменения записанного файла
+struct SettledFile
+{
+    QString path;
+    qint64 size;
+    QDateTime mtime;
+};
+
+// определяет окончание записи файлов: файл считается записанным, когда его размер
+// и время изменения не менялись settleTime мс. Файлы опрашиваются по таймеру через FsGuard,
+// поэтому частые дозаписи не порождают событий, а зависшая шара не останавливает поток
+class SettleDetector : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SettleDetector(qint32 _settleTime, QObject* parent = nullptr);
+
+    SettleDetector(const SettleDetector&)                   = delete;
+
+    SettleDetector(SettleDetector&& )                       = delete;
+
+    SettleDetector& operator=(const SettleDetector&)        = delete;
+
+    SettleDetector& operator=(SettleDetector&&)             = delete;
+
+    // начать (или продолжить) ожидание окончания записи; false - path не файл
+    bool watch(const QString& path);
+
+    void forget(const QString& path) {files.remove(path);}
+
+    qint32 pendingCount() const {return files.size();}
+
+signals:
+
+    void settled(const SettledFile& file);
+
+private:
+    struct State
+    {
+        qint64 size;
+        QDateTime mtime;
+        qint64 changedAt;
+    };
+
+    void poll();
+
+    qint32 settleTime;
+    QHash <QString, State> files;
+    QElapsedTimer clock;
+    QTimer timer;
+};
+
+#endif // SETTLEDETECTOR_H
@@ -0,0 +1,124 @@
+#include "signalwatcher.h"
+#include <QCoreApplication>
+#include <QHash>
+#ifdef Q_OS_UNIX
+#include <QSocketNotifier>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+struct SignalAction
+{
+    QObject* context;
+    std::function <void()> action;
+};
+
+static QHash <int, SignalAction>& actions()
+{
+    static QHash <int, SignalAction> instance;
+    return instance;
+}
+
+
+#ifdef Q_OS_UNIX
+static int signalPipe[2] = {-1, -1};
+
+static void signalHandler(int signal)
+{
+    // в обработчике сигнала допустима только запись в дескриптор
+    char byte = static_cast <char> (signal);
+    ssize_t written = ::write(signalPipe[0], &byte, 1);
+    Q_UNUSED(written);
+}
+
+bool SignalWatcher::watch(int signal, QObject* context, std::function <void()> action)
+{
+    if (actions().contains(signal))
+    {
+        return false;
+    }
+    if (signalPipe[0] == -1)
+    {
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, signalPipe) != 0)
+        {
+            return false;
+        }
+        // уведомитель живет, пока живет приложение: действия разных сигналов идут через него
+        QSocketNotifier* notifier = new QSocketNotifier(signalPipe[1], QSocketNotifier::Read, QCoreApplication::instance());
+        QObject::connect(notifier, &QSocketNotifier::activated, [](int)
+        {
+            char byte;
+            if (::read(signalPipe[1], &byte, 1) != 1)
+            {
+                return;
+            }
+            auto it = actions().constFind(static_cast <unsigned char> (byte));
+            if (it != actions().constEnd())
+            {
+                QMetaObject::invokeMethod(it->context, it->action, Qt::QueuedConnection);
+            }
+        });
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = signalHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (::sigaction(signal, &sa, nullptr) != 0)
+    {
+        return false;
+    }
+    actions().insert(signal, SignalAction {context, std::move(action)});
+    return true;
+}
+#elif defined(Q_OS_WIN)
+static BOOL WINAPI consoleHandler(DWORD event)
+{
+    // обработчик вызывается системой в отдельном потоке
+    const int signal = event == CTRL_C_EVENT || event == CTRL_BREAK_EVENT ? SIGINT : SIGTERM;
+    auto it = actions().constFind(signal);
+    if (it == actions().constEnd())
+    {
+        return FALSE;
+    }
+    QMetaObject::invokeMethod(it->context, it->action, Qt::QueuedConnection);
+    if (event == CTRL_CLOSE_EVENT || event == CTRL_LOGOFF_EVENT || event == CTRL_SHUTDOWN_EVENT)
+    {
+        // после возврата система сразу завершает процесс: ждем, пока главный поток завершит работу
+        Sleep(INFINITE);
+    }
+    return TRUE;
+}
+
+bool SignalWatcher::watch(int signal, QObject* context, std::function <void()> action)
+{
+    if ((signal != SIGINT && signal != SIGTERM) || actions().contains(signal))
+    {
+        return false;
+    }
+    if (actions().isEmpty() && !SetConsoleCtrlHandler(consoleHandler, TRUE))
+    {
+        return false;
+    }
+    actions().insert(signal, SignalAction {context, std::move(action)});
+    return true;
+}
+#else
+bool SignalWatcher::watch(int signal, QObject* context, std::function <void()> action)
+{
+    Q_UNUSED(signal);
+    Q_UNUSED(context);
+    Q_UNUSED(action);
+    return false;
+}
+#endif
+
+void SignalWatcher::quitOnTermination(QObject* app)
+{
+    for (int signal : {SIGTERM, SIGINT})
+    {
+        watch(signal, app, []() {QCoreApplication::quit();});
+    }
+}
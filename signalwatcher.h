@@ -0,0 +1,22 @@
+#ifndef SIGNALWATCHER_H
+#define SIGNALWATCHER_H
+
+#include <QObject>
+#include <functional>
+#include <csignal>
+
+// сигналы процесса в цикле событий: обработчик сигнала только пишет номер в self-pipe,
+// действие выполняется в потоке context через QSocketNotifier. В Windows SIGINT и SIGTERM
+// приходят от консоли (Ctrl+C, Ctrl+Break, закрытие окна, завершение сеанса).
+// Вызывать из главного потока до запуска цикла событий
+class SignalWatcher
+{
+public:
+    // false - сигнал недоступен в этой системе или уже назначен
+    static bool watch(int signal, QObject* context, std::function <void()> action);
+
+    // SIGTERM и SIGINT завершают цикл событий приложения, чтобы сработали обработчики aboutToQuit
+    static void quitOnTermination(QObject* app);
+};
+
+#endif // SIGNALWATCHER_H
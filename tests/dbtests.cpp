@@ -0,0 +1,460 @@
+#include <QtTest>
+#include <connectionpool.h>
+#include <partitioncoordinator.h>
+#include <modifiedfilesystemwatcher.h>
+#include <QRandomGenerator>
+#include <QProcess>
+#include <memory>
+#include <vector>
+
+// ключ блокировок частей, не пересекающийся с рабочим (WatcherSettings::partitionLockKey)
+constexpr const qint32 testLockKey = 0x7e57;
+constexpr const char* testTable = "dbfw_test_paths";
+
+// запись пакетов изменений наблюдателя в обход очереди и файловой системы
+class ApplyProbe : public DbFileSystemWatcher
+{
+public:
+    using DbFileSystemWatcher::DbFileSystemWatcher;
+    using DbFileSystemWatcher::applyChanges;
+    using DbFileSystemWatcher::applyBusy;
+};
+
+// чтение, которое Database направляет на реплику, пока она не отстает
+class ReplicaProbe : public DbFileWatcher
+{
+public:
+    using Database::getSomeInfo;
+};
+
+// тесты с настоящей БД: подключение из переменных окружения libpq, без PGDATABASE тесты пропускаются
+class DbIntegrationTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void partitionsDisjointAndComplete();
+    void partitionsFailOver();
+    void pathsPageByPartition();
+
+    void applyWavesRandomized_data();
+    void applyWavesRandomized();
+
+    void applyThroughput_data();
+    void applyThroughput();
+
+    void replicaLag();
+
+private:
+    struct Instance
+    {
+        std::unique_ptr <DbConnectionPool> pool;
+        std::unique_ptr <PartitionCoordinator> coordinator;
+    };
+
+    static ConnectionData connectionData();
+
+    static WatcherSettings partitionSettings(qint32 partitions);
+
+    // экземпляр со своим пулом: у каждого своя сессия и свои блокировки
+    static Instance startInstance(const WatcherSettings& settings);
+
+    // части живых экземпляров не пересекаются, покрывают все части и поделены поровну
+    static bool balanced(const std::vector <Instance>& instances, qint32 partitions);
+
+    // таблица заполняется строками /data/dN/sN/fN/; возвращает id -> путь
+    static QMap <qint32, QString> fillTree(DbFileWatcher* db, qint32 dirs, qint32 subdirs, qint32 files);
+
+    static QMap <qint32, QString> readRows(DbFileWatcher* db);
+
+    // то же изменение, что запрос обновления путей: строки с путем from и под ним
+    static void applyToModel(QMap <qint32, QString>& rows, const PathChange& change);
+
+    // пакетами через наблюдатель с connections подключениями записи; false - не дождались ответа
+    static bool applyAll(ApplyProbe& watcher, const QVector <PathChange>& changes, qint32 batchSize);
+
+    // наблюдатель с connections подключениями записи из pool (0 - запись через основное)
+    static std::unique_ptr <ApplyProbe> makeWatcher(DbConnectionPool* pool, qint32 connections);
+
+    QScopedPointer <DbConnectionPool> pool;
+    QVector <PathTable> savedTables;
+};
+
+
+ConnectionData DbIntegrationTest::connectionData()
+{
+    ConnectionData data;
+    data.dbName = qEnvironmentVariable("PGDATABASE");
+    data.host = qEnvironmentVariable("PGHOST", "localhost");
+    data.port = qEnvironmentVariableIsSet("PGPORT") ? qEnvironmentVariableIntValue("PGPORT") : 5432;
+    data.userName = qEnvironmentVariable("PGUSER", "postgres");
+    data.password = qEnvironmentVariable("PGPASSWORD");
+    return data;
+}
+
+WatcherSettings DbIntegrationTest::partitionSettings(qint32 partitions)
+{
+    WatcherSettings settings;
+    settings.partitions = partitions;
+    settings.partitionLockKey = testLockKey;
+    settings.partitionCheckInterval = 100;
+    return settings;
+}
+
+DbIntegrationTest::Instance DbIntegrationTest::startInstance(const WatcherSettings& settings)
+{
+    Instance instance;
+    instance.pool.reset(new DbConnectionPool(connectionData(), 1));
+    instance.coordinator.reset(new PartitionCoordinator(instance.pool.get(), settings));
+    instance.coordinator->start();
+    return instance;
+}
+
+bool DbIntegrationTest::balanced(const std::vector <Instance>& instances, qint32 partitions)
+{
+    const qint32 count = static_cast <qint32> (instances.size());
+    QVector <qint32> owners(partitions, 0);
+    for (const auto& i : instances)
+    {
+        const PathPartition partition = i.coordinator->current();
+        const qint32 size = partition.owned.size();
+        if (size == 0 || size < partitions / count || size > (partitions + count - 1) / count)
+        {
+            return false;
+        }
+        for (auto p : partition.owned)
+        {
+            if (p < 0 || p >= partitions || owners[p]++ > 0)
+            {
+                return false;
+            }
+        }
+    }
+    return !owners.contains(0);
+}
+
+
+QMap <qint32, QString> DbIntegrationTest::fillTree(DbFileWatcher* db, qint32 dirs, qint32 subdirs, qint32 files)
+{
+    db->execParams(QString("TRUNCATE %1 RESTART IDENTITY").arg(testTable), {});
+    db->execParams(QString("INSERT INTO %1 (filepath) SELECT '/data/d' || d || '/s' || s || '/f' || f || '/' "
+                           "FROM generate_series(0, $1 - 1) d, generate_series(0, $2 - 1) s, generate_series(0, $3 - 1) f "
+                           "ORDER BY d, s, f").arg(testTable),
+                   {dirs, subdirs, files});
+    return readRows(db);
+}
+
+QMap <qint32, QString> DbIntegrationTest::readRows(DbFileWatcher* db)
+{
+    PgResult result = db->execParams(QString("SELECT id, filepath FROM %1").arg(testTable), {});
+    QMap <qint32, QString> rows;
+    for (int i = 0; i < PQntuples(result.data()); i++)
+    {
+        rows.insert(QString(PQgetvalue(result.data(), i, 0)).toInt(), QString(PQgetvalue(result.data(), i, 1)));
+    }
+    return rows;
+}
+
+void DbIntegrationTest::applyToModel(QMap <qint32, QString>& rows, const PathChange& change)
+{
+    const QString from = change.from + "/";
+    for (auto& i : rows)
+    {
+        if (i.startsWith(from))
+        {
+            i = change.to.isEmpty() ? PathTable {testTable}.deletedValue() : change.to + "/" + i.mid(from.size());
+        }
+    }
+}
+
+bool DbIntegrationTest::applyAll(ApplyProbe& watcher, const QVector <PathChange>& changes, qint32 batchSize)
+{
+    for (qint32 pos = 0; pos < changes.size(); pos += batchSize)
+    {
+        watcher.applyChanges(changes.mid(pos, batchSize));
+        if (!QTest::qWaitFor([&watcher]() {return !watcher.applyBusy();}, 60000))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr <ApplyProbe> DbIntegrationTest::makeWatcher(DbConnectionPool* pool, qint32 connections)
+{
+    std::unique_ptr <ApplyProbe> watcher(new ApplyProbe(pool->acquire(), WatchRoot::fromString("/data/=/data/")));
+    QVector <QSharedPointer <DbFileWatcher>> lanes;
+    for (qint32 i = 0; i < connections; i++)
+    {
+        lanes.append(pool->acquire());
+    }
+    watcher->setApplyConnections(lanes);
+    return watcher;
+}
+
+
+void DbIntegrationTest::initTestCase()
+{
+    if (connectionData().dbName.isEmpty())
+    {
+        QSKIP("PGDATABASE is not set");
+    }
+    pool.reset(new DbConnectionPool(connectionData(), 2));
+    try
+    {
+        auto db = pool->acquire();
+        db->execParams(QString("DROP TABLE IF EXISTS %1").arg(testTable), {});
+        db->execParams(QString("CREATE TABLE %1 (id serial PRIMARY KEY, filepath text NOT NULL)").arg(testTable), {});
+    }
+    catch (std::exception& e)
+    {
+        QFAIL(e.what());
+    }
+    savedTables = DbFileWatcher::pathTables();
+    DbFileWatcher::setPathTables({PathTable {testTable}});
+}
+
+void DbIntegrationTest::cleanupTestCase()
+{
+    if (!pool)
+    {
+        return;
+    }
+    DbFileWatcher::setPathTables(savedTables);
+    try
+    {
+        pool->acquire()->execParams(QString("DROP TABLE IF EXISTS %1").arg(testTable), {});
+    }
+    catch (std::exception&) {}
+}
+
+
+void DbIntegrationTest::partitionsDisjointAndComplete()
+{
+    constexpr const qint32 partitions = 16;
+    std::vector <Instance> instances;
+    for (qint32 i = 0; i < 4; i++)
+    {
+        instances.push_back(startInstance(partitionSettings(partitions)));
+    }
+    QTRY_VERIFY_WITH_TIMEOUT(balanced(instances, partitions), 10000);
+
+    // новый экземпляр получает свою долю, остальные отдают лишнее
+    instances.push_back(startInstance(partitionSettings(partitions)));
+    QTRY_VERIFY_WITH_TIMEOUT(balanced(instances, partitions), 10000);
+}
+
+void DbIntegrationTest::partitionsFailOver()
+{
+    constexpr const qint32 partitions = 12;
+    std::vector <Instance> instances;
+    for (qint32 i = 0; i < 3; i++)
+    {
+        instances.push_back(startInstance(partitionSettings(partitions)));
+    }
+    QTRY_VERIFY_WITH_TIMEOUT(balanced(instances, partitions), 10000);
+
+    // аварийное завершение: сессию экземпляра обрывает сервер, блокировки никто не снимает явно
+    const qint32 victimPart = instances[1].coordinator->current().owned.first();
+    PgResult killed = pool->acquire()->execParams("SELECT pg_terminate_backend(pid) FROM pg_locks "
+                                                  "WHERE locktype = 'advisory' AND classid = $1 AND objid = $2 "
+                                                  "AND objsubid = 2 AND granted",
+                                                  {testLockKey + 1, victimPart});
+    QCOMPARE(PQntuples(killed.data()), 1);
+    instances.erase(instances.begin() + 1);
+
+    QTRY_VERIFY_WITH_TIMEOUT(balanced(instances, partitions), 10000);
+}
+
+void DbIntegrationTest::pathsPageByPartition()
+{
+    constexpr const qint32 partitions = 4;
+    constexpr const qint32 dirs = 20;
+    constexpr const qint32 filesPerDir = 10;
+    auto db = pool->acquire();
+    db->execParams(QString("INSERT INTO %1 (filepath) SELECT '/data/dir' || d || '/file' || f || '/' "
+                           "FROM generate_series(1, $1) d, generate_series(1, $2) f").arg(testTable),
+                   {dirs, filesPerDir});
+
+    // части, которыми сверка (Reconciler) читает строки, не пересекаются и покрывают все строки,
+    // а строки одного каталога попадают в одну часть
+    QHash <qint32, qint32> partOfRow;
+    QHash <QString, qint32> partOfDir;
+    for (qint32 p = 0; p < partitions; p++)
+    {
+        QVector <PathRow> rows = db->getPathsPage(testTable, 0, dirs * filesPerDir, "/data/", PathPartition {partitions, {p}});
+        for (const auto& i : rows)
+        {
+            QVERIFY(!partOfRow.contains(i.id));
+            partOfRow.insert(i.id, p);
+            const QString dir = i.filepath.section('/', 0, 2);
+            QCOMPARE(partOfDir.value(dir, p), p);
+            partOfDir.insert(dir, p);
+        }
+    }
+    QCOMPARE(partOfRow.size(), dirs * filesPerDir);
+
+    // без деления - все строки
+    QCOMPARE(db->getPathsPage(testTable, 0, dirs * filesPerDir, "/data/").size(), dirs * filesPerDir);
+}
+
+void DbIntegrationTest::applyWavesRandomized_data()
+{
+    QTest::addColumn <qint32> ("connections");
+    QTest::addColumn <quint32> ("seed");
+    for (qint32 connections : {0, 1, 2, 4, 8})
+    {
+        for (quint32 seed : {1u, 2u, 3u})
+        {
+            QTest::addRow("connections=%d seed=%u", connections, seed) << connections << seed;
+        }
+    }
+}
+
+// случайные переименования и удаления файлов и каталогов любого уровня, в том числе перемещения
+// между каталогами разных подключений; итог в БД должен совпасть с последовательным применением
+void DbIntegrationTest::applyWavesRandomized()
+{
+    QFETCH(qint32, connections);
+    QFETCH(quint32, seed);
+    DbConnectionPool lanePool(connectionData(), connections + 1);
+    auto db = pool->acquire();
+    QMap <qint32, QString> model = fillTree(db.data(), 8, 4, 8);
+    const QString deletedValue = PathTable {testTable}.deletedValue();
+
+    QRandomGenerator random(seed);
+    QVector <PathChange> changes;
+    qint32 fresh = 0;
+    while (changes.size() < 1000)
+    {
+        QStringList live;
+        for (const auto& i : model)
+        {
+            if (i != deletedValue)
+            {
+                live.append(i);
+            }
+        }
+        if (live.isEmpty())
+        {
+            break;
+        }
+        // путь любого уровня под /data: файл, подкаталог или каталог
+        auto randomPath = [&random, &live]()
+        {
+            const QStringList parts = live[random.bounded(live.size())].split('/', QString::SkipEmptyParts);
+            return "/" + parts.mid(0, random.bounded(2, parts.size() + 1)).join('/');
+        };
+        PathChange change;
+        change.from = randomPath();
+        change.queuedAt = -1;
+        const quint32 op = random.bounded(100u);
+        if (op >= 10)
+        {
+            // переименование в своем каталоге или перемещение в другой, не лежащий под перемещаемым
+            QString dir = ModifiedFileSystemWatcher::parentPath(change.from);
+            if (op >= 60)
+            {
+                const QString other = ModifiedFileSystemWatcher::parentPath(randomPath());
+                if (other != change.from && !other.startsWith(change.from + "/") && other.startsWith("/data"))
+                {
+                    dir = other;
+                }
+            }
+            change.to = dir + "/n" + QString::number(fresh++);
+        }
+        applyToModel(model, change);
+        changes.append(change);
+    }
+
+    auto watcher = makeWatcher(&lanePool, connections);
+    QVERIFY(applyAll(*watcher, changes, 50));
+    QCOMPARE(readRows(db.data()), model);
+}
+
+
+void DbIntegrationTest::applyThroughput_data()
+{
+    QTest::addColumn <qint32> ("connections");
+    for (qint32 connections : {0, 1, 2, 4, 8})
+    {
+        QTest::addRow("connections=%d", connections) << connections;
+    }
+}
+
+// время записи пакета независимых переименований в зависимости от числа подключений записи
+void DbIntegrationTest::applyThroughput()
+{
+    QFETCH(qint32, connections);
+    DbConnectionPool lanePool(connectionData(), connections + 1);
+    auto db = pool->acquire();
+    QMap <qint32, QString> model = fillTree(db.data(), 32, 8, 8);
+
+    QVector <PathChange> changes;
+    for (const auto& i : model)
+    {
+        PathChange change;
+        change.from = ModifiedFileSystemWatcher::normalizedPath(i);
+        change.to = change.from + "_renamed";
+        change.queuedAt = -1;
+        changes.append(change);
+    }
+    for (const auto& i : changes)
+    {
+        applyToModel(model, i);
+    }
+
+    auto watcher = makeWatcher(&lanePool, connections);
+    QElapsedTimer clock;
+    clock.start();
+    QVERIFY(applyAll(*watcher, changes, WatcherSettings().dbBatchSize));
+    QTest::setBenchmarkResult(clock.elapsed(), QTest::WalltimeMilliseconds);
+    QCOMPARE(readRows(db.data()), model);
+}
+
+
+// два экземпляра PostgreSQL с потоковой репликацией поднимает tests/replica_lag_test.sh,
+// он же передает команды обрыва и восстановления репликации
+void DbIntegrationTest::replicaLag()
+{
+    if (!qEnvironmentVariableIsSet("PGREPLICAPORT"))
+    {
+        QSKIP("PGREPLICAPORT is not set, run tests/replica_lag_test.sh");
+    }
+    ConnectionData replicaData = connectionData();
+    replicaData.port = qEnvironmentVariableIntValue("PGREPLICAPORT");
+    ReplicaProbe db;
+    // отставание проверяется при каждом чтении
+    db.setReplica(replicaData, 1000, 0);
+    db.connectDb(connectionData());
+    auto readsReplica = [&db]() {return db.getSomeInfo("SELECT pg_is_in_recovery()").toBool();};
+    auto write = [this]()
+    {
+        pool->acquire()->execParams(QString("INSERT INTO %1 (filepath) VALUES ('/lag/')").arg(testTable), {});
+        return true;
+    };
+
+    write();
+    QTRY_VERIFY_WITH_TIMEOUT(readsReplica(), 10000);
+
+    // простаивающий основной сервер пишет в журнал только служебные записи: время последней
+    // транзакции на реплике стареет, но отставания нет
+    QTest::qWait(1500);
+    pool->acquire()->execParams("CHECKPOINT", {});
+    QVERIFY(readsReplica());
+
+    // реплика больше ничего не получает: ее полученный журнал равен примененному,
+    // но основной сервер уходит вперед, и чтение должно вернуться на него
+    QCOMPARE(QProcess::execute("sh", {"-c", qEnvironmentVariable("DBTEST_BREAK_REPLICATION")}), 0);
+    QTRY_VERIFY_WITH_TIMEOUT(write() && !readsReplica(), 10000);
+
+    QCOMPARE(QProcess::execute("sh", {"-c", qEnvironmentVariable("DBTEST_RESTORE_REPLICATION")}), 0);
+    QTRY_VERIFY_WITH_TIMEOUT(readsReplica(), 30000);
+}
+
+
+QTEST_GUILESS_MAIN(DbIntegrationTest)
+#include "dbtests.moc"
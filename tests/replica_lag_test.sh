@@ -0,0 +1,54 @@
+#!/bin/sh
+# проверка отставания реплики (Database::checkReplica) на двух локальных экземплярах PostgreSQL 9.6:
+# во временном каталоге поднимаются основной сервер и потоковая реплика, затем выполняется
+# dbfilewatcher_dbtest replicaLag. Обрыв репликации - запрет подключения репликации в pg_hba.conf
+# основного сервера и завершение walsender.
+# Использование: tests/replica_lag_test.sh путь/к/dbfilewatcher_dbtest [каталог bin PostgreSQL]
+set -eu
+
+TEST_BIN=$1
+PGBIN=${2:-$(dirname "$(command -v pg_ctl)")}
+PRIMARY_PORT=${PRIMARY_PORT:-55432}
+REPLICA_PORT=${REPLICA_PORT:-55433}
+WORK=$(mktemp -d)
+
+cleanup()
+{
+    "$PGBIN/pg_ctl" -D "$WORK/replica" -m immediate stop >/dev/null 2>&1 || true
+    "$PGBIN/pg_ctl" -D "$WORK/primary" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+"$PGBIN/initdb" -D "$WORK/primary" -U postgres -A trust >/dev/null
+cat >> "$WORK/primary/postgresql.conf" <<EOF
+port = $PRIMARY_PORT
+listen_addresses = 'localhost'
+unix_socket_directories = '$WORK'
+wal_level = replica
+max_wal_senders = 4
+hot_standby = on
+EOF
+cp "$WORK/primary/pg_hba.conf" "$WORK/pg_hba.broken"
+cp "$WORK/primary/pg_hba.conf" "$WORK/pg_hba.streaming"
+echo "host replication postgres 127.0.0.1/32 trust" >> "$WORK/pg_hba.streaming"
+echo "host replication postgres ::1/128 trust" >> "$WORK/pg_hba.streaming"
+cp "$WORK/pg_hba.streaming" "$WORK/primary/pg_hba.conf"
+"$PGBIN/pg_ctl" -D "$WORK/primary" -w -l "$WORK/primary.log" start >/dev/null
+
+"$PGBIN/pg_basebackup" -h localhost -p "$PRIMARY_PORT" -U postgres -D "$WORK/replica" -R -X stream
+cat >> "$WORK/replica/postgresql.conf" <<EOF
+port = $REPLICA_PORT
+wal_retrieve_retry_interval = 500
+EOF
+"$PGBIN/pg_ctl" -D "$WORK/replica" -w -l "$WORK/replica.log" start >/dev/null
+
+PSQL="\"$PGBIN/psql\" -h localhost -p $PRIMARY_PORT -U postgres -Atq postgres"
+export DBTEST_BREAK_REPLICATION="cp '$WORK/pg_hba.broken' '$WORK/primary/pg_hba.conf' \
+&& \"$PGBIN/pg_ctl\" -D '$WORK/primary' reload >/dev/null \
+&& $PSQL -c 'SELECT pg_terminate_backend(pid) FROM pg_stat_replication' >/dev/null"
+export DBTEST_RESTORE_REPLICATION="cp '$WORK/pg_hba.streaming' '$WORK/primary/pg_hba.conf' \
+&& \"$PGBIN/pg_ctl\" -D '$WORK/primary' reload >/dev/null"
+
+PGHOST=localhost PGPORT=$PRIMARY_PORT PGREPLICAPORT=$REPLICA_PORT PGDATABASE=postgres PGUSER=postgres \
+    "$TEST_BIN" replicaLag
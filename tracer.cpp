@@ -0,0 +1,177 @@
+#include "tracer.h"
+#include <QThread>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QCoreApplication>
+#include <QRandomGenerator>
+
+std::atomic <bool> Tracer::enabled {false};
+double Tracer::sampleRate = 1;
+qint64 Tracer::windowEnd = 0;
+qint32 Tracer::bufferSize = 100000;
+QElapsedTimer Tracer::clock;
+QMutex Tracer::registryMutex;
+QVector <QSharedPointer <Tracer::Buffer>> Tracer::buffers;
+
+thread_local QSharedPointer <Tracer::Buffer> Tracer::localBuffer;
+thread_local qint32 Tracer::chainDepth = 0;
+thread_local bool Tracer::chainIsSampled = false;
+
+
+void Tracer::enable(double _sampleRate, qint32 window, qint32 _bufferSize)
+{
+    QMutexLocker lock(&registryMutex);
+    sampleRate = qBound(0.0, _sampleRate, 1.0);
+    bufferSize = qMax(_bufferSize, 1);
+    if (!clock.isValid())
+    {
+        clock.start();
+    }
+    windowEnd = window > 0 ? clock.nsecsElapsed() / 1000 + static_cast <qint64> (window) * 1000 : 0;
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+qint64 Tracer::now()
+{
+    return clock.isValid() ? clock.nsecsElapsed() / 1000 : 0;
+}
+
+Tracer::Buffer* Tracer::threadBuffer()
+{
+    if (!localBuffer)
+    {
+        localBuffer = QSharedPointer <Buffer>::create();
+        localBuffer->threadName = QThread::currentThread()->objectName();
+        QMutexLocker lock(&registryMutex);
+        localBuffer->threadId = buffers.size() + 1;
+        if (localBuffer->threadName.isEmpty())
+        {
+            localBuffer->threadName = QString("thread %1").arg(localBuffer->threadId);
+        }
+        buffers.append(localBuffer);
+    }
+    return localBuffer.data();
+}
+
+bool Tracer::beginChain()
+{
+    if (chainDepth++ == 0)
+    {
+        chainIsSampled = sampleRate >= 1 || QRandomGenerator::global()->generateDouble() < sampleRate;
+    }
+    return chainIsSampled;
+}
+
+void Tracer::endChain()
+{
+    --chainDepth;
+}
+
+bool Tracer::chainSampled()
+{
+    if (chainDepth > 0)
+    {
+        return chainIsSampled;
+    }
+    return sampleRate >= 1 || QRandomGenerator::global()->generateDouble() < sampleRate;
+}
+
+void Tracer::complete(const char* name, const char* category, qint64 start, qint64 duration, const QString& arg)
+{
+    if (!isEnabled() || !chainSampled())
+    {
+        return;
+    }
+    if (windowEnd != 0 && start > windowEnd)
+    {
+        enabled.store(false, std::memory_order_relaxed);
+        return;
+    }
+    Buffer* buffer = threadBuffer();
+    QMutexLocker lock(&buffer->mutex);
+    if (buffer->events.size() >= bufferSize)
+    {
+        ++buffer->dropped;
+        return;
+    }
+    buffer->events.append(Event {name, category, start, duration, arg});
+}
+
+qint64 Tracer::droppedCount()
+{
+    QMutexLocker lock(&registryMutex);
+    qint64 dropped = 0;
+    for (const auto& i : buffers)
+    {
+        QMutexLocker bufferLock(&i->mutex);
+        dropped += i->dropped;
+    }
+    return dropped;
+}
+
+bool Tracer::exportJson(const QString& fileName)
+{
+    const qint64 pid = QCoreApplication::applicationPid();
+    QJsonArray traceEvents;
+    {
+        QMutexLocker lock(&registryMutex);
+        for (const auto& buffer : buffers)
+        {
+            QVector <Event> events;
+            {
+                QMutexLocker bufferLock(&buffer->mutex);
+                events.swap(buffer->events);
+            }
+            traceEvents.append(QJsonObject {{"ph", "M"}, {"name", "thread_name"}, {"pid", pid},
+                                            {"tid", buffer->threadId},
+                                            {"args", QJsonObject {{"name", buffer->threadName}}}});
+            for (const auto& i : events)
+            {
+                QJsonObject event {{"ph", "X"}, {"name", i.name}, {"cat", i.category}, {"pid", pid},
+                                   {"tid", buffer->threadId}, {"ts", i.start}, {"dur", i.duration}};
+                if (!i.arg.isEmpty())
+                {
+                    event.insert("args", QJsonObject {{"path", i.arg}});
+                }
+                traceEvents.append(event);
+            }
+        }
+    }
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+    QJsonObject root {{"traceEvents", traceEvents}, {"displayTimeUnit", "ms"}};
+    return file.write(QJsonDocument(root).toJson(QJsonDocument::Compact)) != -1;
+}
+
+
+TraceSpan::TraceSpan(const char* _name, const char* _category, const QString& _arg) :
+    name(_name), category(_category)
+{
+    if (!Tracer::isEnabled())
+    {
+        return;
+    }
+    chained = true;
+    if (Tracer::beginChain())
+    {
+        arg = _arg;
+        start = Tracer::now();
+    }
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (start >= 0)
+    {
+        Tracer::complete(name, category, start, Tracer::now() - start, arg);
+    }
+    if (chained)
+    {
+        Tracer::endChain();
+    }
+}
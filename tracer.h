@@ -0,0 +1,114 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QString>
+#include <QVector>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <atomic>
+
+// трассировка этапов обработки событий (уведомление, чтение каталога, передача в очередь,
+// запросы к БД, фиксация) с выгрузкой в формате Chrome trace event (chrome://tracing, Perfetto).
+// По умолчанию выключена: проверка сводится к чтению одного флага.
+// События пишутся в буфер своего потока, общая блокировка берется только при выгрузке
+class Tracer
+{
+public:
+    // sampleRate - доля трассируемых цепочек (0..1); window - сколько мс писать после включения, 0 - без ограничения;
+    // bufferSize - максимум событий в буфере одного потока
+    static void enable(double sampleRate, qint32 window = 0, qint32 bufferSize = 100000);
+
+    static void disable() {enabled.store(false, std::memory_order_relaxed);}
+
+    static bool isEnabled() {return enabled.load(std::memory_order_relaxed);}
+
+    // мкс с момента включения
+    static qint64 now();
+
+    // законченный интервал; учитывается выборка текущей цепочки потока
+    static void complete(const char* name, const char* category, qint64 start, qint64 duration,
+                         const QString& arg = QString());
+
+    // выгружает и очищает накопленные события; false при ошибке записи файла
+    static bool exportJson(const QString& fileName);
+
+    static qint64 droppedCount();
+
+private:
+    friend class TraceSpan;
+
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        qint64 start;
+        qint64 duration;
+        QString arg;
+    };
+
+    struct Buffer
+    {
+        QMutex mutex;
+        qint32 threadId = 0;
+        QString threadName;
+        QVector <Event> events;
+        qint64 dropped = 0;
+    };
+
+    static Buffer* threadBuffer();
+
+    // внешний интервал потока решает, попадет ли вся вложенная цепочка в выборку
+    static bool beginChain();
+
+    static void endChain();
+
+    static bool chainSampled();
+
+    static thread_local QSharedPointer <Buffer> localBuffer;
+
+    static thread_local qint32 chainDepth;
+
+    static thread_local bool chainIsSampled;
+
+    static std::atomic <bool> enabled;
+
+    static double sampleRate;
+
+    static qint64 windowEnd;
+
+    static qint32 bufferSize;
+
+    static QElapsedTimer clock;
+
+    static QMutex registryMutex;
+
+    static QVector <QSharedPointer <Buffer>> buffers;
+};
+
+
+// интервал этапа от создания до уничтожения
+class TraceSpan
+{
+public:
+    TraceSpan(const char* _name, const char* _category, const QString& _arg = QString());
+
+    TraceSpan(const TraceSpan&)                   = delete;
+
+    TraceSpan(TraceSpan&& )                       = delete;
+
+    TraceSpan& operator=(const TraceSpan&)        = delete;
+
+    TraceSpan& operator=(TraceSpan&&)             = delete;
+
+    ~TraceSpan();
+
+private:
+    const char* name;
+    const char* category;
+    QString arg;
+    qint64 start = -1;
+    bool chained = false;
+};
+
+#endif // TRACER_H
@@ -0,0 +1,210 @@
+#ifndef TYPEDRECORD_H
+#define TYPEDRECORD_H
+
+#include <QString>
+#include <QByteArray>
+#include <QDateTime>
+#include <QHash>
+#include <QMutex>
+#include <QVector>
+#include <array>
+#include <tuple>
+#include <utility>
+
+// текстовое представление параметра для libpq без QVariant; NULL - пустой QByteArray
+inline QByteArray pgText(const QString& value) {return value.isNull() ? QByteArray() : value.toUtf8();}
+
+inline QByteArray pgText(qint32 value) {return QByteArray::number(value);}
+
+inline QByteArray pgText(qint64 value) {return QByteArray::number(value);}
+
+inline QByteArray pgText(double value) {return QByteArray::number(value, 'g', 17);}
+
+inline QByteArray pgText(bool value) {return value ? "t" : "f";}
+
+inline QByteArray pgText(const QDateTime& value)
+{
+    return value.isNull() ? QByteArray() : value.toString(Qt::ISODateWithMs).toUtf8();
+}
+
+
+enum class ColumnRole
+{
+    Key,    // условие WHERE
+    Set     // изменяемое значение
+};
+
+template <ColumnRole R, typename T>
+struct TypedColumn
+{
+    using Type = T;
+    static constexpr ColumnRole role = R;
+};
+
+template <typename T>
+using KeyColumn = TypedColumn <ColumnRole::Key, T>;
+
+template <typename T>
+using SetColumn = TypedColumn <ColumnRole::Set, T>;
+
+
+// запись с постоянным составом столбцов - быстрая замена DbRecord для запросов, выполняемых постоянно.
+// Состав, типы и роли столбцов задаются параметрами шаблона, имена - в наследнике:
+//
+//     struct FilepathUpdate : TypedRecord <FilepathUpdate, SetColumn <QString>, KeyColumn <QString>>
+//     {
+//         using TypedRecord::TypedRecord;
+//         static const char* const* columnNames() {static const char* const names[] = {"filepath", "filepath"}; return names;}
+//     };
+//
+// Текст запроса строится один раз на тип и таблицу, параметр $N соответствует N-му столбцу записи.
+// Значения кодируются сразу в текст libpq, без QVariant и поиска полей по имени
+template <typename Record, typename... Columns>
+class TypedRecord
+{
+public:
+    static constexpr size_t columnCount = sizeof...(Columns);
+
+    using Values = std::tuple <typename Columns::Type...>;
+
+    using Params = std::array <QByteArray, columnCount>;
+
+    TypedRecord() = default;
+
+    explicit TypedRecord(typename Columns::Type... _values) : values(std::move(_values)...) {}
+
+    template <size_t I>
+    typename std::tuple_element <I, Values>::type& get() {return std::get <I> (values);}
+
+    template <size_t I>
+    const typename std::tuple_element <I, Values>::type& get() const {return std::get <I> (values);}
+
+    // значения в порядке столбцов для Database::execParams / DbPipeline::addEncoded
+    Params params() const
+    {
+        return encode(std::index_sequence_for <Columns...> ());
+    }
+
+    // INSERT INTO таблица (все столбцы) VALUES ($1, ...)
+    static const QByteArray& insertText(const QString& tableName)
+    {
+        return cachedText(tableName, Insert);
+    }
+
+    // UPDATE таблица SET столбцы Set WHERE столбцы Key [RETURNING Record::returning()]
+    static const QByteArray& updateText(const QString& tableName)
+    {
+        return cachedText(tableName, Update);
+    }
+
+    // DELETE FROM таблица WHERE столбцы Key
+    static const QByteArray& deleteText(const QString& tableName)
+    {
+        return cachedText(tableName, Delete);
+    }
+
+    // INSERT ... ON CONFLICT (столбцы Key) DO UPDATE SET столбцы Set; на Key нужен уникальный индекс
+    static const QByteArray& upsertText(const QString& tableName)
+    {
+        return cachedText(tableName, Upsert);
+    }
+
+    // список RETURNING запроса обновления; наследник может переопределить
+    static const char* returning() {return nullptr;}
+
+private:
+    enum Kind
+    {
+        Insert,
+        Update,
+        Delete,
+        Upsert
+    };
+
+    template <size_t... I>
+    Params encode(std::index_sequence <I...>) const
+    {
+        return Params {{pgText(std::get <I> (values))...}};
+    }
+
+    static QByteArray buildText(const QString& tableName, Kind kind)
+    {
+        static constexpr ColumnRole roles[] = {Columns::role...};
+        const char* const* names = Record::columnNames();
+        QByteArray text;
+        QByteArray sets;
+        QByteArray keys;
+        QByteArray columns;
+        QByteArray placeholders;
+        QByteArray keyColumns;
+        QByteArray excluded;
+        for (size_t i = 0; i < columnCount; i++)
+        {
+            const QByteArray placeholder = "$" + QByteArray::number(static_cast <qint32> (i + 1));
+            QByteArray& target = roles[i] == ColumnRole::Key ? keys : sets;
+            if (!target.isEmpty())
+            {
+                target.append(roles[i] == ColumnRole::Key ? " AND " : ", ");
+            }
+            target.append(names[i]).append(" = ").append(placeholder);
+            columns.append(i == 0 ? "" : ", ").append(names[i]);
+            placeholders.append(i == 0 ? "" : ", ").append(placeholder);
+            if (roles[i] == ColumnRole::Key)
+            {
+                keyColumns.append(keyColumns.isEmpty() ? "" : ", ").append(names[i]);
+            }
+            else
+            {
+                excluded.append(excluded.isEmpty() ? "" : ", ").append(names[i]).append(" = EXCLUDED.").append(names[i]);
+            }
+        }
+        switch (kind)
+        {
+        case Insert:
+            text = "INSERT INTO " + tableName.toUtf8() + " (" + columns + ") VALUES (" + placeholders + ")";
+            break;
+        case Update:
+            text = "UPDATE " + tableName.toUtf8() + " SET " + sets;
+            if (!keys.isEmpty())
+            {
+                text.append(" WHERE ").append(keys);
+            }
+            if (Record::returning() != nullptr)
+            {
+                text.append(" RETURNING ").append(Record::returning());
+            }
+            break;
+        case Delete:
+            text = "DELETE FROM " + tableName.toUtf8();
+            if (!keys.isEmpty())
+            {
+                text.append(" WHERE ").append(keys);
+            }
+            break;
+        case Upsert:
+            text = "INSERT INTO " + tableName.toUtf8() + " (" + columns + ") VALUES (" + placeholders + ")"
+                    + " ON CONFLICT (" + keyColumns + ") DO " + (excluded.isEmpty() ? "NOTHING" : "UPDATE SET " + excluded);
+            break;
+        }
+        return text;
+    }
+
+    // тексты не удаляются, поэтому ссылка остается действительной после освобождения мьютекса
+    static const QByteArray& cachedText(const QString& tableName, Kind kind)
+    {
+        static QMutex mutex;
+        static QHash <QString, QByteArray> texts[4];
+        QMutexLocker lock(&mutex);
+        QHash <QString, QByteArray>& cache = texts[kind];
+        auto it = cache.find(tableName);
+        if (it == cache.end())
+        {
+            it = cache.insert(tableName, buildText(tableName, kind));
+        }
+        return *it;
+    }
+
+    Values values;
+};
+
+#endif // TYPEDRECORD_H
@@ -40,4 +40,21 @@ QString translate (const QString& from, bool inverted)
     return result;
 
 }
+
+QString toPgArray (const QStringList& values)
+{
+    QString result = "{";
+    for (const auto& i : values)
+    {
+        QString escaped = i;
+        escaped.replace("\\", "\\\\").replace("\"", "\\\"");
+        result.append("\"" + escaped + "\",");
+    }
+    if (result.size() > 1)
+    {
+        result.chop(1);
+    }
+    result.append("}");
+    return result;
+}
 }
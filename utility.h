@@ -2,9 +2,13 @@
 #define UTILITY_H
 #include <QString>
 #include <QVector>
+#include <QStringList>
 namespace Utility {
 
 QString translate (const QString& from, bool inverted = false);
+
+// литерал массива PostgreSQL ({"a","b"}) для передачи списка одним параметром
+QString toPgArray (const QStringList& values);
 }
 
 
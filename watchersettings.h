@@ -0,0 +1,57 @@
+#ifndef WATCHERSETTINGS_H
+#define WATCHERSETTINGS_H
+
+#include <QtGlobal>
+#include <QString>
+
+// настройки наблюдения, общие для всех корней
+struct WatcherSettings
+{
+    // потоков наблюдения на корень; каталоги распределяются между ними по хэшу пути
+    qint32 shards = 1;
+    // период обновления списка путей из БД, мс
+    qint32 refreshInterval = 60000;
+    // максимум изменений в очереди до записи в БД; при переполнении удаления отбрасываются,
+    // а их каталог уходит на повторную сверку
+    qint32 queueCapacity = 10000;
+    // изменений путей в секунду на корень, 0 - без ограничения
+    double dbWriteRate = 200;
+    // изменений в одном конвейере запросов
+    qint32 dbBatchSize = 100;
+    // дополнительных подключений наблюдателя для параллельной записи изменений по хэшу каталога,
+    // 0 - изменения пишутся через основное подключение наблюдателя
+    qint32 applyConnections = 0;
+    // период разбора очереди, мс
+    qint32 drainInterval = 100;
+    // потоков проверки существования файлов при сверке с БД, 0 - сверка отключена (по умолчанию:
+    // сверка помечает строки удаленными)
+    qint32 reconcileWorkers = 0;
+    // проверок файлов в секунду при сверке
+    double reconcileRate = 50;
+    // пауза между проходами сверки, мс
+    qint32 reconcileInterval = 3600000;
+    // задержка перед пометкой отсутствующего файла, чтобы успели примениться переименования из очереди, мс
+    qint32 reconcileGraceTime = 30000;
+    // снимки каталогов только по именам из БД (экономия памяти на больших каталогах)
+    bool filteredSnapshots = false;
+    // период сверки отфильтрованных снимков с каталогами, мс, 0 - без сверки
+    qint32 snapshotVerifyInterval = 600000;
+    // предел числа имен в снимках каталогов одного наблюдателя, 0 - без предела
+    qint32 snapshotLimit = 500000;
+    // окно сопоставления удаления и появления файла в разных каталогах как перемещения, мс, 0 - отключено
+    qint32 moveWindow = 2000;
+    // таблица размеров и времен изменения записанных файлов, пусто - не отслеживаются
+    QString metadataTable;
+    // сколько мс размер и время изменения файла должны не меняться, чтобы запись считалась законченной
+    qint32 settleTime = 5000;
+    // частей пространства путей для распределения между экземплярами, 0 - экземпляр наблюдает все
+    qint32 partitions = 0;
+    // ключ рекомендательных блокировок: (ключ, 0) - живые экземпляры, (ключ + 1, часть) - владелец части
+    qint32 partitionLockKey = 0x4446;
+    // период проверки экземпляров и перераспределения частей, мс
+    qint32 partitionCheckInterval = 10000;
+    // срок одного обращения к файловой системе, мс, после него точка монтирования считается зависшей, 0 - без срока
+    qint32 fsTimeout = 5000;
+};
+
+#endif // WATCHERSETTINGS_H
@@ -0,0 +1,64 @@
+#ifndef WATCHROOT_H
+#define WATCHROOT_H
+
+#include <QString>
+#include <QVector>
+
+// корень наблюдения: локальный префикс (шара камеры) и соответствующий ему префикс путей в БД
+struct WatchRoot
+{
+    QString localPrefix;
+    QString dbPrefix;
+
+    // "//Camera20/DATA/" или "//Camera20/DATA/=Camera20/"
+    static WatchRoot fromString(const QString& str)
+    {
+        WatchRoot root;
+        int pos = str.indexOf("=");
+        if (pos == -1)
+        {
+            root.localPrefix = str;
+        }
+        else
+        {
+            root.localPrefix = str.left(pos);
+            root.dbPrefix = str.mid(pos + 1);
+        }
+        if (!root.localPrefix.endsWith("/"))
+        {
+            root.localPrefix.append("/");
+        }
+        if (!root.dbPrefix.isEmpty() && !root.dbPrefix.endsWith("/"))
+        {
+            root.dbPrefix.append("/");
+        }
+        return root;
+    }
+
+    bool ownsLocalPath(const QString& localPath) const
+    {
+        return localPath.startsWith(localPrefix);
+    }
+
+    QString toDbPath(const QString& localPath) const
+    {
+        if (!ownsLocalPath(localPath))
+        {
+            return localPath;
+        }
+        return dbPrefix + localPath.mid(localPrefix.size());
+    }
+
+    QString toLocalPath(const QString& dbPath) const
+    {
+        if (!dbPrefix.isEmpty() && dbPath.startsWith(dbPrefix))
+        {
+            return localPrefix + dbPath.mid(dbPrefix.size());
+        }
+        return localPrefix + dbPath;
+    }
+};
+
+using WatchRoots = QVector <WatchRoot>;
+
+#endif // WATCHROOT_H
@@ -0,0 +1,122 @@
+#include "watchservice.h"
+
+constexpr const qint32 retryInterval = 10000;
+// ожидание подключений для параллельной записи; недостающие не ждем, наблюдатель работает с меньшим числом
+constexpr const qint32 applyAcquireTimeout = 5000;
+
+void RootWorker::start()
+{
+    try
+    {
+        watcher.reset(new DbFileSystemWatcher(pool->acquire(), root, settings));
+    }
+    catch (std::exception& e)
+    {
+        ModifiedFileSystemWatcher::writeLog("DB ERROR: " + root.localPrefix + ": " + QString(e.what()));
+        QTimer::singleShot(retryInterval, this, &RootWorker::start);
+        return;
+    }
+    watcher->setShard(shard, settings.shards);
+    watcher->setFetchPool(pool);
+    if (settings.applyConnections > 0)
+    {
+        QVector <QSharedPointer <DbFileWatcher>> connections;
+        while (connections.size() < settings.applyConnections)
+        {
+            QSharedPointer <DbFileWatcher> conn;
+            try
+            {
+                conn = pool->tryAcquire(applyAcquireTimeout);
+            }
+            catch (std::exception& e)
+            {
+                ModifiedFileSystemWatcher::writeLog("DB ERROR: " + root.localPrefix + ": " + QString(e.what()));
+            }
+            if (!conn)
+            {
+                ModifiedFileSystemWatcher::writeLog(QString("Pool exhausted: %1 of %2 apply connections for %3")
+                                                    .arg(connections.size()).arg(settings.applyConnections).arg(root.localPrefix));
+                break;
+            }
+            connections.append(conn);
+        }
+        watcher->setApplyConnections(connections);
+    }
+    if (coordinator != nullptr)
+    {
+        watcher->setPartitionCoordinator(coordinator);
+        // смена частей применяется сразу, не дожидаясь очередного обновления
+        connect(coordinator, &PartitionCoordinator::partitionsChanged, watcher.data(), &DbFileSystemWatcher::updateWatchPath);
+    }
+    if (publisher != nullptr)
+    {
+        // издатель живет в главном потоке, события уходят ему через очередь
+        connect(watcher.data(), &DbFileSystemWatcher::added, publisher, &EventPublisher::publishAdded);
+        connect(watcher.data(), &DbFileSystemWatcher::deleted, publisher, &EventPublisher::publishDeleted);
+        connect(watcher.data(), &DbFileSystemWatcher::renamed, publisher, &EventPublisher::publishRenamed);
+    }
+    timer = new QTimer(this);
+    timer->setInterval(settings.refreshInterval);
+    connect(timer, &QTimer::timeout, watcher.data(), &DbFileSystemWatcher::updateWatchPath);
+    QTimer::singleShot(0, watcher.data(), &DbFileSystemWatcher::updateWatchPath);
+    timer->start();
+
+    // сверка проходит по всему корню (или по частям экземпляра), поэтому одна на корень
+    if (settings.reconcileWorkers > 0 && shard == 0)
+    {
+        reconciler.reset(new Reconciler(pool, root, settings, coordinator));
+        reconciler->start(QThread::LowPriority);
+    }
+}
+
+void RootWorker::stop()
+{
+    if (timer != nullptr)
+    {
+        timer->stop();
+    }
+    if (reconciler)
+    {
+        reconciler->requestInterruption();
+        reconciler->wait();
+        reconciler.reset();
+    }
+    // подключение возвращается в пул до завершения потока
+    watcher.reset();
+}
+
+
+void WatchService::start()
+{
+    for (const auto& root : roots)
+    {
+        for (qint32 shard = 0; shard < qMax(settings.shards, 1); shard++)
+        {
+            QThread* thread = new QThread(this);
+            RootWorker* worker = new RootWorker(pool, root, settings, shard, publisher, coordinator);
+            worker->moveToThread(thread);
+            connect(thread, &QThread::started, worker, &RootWorker::start);
+            connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+            threads.append(thread);
+            workers.append(worker);
+            thread->start();
+        }
+    }
+}
+
+void WatchService::stop()
+{
+    for (int i = 0; i < threads.size(); i++)
+    {
+        QMetaObject::invokeMethod(workers[i], "stop", Qt::BlockingQueuedConnection);
+        threads[i]->quit();
+        threads[i]->wait();
+    }
+    threads.clear();
+    workers.clear();
+}
+
+WatchService::~WatchService()
+{
+    stop();
+}
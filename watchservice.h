@@ -0,0 +1,81 @@
+#ifndef WATCHSERVICE_H
+#define WATCHSERVICE_H
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+#include <QScopedPointer>
+#include <modifiedfilesystemwatcher.h>
+#include <connectionpool.h>
+#include <watchroot.h>
+#include <reconciler.h>
+#include <eventpublisher.h>
+#include <partitioncoordinator.h>
+
+// обработчик одного корня наблюдения (или его части при settings.shards > 1),
+// живет в собственном потоке: медленная шара не задерживает обработку событий остальных корней
+class RootWorker : public QObject
+{
+    Q_OBJECT
+public:
+    RootWorker(DbConnectionPool* _pool, const WatchRoot& _root, const WatcherSettings& _settings, qint32 _shard = 0,
+               EventPublisher* _publisher = nullptr, PartitionCoordinator* _coordinator = nullptr) :
+        pool(_pool), root(_root), settings(_settings), shard(_shard), publisher(_publisher), coordinator(_coordinator) {}
+
+public slots:
+    void start();
+
+    void stop();
+
+private:
+    DbConnectionPool* pool;
+    WatchRoot root;
+    WatcherSettings settings;
+    qint32 shard;
+    EventPublisher* publisher;
+    PartitionCoordinator* coordinator;
+    QScopedPointer <DbFileSystemWatcher> watcher;
+    QScopedPointer <Reconciler> reconciler;
+    QTimer* timer = nullptr;
+};
+
+
+class WatchService : public QObject
+{
+    Q_OBJECT
+public:
+    WatchService(DbConnectionPool* _pool, const WatchRoots& _roots, const WatcherSettings& _settings, QObject* parent = nullptr) :
+        QObject(parent), pool(_pool), roots(_roots), settings(_settings) {}
+
+    WatchService(const WatchService&)                   = delete;
+
+    WatchService(WatchService&& )                       = delete;
+
+    WatchService& operator=(const WatchService&)        = delete;
+
+    WatchService& operator=(WatchService&&)             = delete;
+
+    // события всех корней дополнительно рассылаются подписчикам; задать до start()
+    void setPublisher(EventPublisher* _publisher) {publisher = _publisher;}
+
+    // корни наблюдаются только в частях путей этого экземпляра; задать до start()
+    void setPartitionCoordinator(PartitionCoordinator* _coordinator) {coordinator = _coordinator;}
+
+    void start();
+
+    void stop();
+
+    ~WatchService();
+
+private:
+    DbConnectionPool* pool;
+    WatchRoots roots;
+    WatcherSettings settings;
+    EventPublisher* publisher = nullptr;
+    PartitionCoordinator* coordinator = nullptr;
+    QVector <QThread*> threads;
+    QVector <RootWorker*> workers;
+};
+
+#endif // WATCHSERVICE_H